@@ -0,0 +1,88 @@
+// Counts heap allocations made by the event loop once it has warmed up. Each
+// iteration re-arms a timeout, passes a byte through a pipe, and queues a
+// callback with runLater(). This is what a busy loop looks like in steady
+// state, and it should not allocate at all.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#include "event.h"
+
+static std::atomic<unsigned long> allocations = { 0 };
+
+void *operator new(size_t size) {
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  free(ptr);
+}
+
+static long steadyState(Event::Backend backend, int warmup, int iterations) {
+  Event event(backend);
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    return -1;
+  }
+  // A few timers that never fire keep the heap non-trivial
+  for (int i = 0; i < 100; i++) {
+    event.addTimeout(3600*1000 + i, []() { });
+  }
+  int count = 0;
+  unsigned long start = 0;
+  Event::Handle idle;
+  event.addPollFd(fds[0], POLLIN, [&]() {
+    char ch;
+    if (read(fds[0], &ch, 1) != 1) {
+      event.exitLoop();
+      return;
+    }
+    if (++count == warmup) {
+      start = allocations;
+    } else if (count == warmup + iterations) {
+      event.exitLoop();
+      return;
+    }
+    // Cancel and re-arm a timeout, the way a watchdog would
+    event.removeTimeout(idle);
+    idle = event.addTimeout(1000, [&]() { event.exitLoop(); });
+    event.runLater([&]() {
+      if (write(fds[1], "", 1) != 1) {
+        event.exitLoop();
+      }
+    });
+  });
+  if (write(fds[1], "", 1) == 1) {
+    event.loop();
+  }
+  const long result = count == warmup + iterations
+                      ? (long)(allocations - start) : -1;
+  event.removePollFd(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+  return result;
+}
+
+int main() {
+  static const int iterations = 100000;
+  printf("%10s %14s %14s\n", "backend", "iterations", "allocations");
+  const long poll = steadyState(Event::BACKEND_POLL, 1000, iterations);
+  const long epoll = steadyState(Event::BACKEND_EPOLL, 1000, iterations);
+  printf("%10s %14d %14ld\n", "ppoll", iterations, poll);
+  printf("%10s %14d %14ld\n", "epoll", iterations, epoll);
+  return poll || epoll;
+}
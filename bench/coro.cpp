@@ -0,0 +1,193 @@
+// Runs HID++ flows as coroutines on a single event loop: device name
+// enumeration on several fake receivers at once, feature lookups on every
+// paired device, and a loop that waits for keys. Checks that sending a DJ
+// report, which never gets a response, finishes right away. Then counts
+// heap allocations per co_await for each of the awaitable primitives, once
+// coroutine frames have been recycled. Needs "make STD=gnu++20".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#include "coro.h"
+
+#if !defined(HAVE_COROUTINES)
+
+int main() {
+  printf("Coroutines aren't supported by this compiler. "
+         "Try \"make STD=gnu++20\".\n");
+  return 0;
+}
+
+#else
+
+#include "faketransport.h"
+
+static std::atomic<unsigned long> allocations = { 0 };
+
+void *operator new(size_t size) {
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  free(ptr);
+}
+
+static void run(Event *event, bool *done) {
+  while (!*done) {
+    event->runOnce();
+  }
+}
+
+static Task<int> readNames(Harmony *harmony, int receiver) {
+  // Each name is a separate request, but all receivers enumerate at once
+  int names = 0;
+  for (int i = 0; i < 6; i++) {
+    const unsigned char buf[7] = { 0x10, 0xFF, 0x83, 0xB5,
+                                   (unsigned char)(0x40 + i) };
+    const Coro::Response rsp = co_await Coro::request(harmony, receiver, buf);
+    names += rsp.ok;
+  }
+  co_return names;
+}
+
+static Task<int> findFeatures(Harmony *harmony, int receiver) {
+  // Root feature lookups for every paired device, e.g. to find the battery
+  // status feature
+  int found = 0;
+  for (int device = 1; device <= 6; device++) {
+    const unsigned char buf[7] = { 0x10, (unsigned char)device, 0x00, 0x00,
+                                   0x10, 0x00 };
+    const Coro::Response rsp = co_await Coro::request(harmony, receiver, buf);
+    found += rsp.ok && rsp.buf[4];
+  }
+  co_return found;
+}
+
+static Task<> enumerate(Harmony *harmony, int receiver, int *names,
+                        int *features, int *pending) {
+  *names += co_await readNames(harmony, receiver);
+  *features += co_await findFeatures(harmony, receiver);
+  --*pending;
+}
+
+static Task<> switchToDJMode(Harmony *harmony, int receiver, bool *done) {
+  // DJ reports never get a response, so this must not wait for one
+  const unsigned char buf[15] = { 0x20, 0xFF, 0x80, 0x3F };
+  *done = (co_await Coro::request(harmony, receiver, buf)).ok;
+}
+
+static Task<> countKeys(Harmony *harmony, int keys, bool *done) {
+  for (int i = 0; i < keys; i++) {
+    co_await Coro::nextKey(harmony);
+  }
+  *done = true;
+}
+
+static Task<> sleeper(Event *event, int n, bool *done) {
+  for (int i = 0; i < n; i++) {
+    co_await Coro::sleep(event, 0);
+  }
+  *done = true;
+}
+
+static Task<> pingPong(Event *event, const int *fds, int n, bool *done) {
+  char ch;
+  for (int i = 0; i < n; i++) {
+    if (write(fds[1], "x", 1) != 1) {
+      break;
+    }
+    co_await Coro::readable(event, fds[0]);
+    if (read(fds[0], &ch, 1) != 1) {
+      break;
+    }
+  }
+  *done = true;
+}
+
+int main() {
+  enum { RECEIVERS = 4, AWAITS = 100000 };
+  Event event;
+  FakeTransport fake;
+  fake.setResponseDelay(8);
+  for (int i = 0; i < RECEIVERS; i++) {
+    fake.plug("fake:" + std::to_string(i + 1), 6);
+  }
+  Harmony harmony(&event, &fake);
+  harmony.waitForReceivers();
+
+  // Enumerate all receivers concurrently. Each response takes 8ms, so
+  // the total time shows whether the flows overlap.
+  int names = 0, features = 0, pending = RECEIVERS;
+  Nanos start = Util::nanos();
+  for (int receiver = 1; receiver <= RECEIVERS; receiver++) {
+    enumerate(&harmony, receiver, &names, &features, &pending).detach();
+  }
+  while (pending) {
+    event.runOnce();
+  }
+  printf("Enumerated %d receivers (%d names, %d battery features, "
+         "%d requests) in %.1f ms\n", RECEIVERS, names, features,
+         RECEIVERS * 12, (double)(Util::nanos() - start) / NANOS_PER_MS);
+
+  bool sent = false;
+  switchToDJMode(&harmony, 1, &sent).detach();
+  if (!sent) {
+    printf("Requests with DJ reports never finish\n");
+    return 1;
+  }
+
+  // Allocations per co_await, once everything is warmed up
+  printf("%-10s %10s %12s %14s\n", "awaitable", "awaits", "allocations",
+         "ns/await");
+  auto measure = [&](const char *name, int n, auto start) {
+    bool done = false;
+    start(&done).detach();
+    run(&event, &done);
+    done = false;
+    const unsigned long before = allocations;
+    const Nanos tm = Util::nanos();
+    start(&done).detach();
+    run(&event, &done);
+    printf("%-10s %10d %12lu %14.0f\n", name, n, allocations - before,
+           (double)(Util::nanos() - tm) / n);
+  };
+  measure("sleep", AWAITS, [&](bool *done) {
+    return sleeper(&event, AWAITS, done); });
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    return 1;
+  }
+  measure("readable", AWAITS, [&](bool *done) {
+    return pingPong(&event, fds, AWAITS, done); });
+  fake.setResponseDelay(0);
+  fake.setKeyRate("fake:1", 200000);
+  measure("nextKey", AWAITS, [&](bool *done) {
+    return countKeys(&harmony, AWAITS, done); });
+  fake.setKeyRate("fake:1", 0);
+  measure("request", 1000, [&](bool *done) {
+    return [](Harmony *harmony, bool *done) -> Task<> {
+      for (int i = 0; i < 1000; i++) {
+        co_await readNames(harmony, 1);
+      }
+      *done = true;
+    }(&harmony, done); });
+  close(fds[0]);
+  close(fds[1]);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,160 @@
+// Six remotes paired to the same offline receiver press keys at the same
+// time, so that their reports interleave. Every remote has a script of
+// presses, and the bench works out which keys it has to report, and when:
+// short presses on release, long presses once the threshold is reached,
+// and auto-repeat keys on press and then on every interval. It checks that
+// every remote gets exactly its own keys, at exactly the right time, on a
+// simulated clock. It also reports how long injecting a report takes on
+// the real clock, until all resulting callbacks have returned.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "event.h"
+#include "harmony.h"
+#include "util.h"
+
+enum { DEVICES = 6, PRESSES = 20000, LONGPRESS = 250, DELAY = 400,
+       INTERVAL = 100 };
+
+static Nanos now = 1;
+
+static Nanos simulatedClock() {
+  return now;
+}
+
+struct Report {
+  Nanos tm;
+  int device;
+  int key;
+  bool pressed;
+};
+
+struct Expected {
+  Nanos due;   // When the key has to be reported
+  Nanos tm;    // When it was pressed
+  int key;
+  bool repeat;
+};
+
+// Adds the reports for one press, and the keys they have to turn into
+static void script(int device, int key, Nanos tm, unsigned hold,
+                   std::vector<Report> *reports,
+                   std::vector<Expected> *expected) {
+  const Nanos release = tm + hold*NANOS_PER_MS;
+  reports->push_back({ tm, device, key, true });
+  reports->push_back({ release, device, key, false });
+  if (key == Harmony::KEY_VOL_UP) {
+    expected->push_back({ tm, tm, key, false });
+    for (Nanos due = tm + DELAY*NANOS_PER_MS; due < release;
+         due += INTERVAL*NANOS_PER_MS) {
+      expected->push_back({ due, tm, key, true });
+    }
+  } else if (hold > LONGPRESS) {
+    expected->push_back({ tm + LONGPRESS*NANOS_PER_MS, tm,
+                          key | Harmony::KEY_LONGPRESS, false });
+  } else {
+    expected->push_back({ release, tm, key, false });
+  }
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  return sorted[std::min(sorted.size() - 1,
+                         (size_t)(p * sorted.size()))] / 1000.0;
+}
+
+int main() {
+  // Holds never end on the long-press threshold or on a repeat, as it
+  // would be up to the order of reports and timers which one wins
+  static const int keys[] = { Harmony::KEY_OK, Harmony::KEY_UP,
+                              Harmony::KEY_DOWN, Harmony::KEY_MENU,
+                              Harmony::KEY_VOL_UP };
+  static const unsigned holds[] = { 40, 120, 230, 270, 730, 1250 };
+  std::vector<Report> reports;
+  std::vector<Expected> expected[DEVICES + 1];
+  unsigned seed = 1;
+  for (int device = 1; device <= DEVICES; device++) {
+    Nanos tm = now + 1000*NANOS_PER_MS + device*7*NANOS_PER_MS;
+    for (int i = 0; i < PRESSES / DEVICES; i++) {
+      seed = seed*1103515245 + 12345;
+      const unsigned hold = holds[(seed >> 8) % 6];
+      script(device, keys[(seed >> 12) % 5], tm, hold, &reports,
+             &expected[device]);
+      tm += (hold + 20 + (seed >> 16) % 200)*NANOS_PER_MS;
+    }
+  }
+  std::stable_sort(reports.begin(), reports.end(),
+                   [](const Report &a, const Report &b) {
+                     return (int64_t)(a.tm - b.tm) < 0; });
+
+  Util::setClock(simulatedClock);
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("offline");
+  harmony.setLongPressThreshold(LONGPRESS);
+  harmony.setAutoRepeat(Harmony::KEY_VOL_UP, DELAY, INTERVAL);
+  size_t next[DEVICES + 1] = { };
+  unsigned long reported = 0, wrong = 0, late = 0;
+  harmony.setKeyCallback([&](const Harmony::KeyEvent &ev) {
+    reported++;
+    if (ev.receiver != receiver || ev.device < 1 || ev.device > DEVICES ||
+        next[ev.device] == expected[ev.device].size()) {
+      wrong++;
+      return;
+    }
+    const Expected &e = expected[ev.device][next[ev.device]++];
+    if (ev.key != e.key || ev.repeat != e.repeat || ev.tm != e.tm) {
+      wrong++;
+    } else if (now != e.due) {
+      late++;
+    }
+  });
+
+  // Step through the reports one millisecond at a time. Reports that are
+  // due go in before the timers.
+  std::vector<uint64_t> latencies;
+  latencies.reserve(reports.size());
+  for (size_t i = 0; i < reports.size(); ) {
+    while (i < reports.size() && reports[i].tm == now) {
+      const Report &r = reports[i++];
+      unsigned char buf[15] = { 0x20, (unsigned char)r.device,
+                                (unsigned char)(r.key >> 16) };
+      if (r.pressed) {
+        buf[3] = r.key >> 8;
+        buf[4] = r.key;
+      }
+      const auto before = std::chrono::steady_clock::now();
+      harmony.injectReport(receiver, buf, sizeof(buf), now);
+      latencies.push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - before).count());
+    }
+    event.runExpired();
+    now += NANOS_PER_MS;
+  }
+  event.runExpired();
+  harmony.setKeyCallback(nullptr);
+  Util::setClock(NULL);
+
+  unsigned long missing = 0, total = 0;
+  for (int device = 1; device <= DEVICES; device++) {
+    missing += expected[device].size() - next[device];
+    total += expected[device].size();
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("%zu reports from %d remotes, %lu of %lu keys reported\n",
+         reports.size(), DEVICES, reported, total);
+  printf("%10s %10s %10s %10s %10s %10s\n", "wrong", "missing", "late",
+         "p50 (us)", "p99 (us)", "max (us)");
+  printf("%10lu %10lu %10lu %10.2f %10.2f %10.2f\n", wrong, missing, late,
+         percentile(latencies, 0.5), percentile(latencies, 0.99),
+         latencies.back() / 1000.0);
+  if (wrong || missing || late) {
+    printf("Remotes on the same receiver interfere with each other\n");
+    return 1;
+  }
+  return 0;
+}
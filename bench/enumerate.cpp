@@ -0,0 +1,66 @@
+// Reads the names of all six paired devices from a simulated receiver,
+// once with one request in flight at a time (which is all that Harmony
+// could do before requests got queued), and once with all of them queued
+// up together, so that up to HARMONY_HIDPP_WINDOW go out back to back.
+// The fake transport answers each request after a fixed delay, which
+// stands in for the USB round trip.
+
+#include <stdio.h>
+
+#include "event.h"
+#include "faketransport.h"
+#include "harmony.h"
+#include "util.h"
+
+enum { PAIRED = 6, ROUNDS = 10 };
+
+static double enumerate(unsigned delay, bool pipelined, int *names) {
+  Event event;
+  FakeTransport fake;
+  fake.setResponseDelay(delay);
+  fake.plug("fake:1", PAIRED);
+  Harmony harmony(&event, &fake);
+  harmony.waitForReceivers();
+  harmony.waitForHIDppRequests();
+  const int receiver = harmony.getReceivers()[0];
+  auto done = [names](int len, const unsigned char *buf) {
+    if (len == 20 && buf[2] == 0x83) {
+      ++*names;
+    }
+  };
+  const Nanos start = Util::nanos();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int device = 1; device <= PAIRED; device++) {
+      const unsigned char buf[7] = { 0x10, 0xFF, 0x83, 0xB5,
+                                     (unsigned char)(0x40 + device - 1) };
+      if (pipelined) {
+        harmony.sendHIDppRequest(receiver, buf, done);
+      } else {
+        harmony.sendHIDppRequestAndWait(receiver, buf, done);
+      }
+    }
+    harmony.waitForHIDppRequests();
+  }
+  return (double)(Util::nanos() - start) / (double)NANOS_PER_MS /
+         (double)ROUNDS;
+}
+
+int main() {
+  printf("%-16s %14s %14s %10s\n", "response delay", "serial (ms)",
+         "pipelined (ms)", "speedup");
+  static const unsigned delays[] = { 1, 2, 8 };
+  for (unsigned delay : delays) {
+    int names = 0;
+    const double serial = enumerate(delay, false, &names);
+    const double pipelined = enumerate(delay, true, &names);
+    char label[16];
+    snprintf(label, sizeof(label), "%ums", delay);
+    printf("%-16s %14.1f %14.1f %9.1fx\n", label, serial, pipelined,
+           serial / pipelined);
+    if (names != 2*ROUNDS*PAIRED) {
+      printf("Got %d of %d names\n", names, 2*ROUNDS*PAIRED);
+      return 1;
+    }
+  }
+  return 0;
+}
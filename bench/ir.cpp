@@ -0,0 +1,160 @@
+// Measures how long it takes from queuing the IR code for a key to the
+// write() that sends it. Reports go through an offline receiver and the
+// keymap, just like in main.cpp. A FIFO stands in for a LIRC device that
+// gets written to from the event loop, and /dev/null for one that has its
+// own thread. For comparison, the cost of shelling out to a command per key
+// press is measured, too, as is compiling codes up front.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "event.h"
+#include "harmony.h"
+#include "ir.h"
+#include "keymap.h"
+#include "util.h"
+
+enum { KEYS = 2000, COMPILES = 10000, SPAWNS = 100 };
+
+static const char *codes[] = {
+  "nec 0x04 0x08", "nec 0x7F01 0x15", "rc5 0 12", "sony12 1 21",
+  "sony20 26 121 8", "raw 38000 9000 4500 560 560 560 1690 560",
+};
+
+static void latency(const char *name, const std::string &path) {
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("offline");
+  harmony.setAutoRepeat(Harmony::KEY_VOL_UP, 400, 100);
+  std::string error;
+  Keymap *keymap = Keymap::compile("VOL_UP ir nec 0x04 0x02\n", &error);
+  IrOutput ir(&event);
+  if (!keymap || !ir.open(path, &error)) {
+    printf("%s: %s\n", name, error.c_str());
+    exit(1);
+  }
+  harmony.setKeyCallback([&](const Harmony::KeyEvent &ev) {
+    int count;
+    const Keymap::Action *actions = keymap->find(ev.receiver, ev.device,
+                                                 ev.key, &count);
+    for (int i = 0; i < count; i++) {
+      ir.send(actions[i].ir, ev.repeat);
+    }
+  });
+
+  // Press and release the key once every millisecond
+  int keys = 0;
+  Event::Handle handle;
+  std::function<void ()> tick = [&]() {
+    for (int pressed = 1; pressed >= 0; pressed--) {
+      const unsigned char buf[15] = { 0x20, 1, Harmony::KEY_VOL_UP >> 16,
+        (unsigned char)(pressed ? Harmony::KEY_VOL_UP >> 8 : 0),
+        (unsigned char)(pressed ? Harmony::KEY_VOL_UP : 0) };
+      harmony.injectReport(receiver, buf, sizeof(buf), Util::nanos());
+    }
+    if (++keys == KEYS) {
+      event.exitLoop();
+    } else {
+      handle = event.addTimeout(1, tick);
+    }
+  };
+  handle = event.addTimeout(1, tick);
+  event.loop();
+  // Give the worker thread a moment to catch up
+  for (int i = 0; i < 100 && ir.getStats().sent < KEYS; i++) {
+    usleep(1000);
+  }
+  const IrOutput::Stats stats = ir.getStats();
+  printf("%-20s %8lu %8lu %12.1f %12.1f\n", name,
+         (unsigned long)stats.sent, (unsigned long)stats.dropped,
+         stats.sent ? (double)stats.latencyNanos / stats.sent / 1000 : 0.0,
+         (double)stats.maxLatencyNanos / 1000);
+  delete keymap;
+}
+
+int main() {
+  std::string error;
+  for (const char *spec : codes) {
+    const Nanos start = Util::nanos();
+    size_t len = 0;
+    for (int i = 0; i < COMPILES; i++) {
+      std::shared_ptr<IrCode> code = IrCode::compile(spec, &error);
+      if (!code) {
+        printf("%s: %s\n", spec, error.c_str());
+        return 1;
+      }
+      len = code->press.size();
+    }
+    printf("Compiling %-20s %6.2f us (%zu pulses and spaces)\n", spec,
+           (double)(Util::nanos() - start) / (double)COMPILES / 1000, len);
+  }
+
+  // Drain the FIFO on another thread, like a receiving process would
+  char dir[] = "/tmp/harmony-ir-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string fifo = std::string(dir) + "/lirc";
+  if (mkfifo(fifo.c_str(), 0600)) {
+    perror(fifo.c_str());
+    return 1;
+  }
+  std::atomic<bool> done = { false };
+  std::atomic<unsigned long> bytes = { 0 };
+  std::thread reader([&]() {
+    const int fd = open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+    char buf[4096];
+    while (!done) {
+      const ssize_t len = read(fd, buf, sizeof(buf));
+      if (len > 0) {
+        bytes += len;
+      } else {
+        usleep(100);
+      }
+    }
+    close(fd);
+  });
+
+  printf("\n%-20s %8s %8s %12s %12s\n", "send() -> write()", "sent",
+         "dropped", "avg (us)", "max (us)");
+  latency("event loop (FIFO)", fifo);
+  latency("thread (/dev/null)", "/dev/null");
+  done = true;
+  reader.join();
+  unlink(fifo.c_str());
+  rmdir(dir);
+  if (bytes != KEYS*67*sizeof(uint32_t)) {
+    printf("FIFO received %lu bytes\n", bytes.load());
+    return 1;
+  }
+
+  // What "exec" costs the event loop, and how long until a command has run
+  Nanos spawn = 0, exited = 0;
+  for (int i = 0; i < SPAWNS; i++) {
+    const char *argv[] = { "/bin/sh", "-c", "true", NULL };
+    const Nanos start = Util::nanos();
+    pid_t pid;
+    if (posix_spawn(&pid, "/bin/sh", NULL, NULL, (char **)argv, environ)) {
+      perror("posix_spawn");
+      return 1;
+    }
+    spawn += Util::nanos() - start;
+    waitpid(pid, NULL, 0);
+    exited += Util::nanos() - start;
+  }
+  printf("%-20s %8d %8s %12.1f\n%-20s %8d %8s %12.1f\n", "exec (spawn)",
+         SPAWNS, "", (double)spawn / (double)SPAWNS / 1000, "exec (until exit)",
+         SPAWNS, "", (double)exited / (double)SPAWNS / 1000);
+  return 0;
+}
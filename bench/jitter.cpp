@@ -0,0 +1,74 @@
+// Checks that timers keep firing in order when the clock wraps around, by
+// installing a simulated clock. Then measures how late a periodic 500us
+// timer fires with each of the event loop's backends.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "event.h"
+#include "util.h"
+
+static Nanos simulated;
+
+static bool wraparound() {
+  // Start half a second before the 64 bit clock wraps, and step through
+  // time in 1ms increments. Queuing a no-op makes runOnce() dispatch
+  // whatever expired without actually sleeping.
+  Util::setClock([]() { return simulated; });
+  simulated = (Nanos)0 - 500*NANOS_PER_MS;
+  Event event;
+  static const unsigned tmos[] = { 600, 100, 1000, 400, 499, 501 };
+  std::vector<unsigned> fired;
+  bool ok = true;
+  for (auto tmo : tmos) {
+    const Nanos deadline = simulated + tmo*NANOS_PER_MS;
+    event.addTimeout(tmo, [&, tmo, deadline]() {
+      fired.push_back(tmo);
+      ok &= simulated - deadline < NANOS_PER_MS;
+    });
+  }
+  for (int ms = 0; ms <= 1100; ms++) {
+    simulated += NANOS_PER_MS;
+    event.runLater([]() { });
+    event.runOnce();
+  }
+  Util::setClock(NULL);
+  std::vector<unsigned> sorted(tmos, tmos + sizeof(tmos)/sizeof(*tmos));
+  std::sort(sorted.begin(), sorted.end());
+  return ok && fired == sorted;
+}
+
+static void jitter(const char *name, Event::Backend backend, bool precise) {
+  static const Nanos period = 500*1000;
+  static const int iterations = 2000;
+  Event event(backend, precise);
+  Nanos deadline = Util::nanos() + period, sum = 0, worst = 0;
+  int count = 0;
+  std::function<void (void)> tick = [&]() {
+    const Nanos late = Util::nanos() - deadline;
+    sum += late;
+    worst = std::max(worst, late);
+    if (++count == iterations) {
+      event.exitLoop();
+    } else {
+      deadline += period;
+      event.addTimeoutAt(deadline, tick);
+    }
+  };
+  event.addTimeoutAt(deadline, tick);
+  event.loop();
+  printf("%-16s %14.1f %14.1f\n", name,
+         (double)sum / iterations / 1000, (double)worst / 1000);
+}
+
+int main() {
+  printf("wraparound: %s\n\n", wraparound() ? "ok" : "FAILED");
+  printf("%-16s %14s %14s\n", "backend", "avg late (us)", "max late (us)");
+  jitter("ppoll", Event::BACKEND_POLL, false);
+  jitter("epoll", Event::BACKEND_EPOLL, false);
+  jitter("epoll+timerfd", Event::BACKEND_EPOLL, true);
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Measures what dispatching a key through a compiled keymap costs, how long
+// compiling a keymap takes, and whether dispatching ever stalls while the
+// keymap file keeps changing underneath. A second thread rewrites the file
+// while the event loop dispatches keys and KeymapWatcher reloads in the
+// background.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "keymap.h"
+#include "keys.h"
+#include "util.h"
+
+enum { LOOKUPS = 10000000, COMPILES = 100, RELOAD_MS = 2000 };
+
+static std::string makeConfig(int variant) {
+  // Every key gets bound, some of them per receiver and device, and
+  // there is a catch-all
+  std::string text = "*  print\n";
+  for (int i = 0; i < Keys::COUNT; i++) {
+    std::string name = Keys::keys[i].name;
+    for (auto &ch : name) {
+      ch = ch == ' ' ? '_' : ch;
+    }
+    text += name + "  exec echo " + std::to_string(variant) + "\n";
+    if (Keys::keys[i].longPress) {
+      text += "LONG_" + name + "@1  print\n";
+    }
+    text += name + "@2." + std::to_string(1 + i % 6) + "  exit\n";
+  }
+  return text;
+}
+
+static bool writeConfig(const std::string &path, const std::string &text) {
+  // Replace the file like an editor would
+  const std::string tmp = path + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if (!fp) {
+    return false;
+  }
+  fputs(text.c_str(), fp);
+  return !fclose(fp) && !rename(tmp.c_str(), path.c_str());
+}
+
+int main() {
+  std::string error;
+  const std::string text = makeConfig(0);
+  Nanos start = Util::nanos();
+  for (int i = 0; i < COMPILES; i++) {
+    delete Keymap::compile(text, &error);
+  }
+  printf("Compiling %zu bytes: %.1f us\n", text.size(),
+         (double)(Util::nanos() - start) / (double)COMPILES / 1000);
+
+  // Dispatch a random mix of keys, receivers and devices
+  Keymap *keymap = Keymap::compile(text, &error);
+  if (!keymap) {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  int keys[1024];
+  unsigned seed = 1;
+  for (auto &key : keys) {
+    key = Keys::keys[rand_r(&seed) % Keys::COUNT].code |
+          (rand_r(&seed) % 4 ? 0 : Keys::LONGPRESS);
+  }
+  unsigned long sum = 0;
+  start = Util::nanos();
+  for (int i = 0; i < LOOKUPS; i++) {
+    int count;
+    keymap->find(1 + i % 3, 1 + i % 6, keys[i % 1024], &count);
+    sum += count;
+  }
+  printf("Dispatch: %.1f ns/key (%lu actions)\n",
+         (double)(Util::nanos() - start) / (double)LOOKUPS, sum);
+  delete keymap;
+
+  // Keep rewriting the file, while the loop dispatches keys
+  char dir[] = "/tmp/harmony-keymap-XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string path = std::string(dir) + "/keymap";
+  writeConfig(path, text);
+  Event event;
+  KeymapWatcher watcher(&event, path);
+  if (!watcher.start(&error)) {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  printf("%-16s %8s %10s %12s %12s\n", "", "reloads", "keys",
+         "p99.9 (ns)", "max (ns)");
+  for (int rewrite = 0; rewrite < 2; rewrite++) {
+    std::atomic<bool> done = { false };
+    std::thread writer([&]() {
+      for (int i = 1; rewrite && !done; i++) {
+        writeConfig(path, makeConfig(i));
+        usleep(50000);
+      }
+    });
+    std::vector<Nanos> times;
+    times.reserve(4000000);
+    const unsigned long reloads = watcher.getReloads();
+    bool timedOut = false;
+    Event::Handle handle;
+    std::function<void ()> tick = [&]() {
+      for (int i = 0; i < 1000; i++) {
+        const Nanos tm = Util::nanos();
+        int count;
+        watcher.get()->find(1, 1, keys[i], &count);
+        times.push_back(Util::nanos() - tm);
+      }
+      handle = event.addTimeout(1, tick);
+    };
+    handle = event.addTimeout(1, tick);
+    event.addTimeout(RELOAD_MS, [&]() { timedOut = true; });
+    while (!timedOut) {
+      event.runOnce();
+    }
+    event.removeTimeout(handle);
+    done = true;
+    writer.join();
+    std::sort(times.begin(), times.end());
+    printf("%-16s %8lu %10zu %12lu %12lu\n",
+           rewrite ? "while reloading" : "idle", watcher.getReloads() - reloads,
+           times.size(), (unsigned long)times[times.size() * 999 / 1000],
+           (unsigned long)times.back());
+  }
+  unlink(path.c_str());
+  unlink((path + ".tmp").c_str());
+  rmdir(dir);
+  return 0;
+}
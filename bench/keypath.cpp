@@ -0,0 +1,114 @@
+// Replays a stream of key reports through an offline receiver, and counts
+// heap allocations on the way from report to decoded key. The stream mixes
+// short presses, long presses, auto-repeat and synchronous getKey() calls.
+// A simulated clock makes all timers fire without actually waiting. Once
+// warmed up, none of this should allocate.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include "event.h"
+#include "harmony.h"
+#include "util.h"
+
+static std::atomic<unsigned long> allocations = { 0 };
+
+void *operator new(size_t size) {
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  free(ptr);
+}
+
+static Nanos now = 1;
+
+static Nanos simulatedClock() {
+  return now;
+}
+
+static void keyReport(Harmony *harmony, int receiver, int device, int key,
+                      bool pressed) {
+  // DJ short report, as sent by the receiver for key presses and releases
+  unsigned char buf[15] = { 0x20, (unsigned char)device,
+                            (unsigned char)(key >> 16) };
+  if (pressed) {
+    buf[3] = key >> 8;
+    buf[4] = key;
+  }
+  harmony->injectReport(receiver, buf, sizeof(buf), now);
+}
+
+static void advance(Event *event, unsigned ms) {
+  // Only ever runs the loop when a timer has already expired, so that it
+  // never has to wait.
+  now += ms*NANOS_PER_MS;
+  event->runOnce();
+}
+
+int main() {
+  static const int warmup = 100, iterations = 10000;
+  Util::setClock(simulatedClock);
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("offline");
+  harmony.setLongPressThreshold(500);
+  harmony.setAutoRepeat(Harmony::KEY_VOL_UP, 400, 100);
+  unsigned long keys = 0;
+  harmony.setKeyCallback([&keys](const Harmony::KeyEvent &) { keys++; });
+
+  unsigned long start = 0, startKeys = 0;
+  auto wallStart = std::chrono::steady_clock::now();
+  for (int i = 0; i < warmup + iterations; i++) {
+    if (i == warmup) {
+      start = allocations;
+      startKeys = keys;
+      wallStart = std::chrono::steady_clock::now();
+    }
+    const int device = 1 + i % 6;
+    // Short press, reported on release
+    keyReport(&harmony, receiver, device, Harmony::KEY_OK, true);
+    now += 100*NANOS_PER_MS;
+    keyReport(&harmony, receiver, device, Harmony::KEY_OK, false);
+    // Long press, reported by a timer
+    keyReport(&harmony, receiver, device, Harmony::KEY_MENU, true);
+    advance(&event, 500);
+    keyReport(&harmony, receiver, device, Harmony::KEY_MENU, false);
+    // Auto-repeat, reported on press and then by a timer
+    keyReport(&harmony, receiver, device, Harmony::KEY_VOL_UP, true);
+    advance(&event, 400);
+    advance(&event, 100);
+    keyReport(&harmony, receiver, device, Harmony::KEY_VOL_UP, false);
+    // Synchronous API, with the report arriving from the event loop
+    event.runLater([&harmony, receiver, device]() {
+      keyReport(&harmony, receiver, device, Harmony::KEY_OK, true);
+      keyReport(&harmony, receiver, device, Harmony::KEY_OK, false);
+    });
+    harmony.getKey();
+  }
+  const double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - wallStart).count();
+  const unsigned long allocated = allocations - start;
+  harmony.setKeyCallback(nullptr);
+  Util::setClock(NULL);
+
+  printf("%14s %14s %14s %14s\n", "reports", "keys", "reports/s",
+         "allocations");
+  printf("%14d %14lu %14.0f %14lu\n", 8*iterations, keys - startKeys,
+         8*iterations / secs, allocated);
+  return allocated != 0;
+}
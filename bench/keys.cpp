@@ -0,0 +1,98 @@
+// Compares key name lookups through the perfect hash tables in keys.h with
+// what Harmony::toString() used to do: bsearch() over a sorted table of
+// "LONG ..." names, slicing off the prefix for short presses. The reverse
+// lookup is compared against a linear scan, which is what parsing a config
+// file would otherwise do.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "keys.h"
+#include "util.h"
+
+enum { LOOKUPS = 10000000 };
+
+struct Map { int code; const char *str; };
+static std::vector<Map> map;
+
+static const char *bsearchToString(int key) {
+  int code = key & ~Keys::LONGPRESS;
+  const Map *entry =
+    (const Map *)bsearch(&code, &map[0], map.size(), sizeof(Map),
+                         [](const void *a, const void *b) -> int {
+                           return *(int *)a - *(int *)b; });
+  if (!entry) {
+    return "UNKNOWN KEY";
+  } else {
+    return key & Keys::LONGPRESS ? entry->str : entry->str + 5;
+  }
+}
+
+static int linearFromString(const char *name) {
+  for (int i = 0; i < Keys::COUNT; i++) {
+    if (!strcasecmp(Keys::keys[i].name, name)) {
+      return Keys::keys[i].code;
+    } else if (!strcasecmp(Keys::keys[i].longName, name)) {
+      return Keys::keys[i].code | Keys::LONGPRESS;
+    }
+  }
+  return 0;
+}
+
+template<typename F>
+static double measure(const std::vector<int> &codes, F lookup) {
+  // Sum up the first character of every result, so that the lookups can't
+  // be optimized away
+  unsigned long sum = 0;
+  const Nanos start = Util::nanos();
+  for (int i = 0; i < LOOKUPS; i++) {
+    sum += lookup(codes[i % codes.size()]);
+  }
+  const double ns = (double)(Util::nanos() - start) / (double)LOOKUPS;
+  if (sum == 42) {
+    printf("\n");
+  }
+  return ns;
+}
+
+int main() {
+  for (int i = 0; i < Keys::COUNT; i++) {
+    map.push_back({ Keys::keys[i].code, Keys::keys[i].longName });
+  }
+  std::sort(map.begin(), map.end(),
+            [](const Map &a, const Map &b) { return a.code < b.code; });
+
+  // A random mix of keys, with about one in four being long presses
+  std::vector<int> codes;
+  unsigned seed = 1;
+  for (int i = 0; i < 4096; i++) {
+    codes.push_back(Keys::keys[rand_r(&seed) % Keys::COUNT].code |
+                    (rand_r(&seed) % 4 ? 0 : Keys::LONGPRESS));
+  }
+  printf("%-24s %10s\n", "", "ns/lookup");
+  printf("%-24s %10.1f\n", "code -> name, bsearch", measure(codes,
+         [](int code) { return *bsearchToString(code); }));
+  printf("%-24s %10.1f\n", "code -> name, hash", measure(codes,
+         [](int code) { return *Keys::toString(code); }));
+  printf("%-24s %10.1f\n", "name -> code, linear", measure(codes,
+         [](int code) { return linearFromString(Keys::toString(code)); }));
+  printf("%-24s %10.1f\n", "name -> code, hash", measure(codes,
+         [](int code) { return Keys::fromString(Keys::toString(code)); }));
+
+  // Both directions have to agree for every key
+  for (int i = 0; i < Keys::COUNT; i++) {
+    const Keys::Info &key = Keys::keys[i];
+    if (Keys::fromString(key.name) != key.code ||
+        Keys::fromString(key.longName) != (key.code | Keys::LONGPRESS) ||
+        strcmp(bsearchToString(key.code), Keys::toString(key.code))) {
+      printf("Lookup mismatch for %s\n", key.name);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Runs hundreds of macros at once, and measures how far their steps stray
+// from the schedule. Meanwhile, another thread writes a timestamp into a
+// pipe every millisecond, which stands in for key reports; the time until
+// the loop reads it shows whether macros hold up key decoding. In the
+// "aligned" scenarios, all macros start together, so that their steps come
+// due back to back. Steps burn a fixed amount of
+// CPU time each. Also checks that starting a macro stops the one that the
+// same remote was running before.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "harmony.h"
+#include "keymap.h"
+#include "macro.h"
+#include "util.h"
+
+enum { MACROS = 500, STEPS = 20, STEP_MS = 10, RUN_MS = 400 };
+
+static void spin(Nanos ns) {
+  // Stands in for the work that a step does, like queuing an IR code
+  const Nanos until = Util::nanos() + ns;
+  while ((int64_t)(Util::nanos() - until) < 0) {
+  }
+}
+
+static void scenario(const char *name, int macros, bool aligned,
+                     Nanos work,
+                     const std::shared_ptr<const Keymap::Macro> &macro) {
+  Event event(Event::BACKEND_EPOLL, true);
+  MacroEngine engine(&event, [work](const Keymap::Action &,
+                                    const Harmony::KeyEvent &) {
+    spin(work);
+  });
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK)) {
+    perror("pipe");
+    return;
+  }
+  std::vector<Nanos> input;
+  input.reserve(2*RUN_MS);
+  event.addPollFd(fds[0], POLLIN, [&]() {
+    Nanos tm;
+    while (read(fds[0], &tm, sizeof(tm)) == sizeof(tm)) {
+      input.push_back(Util::nanos() - tm);
+    }
+  });
+  std::atomic<bool> done = { false };
+  std::thread writer([&]() {
+    while (!done) {
+      const Nanos tm = Util::nanos();
+      if (write(fds[1], &tm, sizeof(tm)) < 0) {
+        break;
+      }
+      usleep(1000);
+    }
+  });
+
+  // Spread out start times over one step's interval, unless aligned
+  for (int i = 0; i < macros; i++) {
+    const Harmony::KeyEvent ev = { Harmony::KEY_OK, 1 + i / 6, 1 + i % 6,
+                                   Util::nanos(), false };
+    if (aligned) {
+      engine.start(macro, ev);
+    } else {
+      event.addTimeoutAt(Util::nanos() + (Nanos)i*STEP_MS*NANOS_PER_MS /
+                         macros, [&engine, &macro, ev]() {
+        engine.start(macro, ev);
+      });
+    }
+  }
+  event.addTimeout(RUN_MS, [&event]() { event.exitLoop(); });
+  event.loop();
+  done = true;
+  writer.join();
+  close(fds[0]);
+  close(fds[1]);
+
+  const MacroEngine::Stats &stats = engine.getStats();
+  std::sort(input.begin(), input.end());
+  printf("%-22s %8lu %10.1f %10.1f %10.1f %10.1f\n", name,
+         (unsigned long)stats.steps,
+         stats.steps ? (double)stats.jitterNanos / stats.steps / 1000 : 0.0,
+         (double)stats.maxJitterNanos / 1000,
+         (double)input[input.size() * 99 / 100] / 1000,
+         (double)input.back() / 1000);
+}
+
+int main() {
+  // A macro that does something every STEP_MS milliseconds
+  std::string text;
+  for (int i = 0; i < STEPS; i++) {
+    text += i ? "OK wait " + std::to_string(STEP_MS) + "\nOK print\n"
+              : "OK print\n";
+  }
+  std::string error;
+  Keymap *keymap = Keymap::compile(text, &error);
+  if (!keymap) {
+    printf("%s\n", error.c_str());
+    return 1;
+  }
+  int count;
+  const Keymap::Action *action = keymap->find(1, 1, Harmony::KEY_OK, &count);
+  if (count != 1 || action->type != Keymap::Action::MACRO ||
+      action->macro->steps.size() != STEPS) {
+    printf("Keymap didn't compile into a macro\n");
+    return 1;
+  }
+  const std::shared_ptr<const Keymap::Macro> macro = action->macro;
+  delete keymap;
+
+  // Each remote only ever runs its latest macro
+  Event event;
+  unsigned long steps = 0;
+  MacroEngine engine(&event, [&steps](const Keymap::Action &,
+                                      const Harmony::KeyEvent &) { steps++; });
+  for (int i = 0; i < 1000; i++) {
+    engine.start(macro, { Harmony::KEY_OK, 1, 1 + i % 6, 0, false });
+  }
+  if (engine.getRunning() != 6 || engine.getStats().cancelled != 994 ||
+      steps != 1000 || !engine.cancel(1, 1) || engine.cancel(1, 1)) {
+    printf("Preempting macros doesn't work\n");
+    return 1;
+  }
+
+  printf("%-22s %8s %10s %10s %10s %10s\n", "", "steps", "avg (us)",
+         "max (us)", "input p99", "input max");
+  printf("%-22s %8s %10s %10s %10s %10s\n", "", "", "jitter", "jitter",
+         "(us)", "(us)");
+  scenario("no macros", 0, false, 0, macro);
+  scenario("spread, 1us steps", MACROS, false, 1000, macro);
+  scenario("aligned, 1us steps", MACROS, true, 1000, macro);
+  scenario("aligned, 10us steps", MACROS, true, 10000, macro);
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Holds down VOL_UP for three seconds, with auto-repeat sending 20 keys a
+// second, while the output only takes 5 actions a second. Keys go through
+// an offline receiver and an OutputQueue, with different coalescing rules.
+// Without any, the backlog keeps playing long after the key gets released.
+// Dropping stale repeats or merging them bounds the lag. A simulated clock
+// makes all of this run without waiting.
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "event.h"
+#include "harmony.h"
+#include "keymap.h"
+#include "outputqueue.h"
+#include "util.h"
+
+enum { HOLD_MS = 3000, REPEAT_MS = 50, RUN_MS = 20000 };
+
+static Nanos now = 1;
+
+static Nanos simulatedClock() {
+  return now;
+}
+
+static void burst(const char *name, const OutputQueue::Rules &rules) {
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("offline");
+  harmony.setAutoRepeat(Harmony::KEY_VOL_UP, 400, REPEAT_MS);
+  std::string error;
+  Keymap *keymap = Keymap::compile("VOL_UP exec amixer -q set Master "
+                                   "$((2*$1))%+\n", &error);
+  unsigned long keys = 0, outputs = 0, steps = 0;
+  Nanos last = 0;
+  OutputQueue queue(&event, [&](const Keymap::Action &,
+                                const Harmony::KeyEvent &, unsigned count) {
+    outputs++;
+    steps += count;
+    last = now;
+  });
+  const int target = queue.addTarget(rules);
+  harmony.setKeyCallback([&](const Harmony::KeyEvent &ev) {
+    int count;
+    const Keymap::Action *actions = keymap->find(ev.receiver, ev.device,
+                                                 ev.key, &count);
+    for (int i = 0; i < count; i++) {
+      queue.push(target, actions[i], ev);
+    }
+    keys++;
+  });
+
+  // DJ short reports for pressing and releasing the key
+  const unsigned char press[15] = { 0x20, 1, Harmony::KEY_VOL_UP >> 16,
+    (unsigned char)(Harmony::KEY_VOL_UP >> 8),
+    (unsigned char)Harmony::KEY_VOL_UP };
+  const unsigned char release[15] = { 0x20, 1, Harmony::KEY_VOL_UP >> 16 };
+  const Nanos start = now;
+  harmony.injectReport(receiver, press, sizeof(press), now);
+  for (int ms = 1; ms <= RUN_MS; ms++) {
+    now = start + ms*NANOS_PER_MS;
+    if (ms == HOLD_MS) {
+      harmony.injectReport(receiver, release, sizeof(release), now);
+    }
+    event.runExpired();
+  }
+  const OutputQueue::Stats stats = queue.getStats(target);
+  printf("%-16s %6lu %7lu %6lu %6lu %6lu %6lu %6zu %9lu %9ld\n", name, keys,
+         outputs, steps, (unsigned long)stats.merged,
+         (unsigned long)stats.stale, (unsigned long)stats.dropped,
+         stats.maxDepth, (unsigned long)(stats.maxLagNanos / NANOS_PER_MS),
+         (long)((int64_t)(last - start) / (int64_t)NANOS_PER_MS) - HOLD_MS);
+  delete keymap;
+}
+
+static bool chained() {
+  // A callback that forwards to another target gets that target drained
+  // right away, and both targets keep their own entry while calling out
+  Event event;
+  std::string error;
+  Keymap *keymap = Keymap::compile("OK print first\nOK print second\n",
+                                   &error);
+  int count;
+  const Keymap::Action *actions = keymap->find(1, 1, Harmony::KEY_OK,
+                                               &count);
+  std::string sent;
+  int second = -1;
+  OutputQueue *queue = NULL;
+  OutputQueue q(&event, [&](const Keymap::Action &action,
+                            const Harmony::KeyEvent &ev, unsigned) {
+    if (action.arg == "first") {
+      queue->push(second, actions[1], ev);
+    }
+    sent += action.arg + " ";
+  });
+  queue = &q;
+  const int first = q.addTarget({ 0, 1, 4, false, 0 });
+  second = q.addTarget({ 0, 1, 4, false, 0 });
+  q.push(first, actions[0], { Harmony::KEY_OK, 1, 1, now, false });
+  delete keymap;
+  return sent == "second first " && !q.getDepth(first) &&
+         !q.getDepth(second);
+}
+
+int main() {
+  if (!chained()) {
+    printf("Pushing from a callback gets stuck\n");
+    return 1;
+  }
+  Util::setClock(simulatedClock);
+  printf("%-16s %6s %7s %6s %6s %6s %6s %6s %9s %9s\n", "", "keys",
+         "outputs", "steps", "merged", "stale", "drop", "depth",
+         "lag (ms)", "tail (ms)");
+  burst("no coalescing", { 5, 2, 1000, false, 0 });
+  burst("bounded queue", { 5, 2, 8, false, 0 });
+  burst("drop stale", { 5, 2, 1000, false, 300 });
+  burst("merge", { 5, 2, 1000, true, 0 });
+  burst("merge, stale", { 5, 2, 1000, true, 300 });
+  Util::setClock(NULL);
+  return 0;
+}
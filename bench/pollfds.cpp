@@ -0,0 +1,112 @@
+// Compares dispatch latency of the ppoll() and epoll() backends. A single
+// token is passed around a ring of pipes, so that exactly one out of many
+// registered file descriptors is ready at any given time.
+// First, checks that neither backend lets timers starve file descriptors,
+// or the other way around: a descriptor that never stops being readable
+// and a timer that keeps re-arming itself have to take turns.
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "event.h"
+
+static bool fair(Event::Backend backend, bool precise) {
+  enum { ITERATIONS = 1000 };
+  Event event(backend, precise);
+  int fds[2];
+  if (pipe(fds) || write(fds[1], "", 1) != 1) {
+    perror("pipe");
+    return false;
+  }
+  int reads = 0, timeouts = 0;
+  event.addPollFd(fds[0], POLLIN, [&reads]() { reads++; });
+  std::function<void ()> tick = [&]() {
+    timeouts++;
+    event.addTimeout(0, tick);
+  };
+  event.addTimeout(0, tick);
+  for (int i = 0; i < ITERATIONS; i++) {
+    event.runOnce();
+  }
+  event.removePollFd(fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+  printf("%-16s %10d %10d\n", backend == Event::BACKEND_POLL ? "ppoll"
+         : precise ? "epoll, timerfd" : "epoll", reads, timeouts);
+  return reads >= ITERATIONS/2 && timeouts >= ITERATIONS/2;
+}
+
+static double dispatch(Event::Backend backend, int nFds, int iterations) {
+  Event event(backend);
+  std::vector<int> rd(nFds), wr(nFds);
+  for (int i = 0; i < nFds; i++) {
+    int fds[2];
+    if (pipe(fds)) {
+      perror("pipe");
+      return 0;
+    }
+    rd[i] = fds[0];
+    wr[i] = fds[1];
+  }
+  int count = 0;
+  for (int i = 0; i < nFds; i++) {
+    event.addPollFd(rd[i], POLLIN, [&, i]() {
+      char ch;
+      if (read(rd[i], &ch, 1) != 1) {
+        return;
+      }
+      if (++count == iterations) {
+        event.exitLoop();
+      } else if (write(wr[(i + 1) % nFds], &ch, 1) != 1) {
+        event.exitLoop();
+      }
+    });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  if (write(wr[0], "", 1) == 1) {
+    event.loop();
+  }
+  const double ns = std::chrono::duration<double, std::nano>(
+                      std::chrono::steady_clock::now() - start).count();
+  for (int i = 0; i < nFds; i++) {
+    event.removePollFd(rd[i]);
+    close(rd[i]);
+    close(wr[i]);
+  }
+  return ns / iterations;
+}
+
+int main() {
+  // Each file descriptor needs a pipe, and we need a few extra descriptors
+  // for the event loop itself.
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < 2100) {
+    rl.rlim_cur = std::min((rlim_t)2100, rl.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  printf("%-16s %10s %10s\n", "", "fd", "timer");
+  if (!fair(Event::BACKEND_POLL, false) | !fair(Event::BACKEND_EPOLL, false) |
+      !fair(Event::BACKEND_EPOLL, true)) {
+    printf("Timers and file descriptors don't take turns\n");
+    return 1;
+  }
+
+  static const int counts[] = { 10, 100, 1000 };
+  printf("\n%10s %16s %16s\n", "fds", "ppoll (ns)", "epoll (ns)");
+  for (auto n : counts) {
+    if (2*n + 16 > (int)rl.rlim_cur) {
+      printf("%10d   skipped, RLIMIT_NOFILE is too low\n", n);
+      continue;
+    }
+    printf("%10d %16.1f %16.1f\n", n,
+           dispatch(Event::BACKEND_POLL, n, 20000),
+           dispatch(Event::BACKEND_EPOLL, n, 20000));
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Records a synthetic session of remote control traffic into a capture file,
+// and then replays it through an offline receiver. The replay runs on a
+// simulated clock, so it goes as fast as decoding allows. Reports how many
+// keys get decoded per second, and how long each replayed record takes from
+// injection until all resulting callbacks have returned.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "capture.h"
+#include "event.h"
+#include "harmony.h"
+#include "util.h"
+
+static void keyReport(Harmony *harmony, int receiver, int device, int key,
+                      bool pressed, Nanos tm) {
+  unsigned char buf[15] = { 0x20, (unsigned char)device,
+                            (unsigned char)(key >> 16) };
+  if (pressed) {
+    buf[3] = key >> 8;
+    buf[4] = key;
+  }
+  harmony->injectReport(receiver, buf, sizeof(buf), tm);
+}
+
+static int record(const char *path, int presses) {
+  // Every press is followed by its release. Most presses are short, some
+  // turn into long presses, and volume keys auto-repeat.
+  static const int keys[] = { Harmony::KEY_OK, Harmony::KEY_UP,
+                              Harmony::KEY_DOWN, Harmony::KEY_MENU,
+                              Harmony::KEY_VOL_UP };
+  static const unsigned holds[] = { 80, 120, 150, 700, 1200 };
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("synthetic");
+  if (!harmony.startCapture(path)) {
+    return 0;
+  }
+  Nanos tm = 1000*NANOS_PER_MS;
+  unsigned seed = 1;
+  int reports = 0;
+  for (int i = 0; i < presses; i++) {
+    seed = seed*1103515245 + 12345;
+    const int device = 1 + (seed >> 8) % 6;
+    const int key = keys[(seed >> 12) % 5];
+    const unsigned hold = holds[(seed >> 16) % 5];
+    keyReport(&harmony, receiver, device, key, true, tm);
+    tm += hold*NANOS_PER_MS;
+    keyReport(&harmony, receiver, device, key, false, tm);
+    tm += (50 + (seed >> 20) % 250)*NANOS_PER_MS;
+    reports += 2;
+  }
+  return harmony.stopCapture() ? reports : 0;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  return sorted[std::min(sorted.size() - 1,
+                         (size_t)(p * sorted.size()))] / 1000.0;
+}
+
+int main() {
+  char path[] = "/tmp/harmony-capture-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  const int reports = record(path, 100000);
+  if (!reports) {
+    fprintf(stderr, "Failed to record %s\n", path);
+    unlink(path);
+    return 1;
+  }
+
+  Event event;
+  Harmony harmony(&event);
+  harmony.setAutoRepeat(Harmony::KEY_VOL_UP, 400, 100);
+  unsigned long keys = 0;
+  harmony.setKeyCallback([&keys](const Harmony::KeyEvent &) { keys++; });
+  CaptureReplay replay(&event, &harmony);
+  if (!replay.open(path)) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    unlink(path);
+    return 1;
+  }
+  std::vector<uint64_t> latencies;
+  latencies.reserve(reports);
+  const auto start = std::chrono::steady_clock::now();
+  for (;;) {
+    const auto before = std::chrono::steady_clock::now();
+    if (!replay.step()) {
+      break;
+    }
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - before).count());
+  }
+  const double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+  const double simulated = (double)(replay.now() - 1000*NANOS_PER_MS) / 1e9;
+  harmony.setKeyCallback(nullptr);
+  unlink(path);
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("Replayed %zu records (%.0f s of traffic) in %.3f s\n",
+         latencies.size(), simulated, secs);
+  printf("%14s %14s %10s %10s %10s %10s\n", "keys", "keys/s",
+         "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+  printf("%14lu %14.0f %10.2f %10.2f %10.2f %10.2f\n", keys, keys / secs,
+         percentile(latencies, 0.5), percentile(latencies, 0.9),
+         percentile(latencies, 0.99), latencies.back() / 1000.0);
+  return 0;
+}
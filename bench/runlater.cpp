@@ -0,0 +1,99 @@
+// Measures how long it takes for a callback that another thread posted with
+// Event::runLater() to start executing on the loop's thread, and how many
+// callbacks per second the loop can absorb, with 1 to 8 producer threads.
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "util.h"
+
+static double throughput(int producers, int perProducer) {
+  // All producers post as fast as they can
+  Event event;
+  const int total = producers * perProducer;
+  int count = 0;
+
+  // Posted callbacks don't keep the loop alive by themselves
+  event.addTimeout(3600*1000, []() { });
+  std::atomic<bool> go = { false };
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&]() {
+      while (!go) {
+        std::this_thread::yield();
+      }
+      for (int i = 0; i < perProducer; i++) {
+        event.runLater([&]() {
+          if (++count == total) {
+            event.exitLoop();
+          }
+        });
+      }
+    });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  go = true;
+  event.loop();
+  const double secs = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+  for (auto it = threads.begin(); it != threads.end(); it++) {
+    it->join();
+  }
+  return total / secs;
+}
+
+static void latency(int producers, int perProducer,
+                    double *avg, double *worst) {
+  // Every producer waits for its callback to run, before posting the next
+  // one. This measures the wakeup path, instead of the queue's backlog.
+  Event event;
+  const int total = producers * perProducer;
+  int count = 0;
+  uint64_t sum = 0, max = 0;
+  event.addTimeout(3600*1000, []() { });
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < perProducer; i++) {
+        std::atomic<bool> ran = { false };
+        const uint64_t posted = Util::nanos();
+        event.runLater([&, posted]() {
+          const uint64_t latency = Util::nanos() - posted;
+          sum += latency;
+          max = std::max(max, latency);
+          ran = true;
+          if (++count == total) {
+            event.exitLoop();
+          }
+        });
+        while (!ran) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  event.loop();
+  for (auto it = threads.begin(); it != threads.end(); it++) {
+    it->join();
+  }
+  *avg = (double)sum / total / 1000;
+  *worst = (double)max / 1000;
+}
+
+int main() {
+  printf("%10s %14s %14s %14s\n", "producers", "posts/s", "avg (us)",
+         "max (us)");
+  for (int producers = 1; producers <= 8; producers *= 2) {
+    double avg, worst;
+    const double rate = throughput(producers, 400000 / producers);
+    latency(producers, 20000 / producers, &avg, &worst);
+    printf("%10d %14.0f %14.1f %14.1f\n", producers, rate, avg, worst);
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+// Measures the time from process start, or from plugging in a receiver,
+// until the first key gets delivered, until the names of all paired
+// remotes are known, and until the receiver is ready. Receivers are
+// simulated by the fake transport, with USB-like response times and a
+// receiver that needs a moment before it reports its firmware version.
+// Each scenario runs once with an empty metadata cache (cold), and once
+// with the cache that the cold run left behind (warm). Keys flow as soon
+// as the receiver is in DJ mode either way. What the cache buys is knowing
+// the names right away, instead of once bringing up the receiver is done;
+// that still happens in the background, to revalidate the cache.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "faketransport.h"
+#include "harmony.h"
+#include "metacache.h"
+#include "util.h"
+
+enum { RESPONSE_DELAY = 8, WARMUP = 200, KEY_RATE = 2000, PAIRED = 6 };
+
+struct Times {
+  Nanos start, key, names, ready;
+};
+
+static void setup(FakeTransport *fake) {
+  fake->setResponseDelay(RESPONSE_DELAY);
+  fake->setWarmup(WARMUP);
+}
+
+static void plug(FakeTransport *fake) {
+  fake->plug("fake:1", PAIRED);
+  fake->setKeyRate("fake:1", KEY_RATE);
+}
+
+static void watch(Harmony *harmony, Times *t) {
+  // Names are checked whenever the receiver makes progress, and whenever
+  // a key arrives
+  auto check = [harmony, t]() {
+    const std::vector<int> receivers = harmony->getReceivers();
+    if (t->names || receivers.empty()) {
+      return;
+    }
+    for (int device = 1; device <= PAIRED; device++) {
+      if (harmony->getDeviceName(receivers[0], device).empty()) {
+        return;
+      }
+    }
+    t->names = Util::nanos();
+  };
+  harmony->setProgressCallback([t, check](int, Harmony::State state) {
+    if (state == Harmony::STATE_READY && !t->ready) {
+      t->ready = Util::nanos();
+    }
+    check();
+  });
+  harmony->setKeyCallback([t, check](const Harmony::KeyEvent &) {
+    if (!t->key) {
+      t->key = Util::nanos();
+    }
+    check();
+  });
+}
+
+static Times synchronous(const std::string &file) {
+  // Everything happens on the caller's thread. getKey() and
+  // waitForReceivers() run Harmony's private event loop.
+  MetadataCache cache(file);
+  cache.load();
+  FakeTransport fake;
+  setup(&fake);
+  plug(&fake);
+  Times t = { Util::nanos() };
+  Harmony harmony(NULL, &fake, &cache);
+  watch(&harmony, &t);
+  harmony.getKey();
+  t.key = Util::nanos();
+  harmony.waitForReceivers();
+  harmony.setKeyCallback(nullptr);
+  harmony.waitForHIDppRequests();
+  return t;
+}
+
+static Times asynchronous(const std::string &file, bool hotplug) {
+  // The caller runs the event loop. With "hotplug", the receiver only
+  // shows up once the loop is running.
+  MetadataCache cache(file);
+  cache.load();
+  Event event;
+  FakeTransport fake;
+  setup(&fake);
+  Times t = { Util::nanos() };
+  if (!hotplug) {
+    plug(&fake);
+  }
+  Harmony harmony(&event, &fake, &cache);
+  watch(&harmony, &t);
+  if (hotplug) {
+    t.start = Util::nanos();
+    plug(&fake);
+  }
+  while (!t.key || !t.names || !t.ready) {
+    event.runOnce();
+  }
+  harmony.setKeyCallback(nullptr);
+  harmony.waitForHIDppRequests();
+  return t;
+}
+
+static double ms(Nanos start, Nanos tm) {
+  return (double)(tm - start) / (double)NANOS_PER_MS;
+}
+
+int main() {
+  char path[] = "/tmp/harmony-cache-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  printf("%-14s %21s %21s %21s\n", "", "first key (ms)", "names (ms)",
+         "ready (ms)");
+  printf("%-14s %10s %10s %10s %10s %10s %10s\n", "", "cold", "warm",
+         "cold", "warm", "cold", "warm");
+  for (int scenario = 0; scenario < 3; scenario++) {
+    Times t[2];
+    unlink(path);
+    for (int warm = 0; warm < 2; warm++) {
+      t[warm] = scenario == 0 ? synchronous(path)
+                              : asynchronous(path, scenario == 2);
+    }
+    printf("%-14s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           scenario == 0 ? "sync start" :
+           scenario == 1 ? "async start" : "async hotplug",
+           ms(t[0].start, t[0].key), ms(t[1].start, t[1].key),
+           ms(t[0].start, t[0].names), ms(t[1].start, t[1].names),
+           ms(t[0].start, t[0].ready), ms(t[1].start, t[1].ready));
+  }
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// Drives Harmony with a fake Unifying receiver that generates key reports
+// at increasing rates, and measures how many of them make it through the
+// event loop. Once the loop saturates, the generator's timer fires late,
+// reports start piling up in the fake receiver and eventually get dropped.
+// An optional argument adds that many nanoseconds of busy work to every
+// key callback.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "event.h"
+#include "faketransport.h"
+#include "harmony.h"
+#include "util.h"
+
+static void run(Event *event, unsigned ms) {
+  bool running = true;
+  event->addTimeout(ms, [&running]() { running = false; });
+  while (running) {
+    event->runOnce();
+  }
+}
+
+static void spin(uint64_t ns) {
+  const Nanos until = Util::nanos() + ns;
+  while (Util::nanos() < until) { }
+}
+
+int main(int argc, char *argv[]) {
+  static const unsigned rates[] = { 1000, 5000, 10000, 20000, 50000,
+                                    100000, 200000, 500000, 1000000 };
+  const uint64_t work = argc > 1 ? strtoull(argv[1], NULL, 0) : 0;
+  Event event(Event::BACKEND_EPOLL, true);
+  FakeTransport fake;
+  fake.plug("fake:1", 6);
+  unsigned long keys = 0;
+  {
+    Harmony harmony(&event, &fake);
+    harmony.setKeyCallback([&keys, work](const Harmony::KeyEvent &) {
+      keys++;
+      if (work) {
+        spin(work);
+      }
+    });
+    // Let initialization finish
+    run(&event, 100);
+
+    printf("%10s %12s %12s %12s %10s %10s %10s %10s\n", "rate",
+           "offered/s", "delivered/s", "keys/s", "dropped",
+           "late (us)", "max (us)", "stall (us)");
+    for (auto rate : rates) {
+      fake.resetStats();
+      event.resetMaxStall();
+      keys = 0;
+      const Nanos start = Util::nanos();
+      fake.setKeyRate("fake:1", rate);
+      run(&event, 1000);
+      fake.setKeyRate("fake:1", 0);
+      const double secs = (double)(Util::nanos() - start) / 1e9;
+      const FakeTransport::Stats &stats = fake.getStats();
+      printf("%10u %12.0f %12.0f %12.0f %10lu %10.1f %10.1f %10.1f\n", rate,
+             stats.offered / secs, stats.delivered / secs, keys / secs,
+             (unsigned long)fake.getDropped(),
+             stats.ticks ? stats.lateNanos / 1000.0 / stats.ticks : 0.0,
+             stats.maxLateNanos / 1000.0, event.getMaxStall() / 1000.0);
+    }
+    harmony.setKeyCallback(nullptr);
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Measures the cost of waking up the event loop for an expiring timeout,
+// while a growing number of other timeouts are pending. Also measures the
+// cost of arming and cancelling a timeout. First, checks that a handle to
+// a timeout that is gone can't cancel the timeout that reused its record.
+
+#include <stdio.h>
+
+#include <chrono>
+#include <functional>
+
+#include "event.h"
+
+static double nanosSince(std::chrono::steady_clock::time_point start,
+                         int iterations) {
+  return std::chrono::duration<double, std::nano>(
+           std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+static double wakeup(int active, int iterations) {
+  Event event;
+  for (int i = 0; i < active; i++) {
+    event.addTimeout(3600*1000 + i, []() { });
+  }
+  int count = 0;
+  std::function<void (void)> chain = [&]() {
+    if (++count == iterations) {
+      event.exitLoop();
+    } else {
+      event.addTimeout(0, chain);
+    }
+  };
+  event.addTimeout(0, chain);
+  const auto start = std::chrono::steady_clock::now();
+  event.loop();
+  return nanosSince(start, iterations);
+}
+
+static double churn(int active, int iterations) {
+  Event event;
+  for (int i = 0; i < active; i++) {
+    event.addTimeout(3600*1000 + i, []() { });
+  }
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    event.removeTimeout(event.addTimeout(1800*1000 + i % 1000, []() { }));
+  }
+  return nanosSince(start, iterations);
+}
+
+static bool staleHandles() {
+  Event event;
+  bool fired = false;
+  const Event::Handle stale = event.addTimeout(0, []() { });
+  event.removeTimeout(stale);
+  event.addTimeout(0, [&fired]() { fired = true; });
+  event.removeTimeout(stale);
+  event.runExpired();
+  return fired;
+}
+
+int main() {
+  if (!staleHandles()) {
+    printf("A stale handle cancelled another timeout\n");
+    return 1;
+  }
+  static const int active[] = { 0, 10, 100, 1000, 10000, 100000 };
+  printf("%10s %16s %16s\n", "timers", "wakeup (ns)", "add+remove (ns)");
+  for (auto n : active) {
+    printf("%10d %16.1f %16.1f\n", n, wakeup(n, 100000), churn(n, 100000));
+  }
+  return 0;
+}
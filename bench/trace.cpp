@@ -0,0 +1,115 @@
+// Measures what tracing a report costs, compared to the iostream hex dump
+// that debug builds used to print for every report. Also records from
+// several threads at once, and checks that a dump taken while they are
+// running decodes cleanly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "util.h"
+
+enum { ITERATIONS = 1000000 };
+
+static const unsigned char report[15] = {
+  0x20, 0x01, 0x03, 0xE9, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+static double traceReports(bool clock) {
+  const Nanos tm = Util::nanos();
+  const Nanos start = Util::nanos();
+  for (int i = 0; i < ITERATIONS; i++) {
+    if (clock) {
+      Trace::record(Trace::REPORT_IN, 1, 0, report, sizeof(report));
+    } else {
+      Trace::record(tm, Trace::REPORT_IN, 1, 0, report, sizeof(report));
+    }
+  }
+  return (double)(Util::nanos() - start) / (double)ITERATIONS;
+}
+
+static double printReports() {
+  // This is what Harmony::handleReport() used to do. Even with the output
+  // going nowhere, the formatting alone is expensive.
+  std::ofstream out("/dev/null");
+  const Nanos start = Util::nanos();
+  for (int i = 0; i < ITERATIONS / 10; i++) {
+    out << "1-1.3" << " [ ";
+    for (int j = 0; j < (int)sizeof(report); j++) {
+      out << std::hex << std::setw(2) << std::setfill('0')
+          << (0xFF & (unsigned)report[j])
+          << std::dec << std::setw(0);
+      if (j != (int)sizeof(report) - 1) {
+        out << ", ";
+      }
+    }
+    out << " ]" << std::endl;
+  }
+  return (double)(Util::nanos() - start) / (ITERATIONS / 10);
+}
+
+static double contended(int threads) {
+  std::vector<std::thread> workers;
+  const Nanos start = Util::nanos();
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([]() { traceReports(true); });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return (double)(Util::nanos() - start) / (double)ITERATIONS;
+}
+
+static bool dumpWhileRecording(int *records) {
+  // Dump while another thread keeps overwriting the ring. Torn slots have
+  // to be skipped, and everything else has to decode.
+  char path[] = "/tmp/harmony-trace-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return false;
+  }
+  std::thread writer([]() { traceReports(true); });
+  const bool dumped = Trace::dump(fd);
+  writer.join();
+  close(fd);
+  FILE *in = fopen(path, "rb"), *out = tmpfile();
+  const bool ok = dumped && in && out && Trace::decode(in, out, false);
+  *records = 0;
+  if (ok) {
+    rewind(out);
+    for (int ch; (ch = getc(out)) != EOF; ) {
+      *records += ch == '\n';
+    }
+  }
+  if (in) {
+    fclose(in);
+  }
+  if (out) {
+    fclose(out);
+  }
+  unlink(path);
+  return ok;
+}
+
+int main() {
+  printf("%-22s %10s\n", "", "ns/report");
+  printf("%-22s %10.1f\n", "trace", traceReports(false));
+  printf("%-22s %10.1f\n", "trace, reading clock", traceReports(true));
+  printf("%-22s %10.1f\n", "trace, 2 threads", contended(2));
+  printf("%-22s %10.1f\n", "trace, 4 threads", contended(4));
+  printf("%-22s %10.1f\n", "iostream hex dump", printReports());
+  int records;
+  if (!dumpWhileRecording(&records)) {
+    printf("Dump failed to decode\n");
+    return 1;
+  }
+  printf("Dumped %d of %d records while recording\n", records, Trace::SIZE);
+  return 0;
+}
@@ -0,0 +1,200 @@
+// Presses and releases a key every few milliseconds while the event loop
+// runs slow callbacks that block it, and compares reading reports on the
+// loop with reading them on a separate thread. This models UsbTransport's
+// two modes; it doesn't run UsbTransport itself, which needs libusb and a
+// receiver. A thread plays the receiver, and can only hand over a report
+// while one of the four transfers is submitted; otherwise, it holds on to
+// the report for a while and then drops it. Reports travel over a pipe.
+// On the loop, transfers only get reaped and resubmitted when the loop gets
+// around to it. The reaper thread stamps reports as soon as they arrive,
+// and queues them through a Ring and an eventfd, like UsbTransport's USB
+// thread does. Reports how far off the report timestamps are, how long
+// keys take to reach the key callback, and how many reports got lost.
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "harmony.h"
+#include "ring.h"
+#include "util.h"
+
+enum { TRANSFERS = 4, BACKLOG_MS = 20, PERIOD_US = 2000, RUN_MS = 1000,
+       SLOW_EVERY_MS = 25 };
+
+struct Report {
+  unsigned seq;
+  Nanos sent;    // When the receiver had the report
+  Nanos tm;      // When it got reaped
+};
+
+static void sleepUntil(Nanos tm) {
+  const int64_t ns = tm - Util::nanos();
+  if (ns > 0) {
+    usleep(ns / 1000);
+  }
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  return sorted.empty() ? 0 :
+    sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))] / 1e6;
+}
+
+static void scenario(bool usbThread, unsigned slowMs) {
+  Event event;
+  Harmony harmony(&event);
+  const int receiver = harmony.addOfflineReceiver("simulated");
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK)) {
+    perror("pipe");
+    return;
+  }
+  const int eventFd = eventfd(0, EFD_NONBLOCK);
+
+  // Submitted transfers that the receiver can complete
+  std::atomic<int> submitted = { TRANSFERS };
+  std::atomic<bool> done = { false };
+  std::atomic<unsigned long> lost = { 0 };
+  unsigned sent = 0;
+  std::thread device([&]() {
+    std::deque<Report> held;
+    const Nanos start = Util::nanos();
+    for (Nanos next = start; next - start < RUN_MS*NANOS_PER_MS; ) {
+      const Nanos now = Util::nanos();
+      if ((int64_t)(now - next) >= 0) {
+        held.push_back({ sent++, next, 0 });
+        next += PERIOD_US*1000;
+      }
+      while (!held.empty() &&
+             now - held.front().sent > BACKLOG_MS*NANOS_PER_MS) {
+        held.pop_front();
+        lost++;
+      }
+      while (!held.empty() && submitted > 0) {
+        submitted--;
+        if (write(fds[1], &held.front(), sizeof(Report)) < 0) {
+          break;
+        }
+        held.pop_front();
+      }
+      sleepUntil(std::min(next, now + 200*1000));
+    }
+    lost += held.size();
+    done = true;
+  });
+
+  // The USB thread reaps transfers as soon as they complete
+  Ring<Report, 256> ring;
+  std::thread reaper;
+  if (usbThread) {
+    reaper = std::thread([&]() {
+      while (!done || submitted < TRANSFERS) {
+        Report r;
+        if (read(fds[0], &r, sizeof(r)) == sizeof(r)) {
+          r.tm = Util::nanos();
+          submitted++;
+          if (ring.push(r)) {
+            const uint64_t one = 1;
+            if (write(eventFd, &one, sizeof(one)) < 0) {
+            }
+          } else {
+            lost++;
+          }
+        } else {
+          // Like libusb_handle_events(), which waits for a completion
+          struct pollfd pfd = { fds[0], POLLIN, 0 };
+          poll(&pfd, 1, 1);
+        }
+      }
+    });
+  }
+
+  std::vector<uint64_t> stamps, keys;
+  Nanos released = 0;
+  harmony.setKeyCallback([&](const Harmony::KeyEvent &) {
+    keys.push_back(Util::nanos() - released);
+  });
+  auto inject = [&](const Report &r) {
+    // Even reports press the key, odd ones release it
+    unsigned char buf[15] = { 0x20, 1, Harmony::KEY_OK >> 16 };
+    if (!(r.seq & 1)) {
+      buf[3] = (unsigned char)(Harmony::KEY_OK >> 8);
+      buf[4] = (unsigned char)Harmony::KEY_OK;
+    }
+    stamps.push_back(r.tm - r.sent);
+    released = r.sent;
+    harmony.injectReport(receiver, buf, sizeof(buf), r.tm);
+  };
+  Event::Handle handle;
+  if (usbThread) {
+    handle = event.addPollFd(eventFd, POLLIN, [&]() {
+      uint64_t count;
+      if (read(eventFd, &count, sizeof(count)) < 0) {
+      }
+      Report r;
+      while (ring.pop(r)) {
+        inject(r);
+      }
+    });
+  } else {
+    handle = event.addPollFd(fds[0], POLLIN, [&]() {
+      Report r;
+      while (read(fds[0], &r, sizeof(r)) == sizeof(r)) {
+        r.tm = Util::nanos();
+        submitted++;
+        inject(r);
+      }
+    });
+  }
+  std::function<void ()> slow = [&]() {
+    // Blocks the loop, like waiting for a command to finish
+    usleep(slowMs*1000);
+    event.addTimeout(SLOW_EVERY_MS, slow);
+  };
+  if (slowMs) {
+    event.addTimeout(SLOW_EVERY_MS, slow);
+  }
+  event.addTimeout(RUN_MS + 100, [&event]() { event.exitLoop(); });
+  event.loop();
+  device.join();
+  if (usbThread) {
+    reaper.join();
+  }
+  event.removePollFd(handle);
+  close(fds[0]);
+  close(fds[1]);
+  close(eventFd);
+
+  std::sort(stamps.begin(), stamps.end());
+  std::sort(keys.begin(), keys.end());
+  char name[32];
+  snprintf(name, sizeof(name), "%s, %ums", usbThread ? "USB thread" : "loop",
+           slowMs);
+  printf("%-18s %8u %6lu %10.2f %10.2f %10.2f %10.2f\n", name, sent,
+         (unsigned long)lost, percentile(stamps, 0.99),
+         stamps.empty() ? 0 : stamps.back() / 1e6, percentile(keys, 0.99),
+         keys.empty() ? 0 : keys.back() / 1e6);
+}
+
+int main() {
+  printf("%-18s %8s %6s %10s %10s %10s %10s\n", "reads on, slow cb",
+         "reports", "lost", "stamp p99", "stamp max", "key p99",
+         "key max");
+  printf("%-18s %8s %6s %10s %10s %10s %10s\n", "", "", "", "(ms)", "(ms)",
+         "(ms)", "(ms)");
+  static const unsigned slow[] = { 0, 5, 15, 40 };
+  for (unsigned ms : slow) {
+    scenario(false, ms);
+    scenario(true, ms);
+  }
+  return 0;
+}
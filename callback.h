@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Type-erased callable, much like std::function. But callables that fit into
+// the inline buffer are stored right inside of the object, and never touch
+// the heap. That covers lambdas that capture a handful of pointers and
+// integers. Larger callables still work, but have to be allocated.
+template<typename Signature, size_t Size = 48>
+class InlineFunction;
+
+template<typename R, typename... Args, size_t Size>
+class InlineFunction<R (Args...), Size> {
+ public:
+  InlineFunction() { }
+  InlineFunction(std::nullptr_t) { }
+
+  template<typename F,
+           typename = typename std::enable_if<
+             !std::is_same<typename std::decay<F>::type,
+                           InlineFunction>::value>::type,
+           typename = decltype(std::declval<F &>()(std::declval<Args>()...))>
+  InlineFunction(F &&f) {
+    typedef typename std::decay<F>::type Fn;
+    if (isNull(f)) {
+      return;
+    }
+    if constexpr (fitsInline<Fn>()) {
+      new (buf) Fn(std::forward<F>(f));
+      invoke = [](void *p, Args... args) -> R {
+        return (*(Fn *)p)(std::forward<Args>(args)...); };
+      manage = [](Op op, void *dst, void *src) {
+        if (op == DESTROY) {
+          ((Fn *)dst)->~Fn();
+        } else if (op == MOVE) {
+          new (dst) Fn(std::move(*(Fn *)src));
+          ((Fn *)src)->~Fn();
+        } else {
+          new (dst) Fn(*(const Fn *)src);
+        } };
+    } else {
+      *(Fn **)buf = new Fn(std::forward<F>(f));
+      invoke = [](void *p, Args... args) -> R {
+        return (**(Fn **)p)(std::forward<Args>(args)...); };
+      manage = [](Op op, void *dst, void *src) {
+        if (op == DESTROY) {
+          delete *(Fn **)dst;
+        } else if (op == MOVE) {
+          *(Fn **)dst = *(Fn **)src;
+        } else {
+          *(Fn **)dst = new Fn(**(const Fn **)src);
+        } };
+    }
+  }
+
+  InlineFunction(InlineFunction &&other) { moveFrom(other); }
+  InlineFunction(const InlineFunction &other) { copyFrom(other); }
+  ~InlineFunction() { reset(); }
+
+  InlineFunction &operator=(InlineFunction &&other) {
+    if (this != &other) {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  InlineFunction &operator=(const InlineFunction &other) {
+    if (this != &other) {
+      reset();
+      copyFrom(other);
+    }
+    return *this;
+  }
+
+  InlineFunction &operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+
+  R operator()(Args... args) const {
+    return invoke((void *)buf, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return invoke != NULL; }
+
+  // Can tell whether a callable would have to be allocated
+  template<typename Fn>
+  static constexpr bool fitsInline() {
+    return sizeof(Fn) <= Size && alignof(Fn) <= alignof(max_align_t) &&
+           std::is_nothrow_move_constructible<Fn>::value;
+  }
+
+ private:
+  enum Op { MOVE, COPY, DESTROY };
+
+  template<typename F>
+  static bool isNull(const F &f) { return isNull(f, 0); }
+  template<typename F>
+  static auto isNull(const F &f, int) -> decltype(f == nullptr) {
+    return f == nullptr;
+  }
+  template<typename F>
+  static bool isNull(const F &, long) { return false; }
+
+  void reset() {
+    if (manage) {
+      manage(DESTROY, buf, NULL);
+    }
+    invoke = NULL;
+    manage = NULL;
+  }
+
+  void moveFrom(InlineFunction &other) {
+    if (other.manage) {
+      other.manage(MOVE, buf, other.buf);
+      invoke = other.invoke;
+      manage = other.manage;
+      other.invoke = NULL;
+      other.manage = NULL;
+    }
+  }
+
+  void copyFrom(const InlineFunction &other) {
+    if (other.manage) {
+      other.manage(COPY, buf, (void *)other.buf);
+      invoke = other.invoke;
+      manage = other.manage;
+    }
+  }
+
+  alignas(max_align_t) unsigned char buf[Size];
+  R (*invoke)(void *, Args...) = NULL;
+  void (*manage)(Op, void *, void *) = NULL;
+};
+
+typedef InlineFunction<void ()> Callback;
+
+// Non-owning reference to a callable. Copying it is as cheap as copying two
+// pointers, and it never allocates. But the callable has to outlive every
+// call made through the reference.
+template<typename Signature>
+class FunctionRef;
+
+template<typename R, typename... Args>
+class FunctionRef<R (Args...)> {
+ public:
+  FunctionRef() { }
+  FunctionRef(std::nullptr_t) { }
+
+  template<typename F,
+           typename = typename std::enable_if<
+             !std::is_same<typename std::decay<F>::type,
+                           FunctionRef>::value>::type,
+           typename = decltype(std::declval<F &>()(std::declval<Args>()...))>
+  FunctionRef(F &f)
+    : obj((void *)&f),
+      invoke([](void *p, Args... args) -> R {
+        return (*(F *)p)(std::forward<Args>(args)...); }) { }
+
+  R operator()(Args... args) const {
+    return invoke(obj, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return invoke != NULL; }
+
+ private:
+  void *obj = NULL;
+  R (*invoke)(void *, Args...) = NULL;
+};
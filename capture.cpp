@@ -0,0 +1,151 @@
+#include <string.h>
+
+#include <string>
+
+#include "capture.h"
+#include "event.h"
+#include "harmony.h"
+
+static const unsigned char magic[8] = { 'H', 'R', 'M', 'C', 'A', 'P', 0, 1 };
+
+Nanos CaptureReplay::clock = 0;
+
+bool CaptureWriter::open(const char *path) {
+  close();
+  fp = fopen(path, "wbe");
+  if (!fp) {
+    return false;
+  }
+  if (fwrite(magic, sizeof(magic), 1, fp) != 1) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool CaptureWriter::write(Nanos tm, int direction, int receiver,
+                          const unsigned char *buf, int len) {
+  if (!fp || len < 0 || len > CAPTURE_MAX_LEN) {
+    return false;
+  }
+  unsigned char hdr[11];
+  for (int i = 0; i < 8; i++) {
+    hdr[i] = tm >> (8*i);
+  }
+  hdr[8] = direction;
+  hdr[9] = receiver;
+  hdr[10] = len;
+  return fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+         (!len || fwrite(buf, len, 1, fp) == 1);
+}
+
+bool CaptureWriter::close() {
+  bool rc = true;
+  if (fp) {
+    rc = !fclose(fp);
+    fp = NULL;
+  }
+  return rc;
+}
+
+bool CaptureReader::open(const char *path) {
+  close();
+  fp = fopen(path, "rbe");
+  if (!fp) {
+    return false;
+  }
+  unsigned char buf[sizeof(magic)];
+  if (fread(buf, sizeof(buf), 1, fp) != 1 ||
+      memcmp(buf, magic, sizeof(magic))) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool CaptureReader::next(CaptureRecord *rec) {
+  unsigned char hdr[11];
+  if (!fp || fread(hdr, sizeof(hdr), 1, fp) != 1) {
+    return false;
+  }
+  rec->tm = 0;
+  for (int i = 0; i < 8; i++) {
+    rec->tm |= (Nanos)hdr[i] << (8*i);
+  }
+  rec->direction = hdr[8];
+  rec->receiver = hdr[9];
+  rec->len = hdr[10];
+  return rec->len <= CAPTURE_MAX_LEN &&
+         (!rec->len || fread(rec->buf, rec->len, 1, fp) == 1);
+}
+
+void CaptureReader::close() {
+  if (fp) {
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+CaptureReplay::CaptureReplay(Event *event, Harmony *harmony)
+  : event(event), harmony(harmony) {
+}
+
+CaptureReplay::~CaptureReplay() {
+  if (started) {
+    Util::setClock(NULL);
+  }
+}
+
+bool CaptureReplay::open(const char *path) {
+  return reader.open(path);
+}
+
+Nanos CaptureReplay::simulatedClock() {
+  return clock;
+}
+
+bool CaptureReplay::step() {
+  CaptureRecord rec;
+  if (!reader.next(&rec)) {
+    return false;
+  }
+  if (!started) {
+    // Time starts with the first record
+    clock = rec.tm;
+    Util::setClock(simulatedClock);
+    started = true;
+  }
+  advanceTo(rec.tm);
+  if (rec.direction == CAPTURE_IN) {
+    auto it = receivers.find(rec.receiver);
+    if (it == receivers.end()) {
+      it = receivers.emplace(rec.receiver, harmony->addOfflineReceiver(
+             "capture:" + std::to_string(rec.receiver))).first;
+    }
+    harmony->injectReport(it->second, rec.buf, rec.len, rec.tm);
+  }
+  return true;
+}
+
+void CaptureReplay::run() {
+  while (step()) {
+  }
+}
+
+void CaptureReplay::advanceTo(Nanos tm) {
+  // Step from one deadline to the next, so that timer callbacks see the
+  // time that they were scheduled for. Anything that is due right now
+  // runs last.
+  Nanos deadline;
+  while (event->getNextDeadline(&deadline) &&
+         (int64_t)(deadline - tm) < 0) {
+    if ((int64_t)(deadline - clock) > 0) {
+      clock = deadline;
+    }
+    event->runExpired();
+  }
+  if ((int64_t)(tm - clock) > 0) {
+    clock = tm;
+  }
+  event->runExpired();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+
+#include "util.h"
+
+class Event;
+class Harmony;
+
+// Compact binary log of the traffic between Harmony and its receivers. A
+// capture starts with 8 bytes: the magic "HRMCAP\0", and a version byte.
+// Then, it holds one record for every report read from a receiver and
+// every report sent to it:
+//   8 bytes  Util::nanos() timestamp, little-endian
+//   1 byte   direction (CAPTURE_IN or CAPTURE_OUT)
+//   1 byte   receiver id
+//   1 byte   length
+//   n bytes  raw report, starting with the report id
+// Records are written through stdio, so recording costs a copy into a
+// buffer, and never allocates once the file is open.
+enum { CAPTURE_IN = 0, CAPTURE_OUT = 1, CAPTURE_MAX_LEN = 64 };
+
+struct CaptureRecord {
+  Nanos tm;
+  int direction;
+  int receiver;
+  int len;
+  unsigned char buf[CAPTURE_MAX_LEN];
+};
+
+class CaptureWriter {
+ public:
+  ~CaptureWriter() { close(); }
+  bool open(const char *path);
+  bool write(Nanos tm, int direction, int receiver,
+             const unsigned char *buf, int len);
+  bool close();
+  bool isOpen() const { return fp != NULL; }
+
+ private:
+  FILE *fp = NULL;
+};
+
+class CaptureReader {
+ public:
+  ~CaptureReader() { close(); }
+  bool open(const char *path);
+  // Returns false at the end of the file, or if the file is corrupt
+  bool next(CaptureRecord *rec);
+  void close();
+
+ private:
+  FILE *fp = NULL;
+};
+
+// Feeds a capture through Harmony's decoding and key handling, with a
+// simulated clock that follows the timestamps in the capture. Timers fire
+// at their exact deadlines, in between the replayed reports, so long
+// presses and auto-repeat behave just like they did live. Every receiver
+// in the capture gets an offline receiver of its own. Reports that were
+// sent to the receiver are skipped.
+// The simulated clock is process-wide. Only one replay can run at a time,
+// and nothing else should be using the event loop concurrently.
+class CaptureReplay {
+ public:
+  CaptureReplay(Event *event, Harmony *harmony);
+  ~CaptureReplay();
+  bool open(const char *path);
+  // Replays the next record. Returns false once the capture is exhausted.
+  bool step();
+  // Replays everything that is left
+  void run();
+  // Moves the simulated clock forward, firing timers along the way
+  void advanceTo(Nanos tm);
+  Nanos now() const { return clock; }
+
+ private:
+  static Nanos simulatedClock();
+
+  Event *event;
+  Harmony *harmony;
+  CaptureReader reader;
+  std::map<int, int> receivers; // Capture's receiver id to offline receiver
+  bool started = false;
+
+  static Nanos clock;
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+// C++20 coroutines on top of Event and Harmony. Multi-step HID++ flows can
+// be written as straight-line code, and any number of them run
+// concurrently on the existing event loop, without threads:
+//
+//   Task<> enumerate(Harmony *harmony, int receiver) {
+//     for (int i = 0; i < 6; i++) {
+//       const unsigned char buf[7] = { 0x10, 0xFF, 0x83, 0xB5,
+//                                      (unsigned char)(0x40 + i) };
+//       Coro::Response rsp = co_await Coro::request(harmony, receiver, buf);
+//       ...
+//       co_await Coro::sleep(event, 100);
+//     }
+//   }
+//   enumerate(&harmony, 1).detach();
+//
+// Sleeping, waiting for file descriptors and waiting for keys never
+// allocate. Event callbacks only capture a pointer, and coroutine frames are
+// recycled once they finish. Requests don't either, once Harmony's request
+// queue has grown to its high-water mark.
+// A coroutine has to run to completion; destroying it while it is suspended
+// isn't supported.
+// This needs a compiler with coroutine support (e.g. "make STD=gnu++20").
+// Otherwise, the header is empty.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define HAVE_COROUTINES 1
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include "event.h"
+#include "harmony.h"
+#include "transport.h"
+
+// Frames get pooled by size in 64 byte steps. Every thread has its own
+// pool; a frame that is released on a different thread goes into that
+// thread's pool. Larger frames, and frames that don't fit into a full pool,
+// just go back to the heap.
+class CoroFramePool {
+ public:
+  static void *alloc(size_t size) {
+    const size_t bucket = (size + STEP - 1) / STEP;
+    if (bucket < BUCKETS && !pool()[bucket].empty()) {
+      void *frame = pool()[bucket].back();
+      pool()[bucket].pop_back();
+      return frame;
+    }
+    return ::operator new(bucket < BUCKETS ? bucket * STEP : size);
+  }
+
+  static void release(void *frame, size_t size) {
+    const size_t bucket = (size + STEP - 1) / STEP;
+    if (bucket < BUCKETS && pool()[bucket].size() < KEEP) {
+      pool()[bucket].push_back(frame);
+    } else {
+      ::operator delete(frame);
+    }
+  }
+
+ private:
+  enum { STEP = 64, BUCKETS = 32, KEEP = 64 };
+
+  static std::vector<void *> *pool() {
+    static thread_local struct Pool {
+      std::vector<void *> frames[BUCKETS];
+      ~Pool() {
+        for (auto &bucket : frames) {
+          for (auto frame : bucket) {
+            ::operator delete(frame);
+          }
+        }
+      }
+    } pool;
+    return pool.frames;
+  }
+};
+
+template<typename T>
+struct CoroResult {
+  T value { };
+  void return_value(T v) { value = std::move(v); }
+  T get() { return std::move(value); }
+};
+
+template<>
+struct CoroResult<void> {
+  void return_void() { }
+  void get() { }
+};
+
+// A coroutine that starts suspended. Awaiting it from another coroutine
+// runs it, and resumes the caller once it returns. Alternatively, it can
+// be detached, and then cleans up after itself.
+template<typename T = void>
+class Task {
+ public:
+  struct promise_type : CoroResult<T> {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    static void *operator new(size_t size) {
+      return CoroFramePool::alloc(size);
+    }
+    static void operator delete(void *frame, size_t size) {
+      CoroFramePool::release(frame, size);
+    }
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return { }; }
+    auto final_suspend() noexcept {
+      struct Final {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<promise_type> h) noexcept {
+          promise_type &p = h.promise();
+          if (p.detached) {
+            h.destroy();
+            return std::noop_coroutine();
+          }
+          return p.continuation ? p.continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept { }
+      };
+      return Final { };
+    }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task &&other) : handle(std::exchange(other.handle, nullptr)) { }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const { return !handle || handle.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+    handle.promise().continuation = caller;
+    return handle;
+  }
+  T await_resume() { return handle.promise().get(); }
+
+  // Runs the task up to its first suspension point, and lets go of it
+  void detach() {
+    auto h = std::exchange(handle, nullptr);
+    h.promise().detached = true;
+    h.resume();
+  }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h) { }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+class Coro {
+ public:
+  // Result of a HID++ request. "ok" is false for error responses, and if
+  // there was no response at all; then "len" is zero. DJ reports don't have
+  // a response, and "ok" only tells whether they could be sent.
+  struct Response {
+    bool ok;
+    int len;
+    unsigned char buf[TransportEvent::MAX_LEN];
+  };
+
+  // Resumes after "ms" milliseconds
+  static auto sleep(Event *event, unsigned ms) {
+    struct Awaiter {
+      Event *event;
+      unsigned ms;
+      std::coroutine_handle<> handle;
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        event->addTimeout(ms, [this]() { handle.resume(); });
+      }
+      void await_resume() const { }
+    };
+    return Awaiter { event, ms, nullptr };
+  }
+
+  // Resumes once "fd" is readable (or "events" are pending)
+  static auto readable(Event *event, int fd, short events = POLLIN) {
+    struct Awaiter {
+      Event *event;
+      int fd;
+      short events;
+      std::coroutine_handle<> handle;
+      Event::Handle pollFd;
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        pollFd = event->addPollFd(fd, events, [this]() {
+                                    event->removePollFd(pollFd);
+                                    handle.resume(); });
+      }
+      void await_resume() const { }
+    };
+    return Awaiter { event, fd, events, nullptr, Event::Handle() };
+  }
+
+  // Sends a HID++ request, and resumes with the response. Requests are
+  // queued and retried just like with Harmony::sendHIDppRequest().
+  static auto request(Harmony *harmony, int receiver,
+                      const unsigned char *buf) {
+    struct Awaiter {
+      Harmony *harmony;
+      int receiver;
+      const unsigned char *buf;
+      std::coroutine_handle<> handle;
+      Response rsp;
+      bool await_ready() const { return false; }
+      bool await_suspend(std::coroutine_handle<> h) {
+        // If the request can't even be queued, resume right away. So do DJ
+        // reports, which never get a response.
+        handle = h;
+        if (buf[0] == 0x20 || buf[0] == 0x21) {
+          rsp.ok = receiver ? harmony->sendHIDppRequest(receiver, buf)
+                            : harmony->sendHIDppRequest(buf);
+          return false;
+        }
+        auto ok = [this](int len, const unsigned char *buf) {
+                    done(true, len, buf); };
+        auto err = [this](int len, const unsigned char *buf) {
+                     done(false, len, buf); };
+        return receiver ? harmony->sendHIDppRequest(receiver, buf, ok, err)
+                        : harmony->sendHIDppRequest(buf, ok, err);
+      }
+      Response await_resume() const { return rsp; }
+      void done(bool ok, int len, const unsigned char *buf) {
+        rsp.ok = ok && len;
+        rsp.len = std::min(len, (int)sizeof(rsp.buf));
+        if (rsp.len) {
+          memcpy(rsp.buf, buf, rsp.len);
+        }
+        handle.resume();
+      }
+    };
+    return Awaiter { harmony, receiver, buf, nullptr, { false, 0, { } } };
+  }
+
+  // Sends the request to the first receiver
+  static auto request(Harmony *harmony, const unsigned char *buf) {
+    return request(harmony, 0, buf);
+  }
+
+  // Resumes with the next key. Until then, keys don't go to the key
+  // callback.
+  static auto nextKey(Harmony *harmony) {
+    struct Awaiter {
+      Harmony *harmony;
+      std::coroutine_handle<> handle;
+      Harmony::KeyEvent ev;
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        harmony->waitForKey(*this);
+      }
+      Harmony::KeyEvent await_resume() const { return ev; }
+      void operator()(const Harmony::KeyEvent &ev) {
+        this->ev = ev;
+        handle.resume();
+      }
+    };
+    return Awaiter { harmony, nullptr, { } };
+  }
+};
+
+#endif
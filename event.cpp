@@ -2,204 +2,630 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "event.h"
 #include "util.h"
 
 
-Event::Event() {
+// Tags for the descriptors that Event uses internally
+static char wakeTag, timerTag;
+
+Event::Event(Backend backend, bool preciseTimers)
+  : postedHead(new Posted()), owner(std::this_thread::get_id()) {
+  postedTail = postedHead;
+  wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (backend == BACKEND_EPOLL) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+  }
+  if (epollFd >= 0 && wakeFd >= 0) {
+    // Internal descriptors don't have EpollFd records
+    struct epoll_event ev = { };
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeTag;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+  }
+  if (epollFd >= 0 && preciseTimers &&
+      (timerFd = timerfd_create(CLOCK_MONOTONIC,
+                                TFD_NONBLOCK | TFD_CLOEXEC)) >= 0) {
+    struct epoll_event ev = { };
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timerTag;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+  }
+  // With ppoll(), the wakeup descriptor always goes last
+  fds.push_back({ wakeFd, POLLIN, 0 });
 }
 
 Event::~Event() {
-  recomputeTimeoutsAndFds();
-  for (auto it = timeouts.begin(); it != timeouts.end(); it++) {
-    delete(*it);
+  // Callbacks that were posted, but never picked up, are dropped
+  while (postedTail) {
+    Posted *next = postedTail->next;
+    delete postedTail;
+    postedTail = next;
+  }
+  if (wakeFd >= 0) {
+    close(wakeFd);
+  }
+  if (timerFd >= 0) {
+    close(timerFd);
   }
-  for (auto it = pollFds.begin(); it != pollFds.end(); it++) {
-    delete(*it);
+  // Handlers and timeouts go away with their slabs
+  for (auto it = epollFds.begin(); it != epollFds.end(); it++) {
+    delete(it->second);
+  }
+  if (epollFd >= 0) {
+    close(epollFd);
   }
-  delete[] fds;
 }
 
 void Event::loop() {
   recomputeTimeoutsAndFds();
-  while (!done && (!pollFds.empty() || !timeouts.empty() || !later.empty())) {
-    // Find timeout that will fire next, if any
-    unsigned now = Util::millis();
-    unsigned tmo = later.empty() ? 0 : now + 1;
-    for (auto it = timeouts.begin(); it != timeouts.end(); it++) {
-      if (*it && (!tmo || tmo > (*it)->tmo)) {
-        tmo = (*it)->tmo;
+  for (;;) {
+    sweepEpollFds();
+    runPosted();
+    if (done ||
+        (!hasPollFds() && timeouts.empty() && laterPos == later.size())) {
+      break;
+    }
+    runOnce();
+  }
+}
+
+void Event::runOnce() {
+  // Waits for the next batch of events, and dispatches them. This can be
+  // called from within a callback, if a synchronous API needs to wait for
+  // events. But nested calls defer all cleanup to the outermost call.
+  if (!depth++) {
+    owner = std::this_thread::get_id();
+  }
+  runPosted();
+  // Find timeout that will fire next, if any. A negative value means that
+  // there is nothing to wait for but file descriptors.
+  const Nanos now = Util::nanos();
+  int64_t tmo = -1;
+  if (laterPos < later.size()) {
+    tmo = 0;
+  } else if (!timeouts.empty()) {
+    tmo = std::max((int64_t)0,
+                   (int64_t)(timeoutSlab[timeouts.front()].tmo - now));
+  }
+  if (!tmo) {
+    // If the timeout has already expired, handle it now. But first, look
+    // for file descriptors that are ready, so that a steady stream of
+    // timers can't starve them.
+    if (depth == 1) {
+      dispatchStart = Util::nanos();
+    }
+    if (!hasPollFds() ||
+        (epollFd >= 0 ? waitEpoll(0) : waitPoll(0)) != 0) {
+      handleTimeouts(Util::nanos());
+    }
+  } else if (epollFd >= 0) {
+    // Wait for next event
+    waitEpoll(tmo);
+  } else {
+    waitPoll(tmo);
+  }
+  if (depth == 1 && dispatchStart) {
+    // Keep track of how long callbacks kept us from waiting for new events
+    maxStall = std::max(maxStall, Util::nanos() - dispatchStart);
+    dispatchStart = 0;
+  }
+  depth--;
+  sweepEpollFds();
+}
+
+void Event::runExpired() {
+  if (!depth++) {
+    owner = std::this_thread::get_id();
+  }
+  runPosted();
+  handleTimeouts(Util::nanos());
+  depth--;
+  sweepEpollFds();
+}
+
+bool Event::getNextDeadline(Nanos *deadline) const {
+  if (timeouts.empty()) {
+    return false;
+  }
+  *deadline = timeoutSlab[timeouts.front()].tmo;
+  return true;
+}
+
+bool Event::hasPollFds() const {
+  return epollFd >= 0 ? !epollFds.empty() : !pollFds.empty();
+}
+
+int Event::waitPoll(int64_t tmo) {
+  struct timespec ts = { (time_t)(tmo / 1000000000),
+                         (long)(tmo % 1000000000) };
+  int nFds = pollFds.size();
+  const int rc = ppoll(&fds[0], nFds + 1, tmo >= 0 ? &ts : NULL, NULL);
+  if (depth == 1) {
+    dispatchStart = Util::nanos();
+  }
+  if (!rc) {
+    handleTimeouts(Util::nanos());
+  } else if (rc > 0) {
+    // Count down a copy, as the caller wants to know whether anything was
+    // ready
+    int ready = rc;
+    if (fds[nFds].revents) {
+      fds[nFds].revents = 0;
+      ready--;
+      wakeUp();
+    }
+    // Handlers can be added while we iterate, but they only show up in
+    // "pollFds" after recomputeTimeoutsAndFds().
+    for (int i = 0; ready > 0 && i < nFds; i++) {
+      if (fds[i].revents) {
+        PollFd &pfd = pollFdSlab[pollFds[i]];
+        if (!pfd.removed) {
+          pfd.cb();
+        }
+        fds[i].revents = 0;
+        ready--;
       }
     }
-    if (tmo) {
-      // If the timeout has already expired, handle it now
-      if (tmo <= now || !later.empty()) {
-        handleTimeouts(now);
+  }
+  recomputeTimeoutsAndFds();
+  return rc;
+}
+
+int Event::waitEpoll(int64_t tmo) {
+  // epoll counts in milliseconds. Round up, so that we never wake up before
+  // the deadline and then spin. With a timerfd, the kernel does the timing
+  // instead.
+  int ms = -1;
+  if (!tmo) {
+    ms = 0;
+  } else if (tmo > 0 && timerFd >= 0) {
+    armTimerFd(timeoutSlab[timeouts.front()].tmo, tmo);
+  } else if (tmo >= 0) {
+    ms = (int)std::min((int64_t)INT_MAX,
+                       (tmo + (int64_t)NANOS_PER_MS - 1) /
+                       (int64_t)NANOS_PER_MS);
+  }
+  struct epoll_event events[64];
+  int rc = epoll_pwait(epollFd, events, sizeof(events)/sizeof(*events),
+                       ms, NULL);
+  if (depth == 1) {
+    dispatchStart = Util::nanos();
+  }
+  if (!rc) {
+    handleTimeouts(Util::nanos());
+  } else if (rc > 0) {
+    for (int i = 0; i < rc; i++) {
+      // Handlers can be added while we iterate, so don't use iterators.
+      // Removed handlers stay in the vector until sweepEpollFds().
+      EpollFd *efd = (EpollFd *)events[i].data.ptr;
+      if (events[i].data.ptr == &wakeTag) {
+        wakeUp();
+        continue;
+      } else if (events[i].data.ptr == &timerTag) {
+        uint64_t count;
+        if (read(timerFd, &count, sizeof(count)) < 0) {
+          // Already consumed
+        }
+        timerArmed = false;
+        handleTimeouts(Util::nanos());
         continue;
-      } else {
-        tmo -= now;
       }
-    }
-    // Wait for next event
-    struct timespec ts = { (long)tmo / 1000L, (long)tmo*1000000L };
-    int nFds = pollFds.size();
-    int rc = ppoll(fds, nFds, tmo ? &ts : NULL, NULL);
-    if (!rc) {
-      handleTimeouts(Util::millis());
-    } else if (rc > 0) {
-      int i = 0;
-      for (auto it = pollFds.begin();
-           rc > 0 && it != pollFds.end(); it++, i++) {
-        if (fds[i].revents) {
-          if (*it) {
-            (*it)->cb();
-          }
-          fds[i].revents = 0;
-          rc--;
+      // Handlers that get added by a callback only see later events.
+      const size_t n = efd->handlers.size();
+      for (size_t j = 0; j < n; j++) {
+        PollFd &pfd = pollFdSlab[efd->handlers[j]];
+        if (!pfd.removed &&
+            (events[i].events & (pfd.events | POLLERR | POLLHUP))) {
+          pfd.cb();
         }
       }
-      recomputeTimeoutsAndFds();
     }
-    recomputeTimeoutsAndFds();
   }
+  return rc;
+}
+
+void Event::armTimerFd(Nanos deadline, int64_t tmo) {
+  // Timers are one-shot. Only touch the timerfd, if the next deadline
+  // changed. The timerfd runs on the system clock, so it gets armed with
+  // a relative timeout; that keeps it working with a custom clock.
+  if (timerArmed && timerDeadline == deadline) {
+    return;
+  }
+  struct itimerspec its = { };
+  its.it_value.tv_sec = tmo / 1000000000;
+  its.it_value.tv_nsec = tmo % 1000000000;
+  timerfd_settime(timerFd, 0, &its, NULL);
+  timerArmed = true;
+  timerDeadline = deadline;
 }
 
 void Event::exitLoop() {
   done = true;
 }
 
-void *Event::addPollFd(int fd, short events, std::function<void (void)> cb) {
-  if (!newFds) {
-    newFds = new std::vector<PollFd *>(pollFds);
+Event::Handle Event::addPollFd(int fd, short events, Callback cb) {
+  const uint32_t slot = pollFdSlab.alloc();
+  PollFd &pfd = pollFdSlab[slot];
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.removed = false;
+  pfd.generation = nextGeneration();
+  pfd.cb = std::move(cb);
+  if (epollFd >= 0) {
+    EpollFd *&efd = epollFds[fd];
+    if (!efd) {
+      efd = new EpollFd();
+      efd->fd = fd;
+    }
+    efd->handlers.push_back(slot);
+    updateEpollFd(efd);
+  } else {
+    // Create vector with future poll information
+    if (!fdsChanged) {
+      newFds = pollFds;
+      fdsChanged = true;
+    }
+    newFds.push_back(slot);
   }
-  PollFd *pfd = new PollFd(fd, events, cb);
-  newFds->push_back(pfd);
-  return pfd;
+  Handle handle;
+  handle.index = slot + 1;
+  handle.generation = pfd.generation;
+  return handle;
 }
 
 void Event::removePollFd(int fd, short events) {
-  // Create vector with future poll information
-  if (!newFds) {
-    newFds = new std::vector<PollFd *>(pollFds);
-  }
-  // Zero out existing record. This avoids the potential for races
-  for (auto it = pollFds.begin(); it != pollFds.end(); it++) {
-    if (*it &&
-        fd == (*it)->fd &&
-        (!events || events == (*it)->events)) {
-      *it = NULL;
-    }
-  }
-  // Remove fd from future list
-  for (auto it = newFds->rbegin(); it != newFds->rend();) {
-    if (fd == (*it)->fd &&
-        (!events || events == (*it)->events)) {
-      delete *it;
-      auto iter = newFds->erase(--it.base());
-      it = std::reverse_iterator<typeof iter>(iter);
-    } else {
-      ++it;
+  if (epollFd >= 0) {
+    auto it = epollFds.find(fd);
+    if (it != epollFds.end()) {
+      for (auto h = it->second->handlers.begin();
+           h != it->second->handlers.end(); h++) {
+        PollFd &pfd = pollFdSlab[*h];
+        if (!events || events == pfd.events) {
+          pfd.removed = true;
+        }
+      }
+      updateEpollFd(it->second);
+    }
+    return;
+  }
+  // Only mark the records. This avoids the potential for races, and
+  // recomputeTimeoutsAndFds() drops them from the future list.
+  if (!fdsChanged) {
+    newFds = pollFds;
+    fdsChanged = true;
+  }
+  for (auto it = newFds.begin(); it != newFds.end(); it++) {
+    PollFd &pfd = pollFdSlab[*it];
+    if (fd == pfd.fd && (!events || events == pfd.events)) {
+      pfd.removed = true;
     }
   }
 }
 
-void Event::removePollFd(void *handle) {
-  // Create vector with future poll information
-  if (!newFds) {
-    newFds = new std::vector<PollFd *>(pollFds);
+void Event::removePollFd(Handle handle) {
+  PollFd *pfd = findPollFd(handle);
+  if (!pfd || pfd->removed) {
+    return;
   }
-  // Zero out existing record. This avoids the potential for races
-  for (auto it = pollFds.begin(); it != pollFds.end(); it++) {
-    if (*it && *it == handle) {
-      *it = NULL;
+  pfd->removed = true;
+  if (epollFd >= 0) {
+    auto it = epollFds.find(pfd->fd);
+    if (it != epollFds.end()) {
+      updateEpollFd(it->second);
     }
+  } else if (!fdsChanged) {
+    newFds = pollFds;
+    fdsChanged = true;
   }
-  // Remove fd from future list
-  for (auto it = newFds->rbegin(); it != newFds->rend();) {
-    if (*it == handle) {
-      delete *it;
-      auto iter = newFds->erase(--it.base());
-      it = std::reverse_iterator<typeof iter>(iter);
-    } else {
-      ++it;
+}
+
+uint32_t Event::nextGeneration() {
+  // Both slabs share the counter, so that a handle for a timeout can never
+  // match a file descriptor handler. Zero marks unused slots.
+  if (!++generation) {
+    generation++;
+  }
+  return generation;
+}
+
+Event::PollFd *Event::findPollFd(Handle handle) {
+  // A handle is only valid, if its slot hasn't been reused since
+  const uint32_t slot = handle.index - 1;
+  if (!handle || !pollFdSlab.contains(slot) ||
+      pollFdSlab[slot].generation != handle.generation) {
+    return NULL;
+  }
+  return &pollFdSlab[slot];
+}
+
+void Event::releasePollFd(uint32_t slot) {
+  PollFd &pfd = pollFdSlab[slot];
+  pfd.generation = 0;
+  pfd.cb = nullptr;
+  pollFdSlab.release(slot);
+}
+
+Event::Handle Event::addTimeout(unsigned tmo, Callback cb) {
+  return addTimeoutAt(Util::nanos() + tmo*NANOS_PER_MS, std::move(cb));
+}
+
+Event::Handle Event::addTimeoutAt(Nanos deadline, Callback cb) {
+  const uint32_t slot = timeoutSlab.alloc();
+  Timeout &t = timeoutSlab[slot];
+  t.tmo = deadline;
+  t.seq = timeoutSeq++;
+  t.generation = nextGeneration();
+  t.cb = std::move(cb);
+  t.idx = timeouts.size();
+  timeouts.push_back(slot);
+  siftUp(t.idx);
+  Handle handle;
+  handle.index = slot + 1;
+  handle.generation = t.generation;
+  return handle;
+}
+
+void Event::removeTimeout(Handle handle) {
+  // Timeouts that already fired or that were cancelled before have had
+  // their generation reset. Ignore them.
+  const uint32_t slot = handle.index - 1;
+  if (handle && timeoutSlab.contains(slot) &&
+      timeoutSlab[slot].generation == handle.generation &&
+      timeoutSlab[slot].idx >= 0) {
+    removeFromHeap(slot);
+    releaseTimeout(slot);
+  }
+}
+
+void Event::releaseTimeout(uint32_t slot) {
+  Timeout &t = timeoutSlab[slot];
+  t.generation = 0;
+  t.cb = nullptr;
+  timeoutSlab.release(slot);
+}
+
+void Event::handleTimeouts(Nanos now) {
+  // Timeouts that get added by one of the callbacks have to wait for the
+  // next iteration of the loop, even if they have already expired.
+  const unsigned long seq = timeoutSeq;
+  while (!timeouts.empty()) {
+    const uint32_t slot = timeouts.front();
+    Timeout &t = timeoutSlab[slot];
+    if ((int64_t)(now - t.tmo) < 0 || t.seq >= seq) {
+      break;
+    }
+    removeFromHeap(slot);
+    Callback cb = std::move(t.cb);
+    releaseTimeout(slot);
+    cb();
+  }
+  // Callbacks can queue more callbacks, or call us recursively. Whoever
+  // drains the queue resets it, but its capacity is kept for next time.
+  while (laterPos < later.size()) {
+    Callback cb = std::move(later[laterPos++]);
+    cb();
+  }
+  later.clear();
+  laterPos = 0;
+  recomputeTimeoutsAndFds();
+}
+
+void Event::runLater(Callback cb) {
+  if (std::this_thread::get_id() == owner) {
+    later.push_back(std::move(cb));
+  } else {
+    Posted *p = new Posted();
+    p->cb = std::move(cb);
+    post(p);
+  }
+}
+
+void Event::postTimeout(unsigned tmo, Callback cb) {
+  if (std::this_thread::get_id() == owner) {
+    addTimeout(tmo, std::move(cb));
+  } else {
+    Posted *p = new Posted();
+    p->hasTmo = true;
+    p->tmo = Util::nanos() + tmo*NANOS_PER_MS;
+    p->cb = std::move(cb);
+    post(p);
+  }
+}
+
+void Event::post(Posted *p) {
+  // Publish the node, then make sure that the loop wakes up. Only the first
+  // producer after the loop last drained the queue has to write to the
+  // eventfd.
+  Posted *prev = postedHead.exchange(p, std::memory_order_acq_rel);
+  prev->next.store(p, std::memory_order_release);
+  if (!wakePending.exchange(true) && wakeFd >= 0) {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+      // The counter can't overflow in practice
     }
   }
 }
 
-void *Event::addTimeout(unsigned tmo, std::function<void(void)> cb) {
-  if (!newTimeouts) {
-    newTimeouts = new std::vector<Timeout *>(timeouts);
+void Event::wakeUp() {
+  // Called when the eventfd is readable. Reset it before looking at the
+  // queue, so that no producer's wakeup gets lost.
+  uint64_t count;
+  if (read(wakeFd, &count, sizeof(count)) < 0) {
+    // Nothing to read
   }
-  newTimeouts->push_back(new Timeout(tmo + Util::millis(), cb));
-  return newTimeouts->back();
+  wakePending = false;
+  runPosted();
 }
 
-void Event::removeTimeout(void *handle) {
-  // Create vector with future timeouts
-  if (!newTimeouts) {
-    newTimeouts = new std::vector<Timeout *>(timeouts);
+void Event::runPosted() {
+  // Move callbacks from other threads into our own, single-threaded queues.
+  // The tail always points to an already consumed node. A producer that is
+  // halfway through post() hides everything after it, until it's done; it
+  // then wakes us up again.
+  Posted *next;
+  while ((next = postedTail->next.load(std::memory_order_acquire)) != NULL) {
+    delete postedTail;
+    postedTail = next;
+    if (next->hasTmo) {
+      addTimeoutAt(next->tmo, std::move(next->cb));
+    } else {
+      later.push_back(std::move(next->cb));
+    }
+    next->cb = nullptr;
   }
-  // Zero out existing record. This avoids the potential for races
-  for (auto it = timeouts.begin(); it != timeouts.end(); it++) {
-    if (*it == handle) {
-      *it = NULL;
+}
+
+void Event::recomputeTimeoutsAndFds() {
+  if (fdsChanged && depth <= 1) {
+    // Every live handler is in the future list. So, this is the one place
+    // where removed handlers get released.
+    fds.clear();
+    size_t n = 0;
+    for (auto it = newFds.begin(); it != newFds.end(); it++) {
+      PollFd &pfd = pollFdSlab[*it];
+      if (pfd.removed) {
+        releasePollFd(*it);
+      } else {
+        newFds[n++] = *it;
+        fds.push_back({ pfd.fd, pfd.events, 0 });
+      }
     }
+    newFds.resize(n);
+    fds.push_back({ wakeFd, POLLIN, 0 });
+    pollFds.swap(newFds);
+    newFds.clear();
+    fdsChanged = false;
   }
-  // Remove timeout from future list
-  for (auto it = newTimeouts->rbegin(); it != newTimeouts->rend();) {
-    if (handle == *it) {
-      delete *it;
-      auto iter = newTimeouts->erase(--it.base());
-      it = std::reverse_iterator<typeof iter>(iter);
+}
+
+void Event::updateEpollFd(EpollFd *efd) {
+  // Tell the kernel about the combined set of events that we are
+  // interested in for this file descriptor.
+  int mask = 0;
+  bool live = false, removed = false;
+  for (auto it = efd->handlers.begin(); it != efd->handlers.end(); it++) {
+    const PollFd &pfd = pollFdSlab[*it];
+    if (pfd.removed) {
+      removed = true;
     } else {
-      ++it;
+      live = true;
+      mask |= pfd.events;
     }
   }
+  struct epoll_event ev = { };
+  ev.events = mask;
+  ev.data.ptr = efd;
+  if (!live) {
+    if (efd->registered) {
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, efd->fd, &ev);
+      efd->registered = false;
+    }
+  } else if (!efd->registered) {
+    efd->registered = !epoll_ctl(epollFd, EPOLL_CTL_ADD, efd->fd, &ev);
+  } else if (mask != efd->mask &&
+             epoll_ctl(epollFd, EPOLL_CTL_MOD, efd->fd, &ev) &&
+             errno == ENOENT) {
+    // The file descriptor was closed and reopened without telling us
+    efd->registered = !epoll_ctl(epollFd, EPOLL_CTL_ADD, efd->fd, &ev);
+  }
+  efd->mask = mask;
+  if (removed && !efd->dirty) {
+    efd->dirty = true;
+    dirtyEpollFds.push_back(efd);
+  }
 }
 
-void Event::handleTimeouts(unsigned now) {
-  for (auto it = timeouts.begin(); it != timeouts.end(); it++) {
-    if (*it && now >= (*it)->tmo) {
-      auto cb = (*it)->cb;
-      removeTimeout(*it);
-      cb();
+void Event::sweepEpollFds() {
+  // Now that no more events are being dispatched, it is safe to delete
+  // handlers that were removed in the meantime.
+  if (depth) {
+    return;
+  }
+  for (auto it = dirtyEpollFds.begin(); it != dirtyEpollFds.end(); it++) {
+    EpollFd *efd = *it;
+    efd->dirty = false;
+    for (auto h = efd->handlers.begin(); h != efd->handlers.end(); ) {
+      if (pollFdSlab[*h].removed) {
+        releasePollFd(*h);
+        h = efd->handlers.erase(h);
+      } else {
+        h++;
+      }
+    }
+    if (efd->handlers.empty()) {
+      epollFds.erase(efd->fd);
+      delete(efd);
     }
   }
-  while (!later.empty()) {
-    std::vector<std::function<void (void)> > tmp;
-    tmp.swap(later);
-    for (auto it = tmp.begin(); it != tmp.end(); it++) {
-      (*it)();
+  dirtyEpollFds.clear();
+}
+
+bool Event::isEarlier(uint32_t a, uint32_t b) {
+  // Compare the signed difference, so that wraparound doesn't matter
+  const Timeout &ta = timeoutSlab[a], &tb = timeoutSlab[b];
+  const int64_t delta = (int64_t)(ta.tmo - tb.tmo);
+  return delta < 0 || (!delta && ta.seq < tb.seq);
+}
+
+void Event::siftUp(int idx) {
+  const uint32_t slot = timeouts[idx];
+  while (idx > 0) {
+    int parent = (idx - 1) / 2;
+    if (!isEarlier(slot, timeouts[parent])) {
+      break;
     }
+    timeouts[idx] = timeouts[parent];
+    timeoutSlab[timeouts[idx]].idx = idx;
+    idx = parent;
   }
-  recomputeTimeoutsAndFds();
+  timeouts[idx] = slot;
+  timeoutSlab[slot].idx = idx;
 }
 
-void Event::runLater(std::function<void(void)> cb) {
-  later.push_back(cb);
+void Event::siftDown(int idx) {
+  const int n = timeouts.size();
+  const uint32_t slot = timeouts[idx];
+  for (;;) {
+    int child = 2*idx + 1;
+    if (child >= n) {
+      break;
+    }
+    if (child + 1 < n && isEarlier(timeouts[child + 1], timeouts[child])) {
+      child++;
+    }
+    if (!isEarlier(timeouts[child], slot)) {
+      break;
+    }
+    timeouts[idx] = timeouts[child];
+    timeoutSlab[timeouts[idx]].idx = idx;
+    idx = child;
+  }
+  timeouts[idx] = slot;
+  timeoutSlab[slot].idx = idx;
 }
 
-void Event::recomputeTimeoutsAndFds() {
-  if (newFds) {
-    delete[] fds;
-    fds = new struct ::pollfd[newFds->size()];
-    int i = 0;
-    for (auto it = newFds->begin(); it != newFds->end(); it++, i++) {
-      fds[i].fd = (*it)->fd;
-      fds[i].events = (*it)->events;
-      fds[i].revents = 0;
-    }
-    pollFds.clear();
-    pollFds.swap(*newFds);
-    delete newFds;
-    newFds = NULL;
-  }
-  if (newTimeouts) {
-    timeouts.clear();
-    timeouts.swap(*newTimeouts);
-    delete newTimeouts;
-    newTimeouts = NULL;
+void Event::removeFromHeap(uint32_t slot) {
+  // Move the last entry into the hole, then restore the heap property in
+  // whichever direction is needed.
+  const int idx = timeoutSlab[slot].idx;
+  const uint32_t last = timeouts.back();
+  timeouts.pop_back();
+  timeoutSlab[slot].idx = -1;
+  if (last != slot) {
+    timeouts[idx] = last;
+    timeoutSlab[last].idx = idx;
+    siftUp(idx);
+    siftDown(timeoutSlab[last].idx);
   }
 }
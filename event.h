@@ -1,45 +1,161 @@
 #pragma once
 
 #include <poll.h>
+#include <stdint.h>
 
-#include <functional>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "callback.h"
+#include "slab.h"
+#include "util.h"
+
+// The event loop can either be built on top of ppoll() or on top of epoll().
+// The latter registers file descriptors incrementally with the kernel and
+// only ever looks at the descriptors that are actually ready. If epoll isn't
+// available, the constructor silently falls back to ppoll().
+// All deadlines are kept in nanoseconds on the Util::nanos() clock. ppoll()
+// can sleep with that precision, but epoll only ever waits for whole
+// milliseconds. For sub-millisecond timers, the epoll backend can be asked
+// to use a timerfd instead.
+// Timeouts that are already due don't keep file descriptors waiting. The
+// loop checks for ready descriptors without blocking, and dispatches them
+// first.
+// Event is meant to be used from a single thread. The only exceptions are
+// runLater() and postTimeout(), which other threads can use to hand work to
+// the loop. These go through a lock-free queue, and wake up the loop right
+// away. Posted callbacks don't keep loop() from returning, though.
+// Handlers and timeouts live in slabs, and callbacks are stored inline. Once
+// the loop has warmed up, it no longer allocates any memory.
 class Event {
  public:
-  Event();
+  enum Backend { BACKEND_POLL, BACKEND_EPOLL };
+
+  // Refers to a file descriptor handler or to a timeout. Slots in the slabs
+  // get reused, but every use gets a fresh generation number. So, a handle
+  // that outlived its record can be detected and ignored.
+  struct Handle {
+    uint32_t index = 0; // Slot + 1, or zero for no handle
+    uint32_t generation = 0;
+    explicit operator bool() const { return index != 0; }
+  };
+
+  Event(Backend backend = BACKEND_EPOLL, bool preciseTimers = false);
   ~Event();
   void loop();
+  void runOnce();
+  // Dispatches timeouts that have already expired and queued callbacks, but
+  // never waits. Together with Util::setClock(), this lets a simulation
+  // drive the loop.
+  void runExpired();
+  bool getNextDeadline(Nanos *deadline) const;
   void exitLoop();
-  void *addPollFd(int fd, short events, std::function<void (void)> cb);
+  Handle addPollFd(int fd, short events, Callback cb);
   void removePollFd(int fd, short events = 0);
-  void removePollFd(void *handle);
-  void *addTimeout(unsigned tmo, std::function<void(void)>);
-  void removeTimeout(void *handle);
-  void runLater(std::function<void(void)>);
+  void removePollFd(Handle handle);
+  Handle addTimeout(unsigned tmo, Callback cb);
+  // Fires once Util::nanos() reaches the deadline. Scheduling periodic work
+  // relative to the previous deadline doesn't accumulate any drift.
+  Handle addTimeoutAt(Nanos deadline, Callback cb);
+  void removeTimeout(Handle handle);
+  void runLater(Callback cb);
+  // Like addTimeout(), but safe to call from any thread. There is no handle
+  // for cancelling the timeout.
+  void postTimeout(unsigned tmo, Callback cb);
+  Backend getBackend() const { return epollFd >= 0 ? BACKEND_EPOLL
+                                                   : BACKEND_POLL; }
+  // Longest time in nanoseconds that the loop spent dispatching callbacks
+  // instead of waiting for new events.
+  uint64_t getMaxStall() const { return maxStall; }
+  void resetMaxStall() { maxStall = 0; }
 
  private:
+  // Removed handlers are only marked as such, and their slots get released
+  // once nothing can be dispatching them anymore.
   struct PollFd {
-    PollFd(int fd, short events, std::function<void (void)> cb)
-      : fd(fd), events(events), cb(cb) { }
-    int   fd;
-    short events;
-    std::function<void (void)> cb;
+    int      fd;
+    short    events;
+    bool     removed;
+    uint32_t generation = 0;
+    Callback cb;
   };
 
+  // With epoll, all handlers for the same file descriptor share a single
+  // registration with the kernel. Removed handlers get cleaned up after all
+  // ready events have been dispatched.
+  struct EpollFd {
+    int  fd;
+    int  mask = 0;
+    bool registered = false;
+    bool dirty = false;
+    std::vector<uint32_t> handlers;
+  };
+
+  // Timeouts live in a binary min-heap of slab slots ordered by deadline,
+  // and each record remembers its position in the heap. This makes
+  // inserting, cancelling and finding the next deadline O(log n) or better.
   struct Timeout {
-    Timeout(unsigned tmo, std::function<void (void)> cb)
-      : tmo(tmo), cb(cb) { }
-    unsigned tmo;
-    std::function<void (void)> cb;
+    Nanos    tmo;
+    unsigned long seq;
+    int      idx = -1;
+    uint32_t generation = 0;
+    Callback cb;
+  };
+
+  // Cross-thread callbacks are queued on an intrusive multi-producer/
+  // single-consumer list. Producers only ever swap the head pointer, and
+  // the loop's thread consumes from the tail.
+  struct Posted {
+    std::atomic<Posted *> next = { NULL };
+    bool hasTmo = false;
+    Nanos tmo = 0;
+    Callback cb;
   };
 
-  void handleTimeouts(unsigned now);
+  void post(Posted *p);
+  void wakeUp();
+  void runPosted();
+  void handleTimeouts(Nanos now);
   void recomputeTimeoutsAndFds();
+  bool hasPollFds() const;
+  int waitPoll(int64_t tmo);
+  int waitEpoll(int64_t tmo);
+  void armTimerFd(Nanos deadline, int64_t tmo);
+  void updateEpollFd(EpollFd *efd);
+  void sweepEpollFds();
+  uint32_t nextGeneration();
+  PollFd *findPollFd(Handle handle);
+  void releasePollFd(uint32_t slot);
+  void releaseTimeout(uint32_t slot);
+  bool isEarlier(uint32_t a, uint32_t b);
+  void siftUp(int idx);
+  void siftDown(int idx);
+  void removeFromHeap(uint32_t slot);
 
-  std::vector<PollFd *> pollFds, *newFds = NULL;
-  std::vector<Timeout *> timeouts, *newTimeouts = NULL;
-  std::vector<std::function<void (void)> > later;
-  struct ::pollfd *fds = NULL;
+  Slab<PollFd> pollFdSlab;
+  Slab<Timeout> timeoutSlab;
+  uint32_t generation = 0;
+  std::vector<uint32_t> pollFds, newFds;
+  bool fdsChanged = false;
+  std::vector<uint32_t> timeouts;
+  unsigned long timeoutSeq = 0;
+  std::vector<Callback> later;
+  size_t laterPos = 0;
+  std::vector<struct ::pollfd> fds;
+  int epollFd = -1;
+  std::unordered_map<int, EpollFd *> epollFds;
+  std::vector<EpollFd *> dirtyEpollFds;
+  std::atomic<Posted *> postedHead;
+  Posted *postedTail;
+  std::atomic<bool> wakePending = { false };
+  int wakeFd = -1;
+  int timerFd = -1;
+  bool timerArmed = false;
+  Nanos timerDeadline = 0;
+  std::atomic<std::thread::id> owner;
+  int depth = 0;
+  uint64_t dispatchStart = 0, maxStall = 0;
   bool done = false;
 };
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "faketransport.h"
+#include "harmony.h"
+
+FakeTransport::FakeTransport() {
+}
+
+FakeTransport::~FakeTransport() {
+  stop();
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    delete it->second;
+  }
+}
+
+void FakeTransport::start(Event *event, Listener listener) {
+  this->event = event;
+  this->listener = std::move(listener);
+  // Key rates can be set up before there is an event loop
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    setKeyRate(it->first, it->second->rate, it->second->tick);
+  }
+}
+
+void FakeTransport::stop() {
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    if (it->second->timer) {
+      event->removeTimeout(it->second->timer);
+      it->second->timer = Event::Handle();
+    }
+  }
+  listener = nullptr;
+}
+
+std::vector<std::string> FakeTransport::scan() {
+  std::vector<std::string> paths;
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    paths.push_back(it->first);
+  }
+  return paths;
+}
+
+bool FakeTransport::open(const std::string &path, int id) {
+  auto it = receivers.find(path);
+  if (it == receivers.end() || it->second->id) {
+    return false;
+  }
+  it->second->id = id;
+  return true;
+}
+
+void FakeTransport::close(int id) {
+  Receiver *r = findReceiver(id);
+  if (r) {
+    r->id = 0;
+    r->reading = false;
+  }
+}
+
+void FakeTransport::startReading(int id) {
+  Receiver *r = findReceiver(id);
+  if (r) {
+    r->reading = true;
+  }
+}
+
+void FakeTransport::stopReading(int id) {
+  Receiver *r = findReceiver(id);
+  if (r) {
+    r->reading = false;
+  }
+}
+
+bool FakeTransport::write(int id, const unsigned char *buf, int len,
+                          bool wait) {
+  Receiver *r = findReceiver(id);
+  if (!r || len < 7 || len > TransportEvent::MAX_LEN) {
+    return false;
+  }
+  if (!wait) {
+    TransportEvent ev = { };
+    ev.type = TransportEvent::WRITTEN;
+    ev.receiver = id;
+    ev.status = TransportEvent::OK;
+    ev.len = len;
+    memcpy(ev.buf, buf, len);
+    post(ev);
+  }
+  respond(r, buf, len);
+  return true;
+}
+
+void FakeTransport::plug(const std::string &path, int paired,
+                         unsigned firmware) {
+  if (receivers.count(path)) {
+    return;
+  }
+  Receiver *r = new Receiver();
+  r->path = path;
+  r->paired = std::max(0, std::min(paired, 6));
+  r->firmware = firmware;
+  r->plugged = Util::nanos();
+  receivers[path] = r;
+  if (event) {
+    TransportEvent ev = { };
+    ev.type = TransportEvent::ATTACH;
+    post(ev);
+  }
+}
+
+void FakeTransport::unplug(const std::string &path) {
+  auto it = receivers.find(path);
+  if (it == receivers.end()) {
+    return;
+  }
+  Receiver *r = it->second;
+  receivers.erase(it);
+  if (r->timer) {
+    event->removeTimeout(r->timer);
+  }
+  if (event) {
+    TransportEvent ev = { };
+    ev.type = TransportEvent::DETACH;
+    ev.receiver = r->id;
+    strncpy((char *)ev.buf, path.c_str(), sizeof(ev.buf) - 1);
+    post(ev);
+  }
+  delete r;
+}
+
+void FakeTransport::setKeyRate(const std::string &path, unsigned rate,
+                               unsigned tick) {
+  auto it = receivers.find(path);
+  if (it == receivers.end()) {
+    return;
+  }
+  Receiver *r = it->second;
+  r->rate = rate;
+  r->tick = std::max(1u, tick);
+  if (!event) {
+    return;
+  }
+  if (r->timer) {
+    event->removeTimeout(r->timer);
+    r->timer = Event::Handle();
+  }
+  r->epoch = Util::nanos();
+  r->deadline = r->epoch + r->tick*NANOS_PER_MS;
+  r->generated = 0;
+  if (rate && r->paired) {
+    armGenerator(r);
+  }
+}
+
+void FakeTransport::post(const TransportEvent &ev, unsigned delay) {
+  // Events are too large to be captured by an Event callback without
+  // allocating. They wait in a slab instead.
+  const uint32_t slot = posted.alloc();
+  posted[slot] = ev;
+  auto cb = [this, slot]() {
+    const TransportEvent ev = posted[slot];
+    posted.release(slot);
+    if (ev.type != TransportEvent::REPORT) {
+      if (listener) {
+        listener(ev);
+      }
+    } else {
+      // The receiver could be gone by the time that the response is due
+      Receiver *r = findReceiver(ev.receiver);
+      if (r) {
+        deliver(r, ev.buf, ev.len);
+      }
+    }
+  };
+  if (delay) {
+    event->addTimeout(delay, std::move(cb));
+  } else {
+    event->runLater(std::move(cb));
+  }
+}
+
+FakeTransport::Receiver *FakeTransport::findReceiver(int id) const {
+  if (!id) {
+    return NULL;
+  }
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    if (it->second->id == id) {
+      return it->second;
+    }
+  }
+  return NULL;
+}
+
+void FakeTransport::respond(Receiver *r, const unsigned char *buf, int len) {
+  // HID++ 1.0 requests are addressed to the receiver itself. Paired devices
+  // only know about the root feature. DJ reports never have a response.
+  static const uint16_t features[] = { 0x0000, 0x0001, 0x0002, 0x0003,
+                                       0x0005, 0x1000 };
+  unsigned char rsp[TransportEvent::MAX_LEN] = { };
+  int rspLen = 7;
+  memcpy(rsp, buf, 7);
+  if (buf[0] == 0x20 || buf[0] == 0x21) {
+    if (buf[1] == 0xFF && buf[2] == 0x80) {
+      r->djMode = buf[3] != 0;
+    }
+    return;
+  } else if (buf[0] == 0x10 && buf[1] == 0xFF && buf[2] == 0x80 &&
+             buf[3] == 0x00) {
+    // Enabling notifications echoes the register
+  } else if (buf[0] == 0x10 && buf[1] == 0xFF && buf[2] == 0x81 &&
+             buf[3] == 0xF1 && (buf[4] == 0x01 || buf[4] == 0x02)) {
+    // Firmware version, either major and minor, or the build number
+    const bool ready = Util::nanos() - r->plugged >= warmup*NANOS_PER_MS;
+    const unsigned version = !ready ? 0
+                           : buf[4] == 0x01 ? r->firmware >> 16
+                                            : r->firmware & 0xFFFF;
+    rsp[5] = version >> 8;
+    rsp[6] = version;
+  } else if (buf[0] == 0x10 && buf[1] == 0xFF && buf[2] == 0x83 &&
+             buf[3] == 0xB5 && buf[4] >= 0x40 && buf[4] < 0x40 + r->paired) {
+    // Name of a paired device, in a long register
+    const int len = snprintf((char *)rsp + 6, 20 - 6, "Harmony %d",
+                             buf[4] - 0x40 + 1);
+    rsp[0] = 0x11;
+    rsp[5] = len;
+    rspLen = 20;
+  } else if (buf[0] == 0x10 && buf[1] >= 1 && buf[1] <= r->paired &&
+             buf[2] == 0x00 && (buf[3] & 0xF0) == 0x00) {
+    // IRoot.getFeature, answered with the feature's index or zero
+    const uint16_t feature = (buf[4] << 8) | buf[5];
+    rsp[4] = rsp[5] = rsp[6] = 0;
+    for (unsigned i = 0; i < sizeof(features)/sizeof(*features); i++) {
+      if (features[i] == feature) {
+        rsp[4] = i;
+      }
+    }
+  } else {
+    // Everything else fails with ERR_INVALID_ADDRESS
+    rsp[2] = 0x8F;
+    rsp[3] = buf[2];
+    rsp[4] = buf[3];
+    rsp[5] = 0x02;
+    rsp[6] = 0x00;
+  }
+  TransportEvent ev = { };
+  ev.type = TransportEvent::REPORT;
+  ev.receiver = r->id;
+  ev.status = TransportEvent::OK;
+  ev.len = rspLen;
+  memcpy(ev.buf, rsp, rspLen);
+  post(ev, responseDelay);
+}
+
+void FakeTransport::deliver(Receiver *r, const unsigned char *buf, int len) {
+  if (!r->reading || !listener) {
+    dropped++;
+    return;
+  }
+  TransportEvent ev;
+  ev.type = TransportEvent::REPORT;
+  ev.receiver = r->id;
+  ev.status = TransportEvent::OK;
+  ev.len = len;
+  ev.tm = Util::nanos();
+  ev.queueEmpty = false;
+  ev.resubmitted = false;
+  ev.resubmitNanos = 0;
+  memcpy(ev.buf, buf, len);
+  listener(ev);
+}
+
+void FakeTransport::generateKeys(Receiver *r) {
+  // Emits everything that became due since the last tick. If the event
+  // loop fell too far behind, the oldest reports got lost.
+  static const int keys[] = { Harmony::KEY_OK, Harmony::KEY_UP,
+                              Harmony::KEY_DOWN, Harmony::KEY_LEFT,
+                              Harmony::KEY_RIGHT, Harmony::KEY_MENU,
+                              Harmony::KEY_PLAY, Harmony::KEY_NUM1 };
+  const Nanos now = Util::nanos();
+  const uint64_t late = now > r->deadline ? now - r->deadline : 0;
+  stats.ticks++;
+  stats.lateNanos += late;
+  stats.maxLateNanos = std::max(stats.maxLateNanos, late);
+  const uint64_t due = (uint64_t)((double)(now - r->epoch) * r->rate /
+                                  (1000*NANOS_PER_MS));
+  uint64_t n = r->djMode ? due - r->generated : 0;
+  r->generated = due;
+  stats.offered += n;
+  const uint64_t backlog =
+    std::max((uint64_t)1, (uint64_t)r->rate*FAKE_BACKLOG_MS/1000);
+  if (n > backlog) {
+    dropped += n - backlog;
+    r->seq += n - backlog;
+    n = backlog;
+  }
+  const int id = r->id;
+  while (n--) {
+    // Presses and releases alternate, round-robin over all paired remotes
+    const unsigned seq = r->seq++;
+    const int device = 1 + (seq / 2) % r->paired;
+    const int key = keys[(seq / 2 / r->paired) % (sizeof(keys)/sizeof(*keys))];
+    unsigned char buf[15] = { 0x20, (unsigned char)device,
+                              (unsigned char)(key >> 16) };
+    if (!(seq & 1)) {
+      buf[3] = key >> 8;
+      buf[4] = key;
+    }
+    const uint64_t before = dropped;
+    deliver(r, buf, sizeof(buf));
+    if (dropped == before) {
+      stats.delivered++;
+    }
+    // Listeners can unplug receivers
+    if (findReceiver(id) != r) {
+      return;
+    }
+  }
+  // Skip ticks that were missed altogether
+  r->deadline = std::max(r->deadline + r->tick*NANOS_PER_MS, now);
+  armGenerator(r);
+}
+
+void FakeTransport::armGenerator(Receiver *r) {
+  r->timer = event->addTimeoutAt(r->deadline, [this, r]() {
+    r->timer = Event::Handle();
+    generateKeys(r);
+  });
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "slab.h"
+#include "transport.h"
+
+// An in-process stand-in for Unifying receivers, for testing and load
+// testing without any hardware. It answers the HID++ requests that Harmony
+// sends while initializing a receiver, reading its firmware version,
+// enumerating device names and looking up feature indices. Everything else
+// gets an error response.
+// Receivers can be plugged and unplugged at any time, and each one can
+// generate key reports at a configurable rate. Reports are emitted in
+// batches from an Event timer. Like a real receiver, it can only hold on
+// to reports for so long; if the event loop falls behind further than
+// that, reports get dropped.
+class FakeTransport : public Transport {
+ public:
+  struct Stats {
+    uint64_t offered;     // Key reports generated
+    uint64_t delivered;   // Key reports handed to the listener
+    uint64_t ticks;       // Times the generator timer fired
+    uint64_t lateNanos;   // Total lateness of the generator timer
+    uint64_t maxLateNanos;// Latest that the generator timer fired
+  };
+
+  FakeTransport();
+  ~FakeTransport();
+  void start(Event *event, Listener listener) override;
+  void stop() override;
+  std::vector<std::string> scan() override;
+  bool open(const std::string &path, int id) override;
+  void close(int id) override;
+  void startReading(int id) override;
+  void stopReading(int id) override;
+  bool write(int id, const unsigned char *buf, int len, bool wait) override;
+  uint64_t getDropped() const override { return dropped; }
+
+  // Remotes are paired with device indices 1 through "paired"
+  void plug(const std::string &path, int paired = 1,
+            unsigned firmware = 0x12010025);
+  void unplug(const std::string &path);
+  // HID++ responses arrive after this many milliseconds
+  void setResponseDelay(unsigned ms) { responseDelay = ms; }
+  // For this many milliseconds after being plugged in, receivers aren't
+  // quite ready, and report a firmware version of zero
+  void setWarmup(unsigned ms) { warmup = ms; }
+  // Sends "rate" key reports per second, alternating between presses and
+  // releases on all paired remotes. Receivers only send key reports once
+  // they have been switched to DJ mode. The timer fires every "tick"
+  // milliseconds, and emits all reports that became due since the last
+  // time. A rate of zero stops generating reports.
+  void setKeyRate(const std::string &path, unsigned rate, unsigned tick = 1);
+  const Stats &getStats() const { return stats; }
+  void resetStats() { stats = { }; dropped = 0; }
+
+ private:
+  enum {
+    FAKE_BACKLOG_MS = 20,  // How long reports wait for the host
+  };
+
+  struct Receiver {
+    std::string path;
+    int id = 0;           // Assigned by open(), zero while closed
+    int paired;
+    unsigned firmware;
+    bool reading = false;
+    bool djMode = false;
+    Nanos plugged = 0;
+    unsigned rate = 0;
+    unsigned tick = 1;
+    Nanos deadline = 0;   // Next time that the generator is due
+    Nanos epoch = 0;      // Start of the current rate
+    uint64_t generated = 0;
+    unsigned seq = 0;
+    Event::Handle timer;
+  };
+
+  Receiver *findReceiver(int id) const;
+  void post(const TransportEvent &ev, unsigned delay = 0);
+  void respond(Receiver *r, const unsigned char *buf, int len);
+  void deliver(Receiver *r, const unsigned char *buf, int len);
+  void generateKeys(Receiver *r);
+  void armGenerator(Receiver *r);
+
+  Event *event = NULL;
+  Listener listener;
+  unsigned responseDelay = 0;
+  unsigned warmup = 0;
+  Stats stats = { };
+  uint64_t dropped = 0;
+  std::map<std::string, Receiver *> receivers;
+  Slab<TransportEvent> posted;  // Events that wait for the event loop
+};
@@ -1,184 +1,208 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <algorithm>
 
 #if !defined(NDEBUG)
-#include <iomanip>
 #include <iostream>
 #endif
 
 #include "harmony.h"
+#include "trace.h"
+#include "usbtransport.h"
 #include "util.h"
 
-const Harmony::Map Harmony::map[] = {
-  { 0x1001E, "LONG NUM 1" },
-  { 0x1001F, "LONG NUM 2" },
-  { 0x10020, "LONG NUM 3" },
-  { 0x10021, "LONG NUM 4" },
-  { 0x10022, "LONG NUM 5" },
-  { 0x10023, "LONG NUM 6" },
-  { 0x10024, "LONG NUM 7" },
-  { 0x10025, "LONG NUM 8" },
-  { 0x10026, "LONG NUM 9" },
-  { 0x10027, "LONG NUM 0" },
-  { 0x10028, "LONG ENTER" },
-  { 0x1004F, "LONG RIGHT" },
-  { 0x10050, "LONG LEFT" },
-  { 0x10051, "LONG DOWN" },
-  { 0x10052, "LONG UP" },
-  { 0x10056, "LONG CLEAR" },
-  { 0x10058, "LONG OK" },
-  { 0x10065, "LONG MENU" },
-  { 0x32402, "LONG BACK" },
-  { 0x38D00, "LONG GUIDE" },
-  { 0x39400, "LONG EXIT" },
-  { 0x39A00, "LONG DVR" },
-  { 0x39C00, "LONG CHN UP" },
-  { 0x39D00, "LONG CHN DOWN" },
-  { 0x3B000, "LONG PLAY" },
-  { 0x3B100, "LONG PAUSE" },
-  { 0x3B200, "LONG RECORD" },
-  { 0x3B300, "LONG FWD" },
-  { 0x3B400, "LONG RWD" },
-  { 0x3B700, "LONG STOP" },
-  { 0x3E200, "LONG MUTE" },
-  { 0x3E801, "LONG DEVICE 1" },
-  { 0x3E900, "LONG VOL UP" },
-  { 0x3E901, "LONG DEVICE 3" },
-  { 0x3EA00, "LONG VOL DOWN" },
-  { 0x3EC01, "LONG OFF" },
-  { 0x3ED01, "LONG DEVICE 2" },
-  { 0x3F00f, "LONG DIM UP" },
-  { 0x3F10f, "LONG DIM DOWN" },
-  { 0x3F20F, "LONG BULB 1" },
-  { 0x3F30F, "LONG BULB 2" },
-  { 0x3F401, "LONG BLUE" },
-  { 0x3F40F, "LONG PLUG 1" },
-  { 0x3F501, "LONG YELLOW" },
-  { 0x3F50F, "LONG PLUG 2" },
-  { 0x3F601, "LONG GREEN" },
-  { 0x3F701, "LONG RED" },
-  { 0x3FF01, "LONG INFO" },
-};
-
-Harmony::Harmony(Event *event) : event(event) {
-  libusb_init(&ctx);
-#ifdef NDEBUG
-# if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000106)
-    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
-# else
-    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_NONE);
-# endif
-#else
-# if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000106)
-    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
-# else
-    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_WARNING);
-# endif
-#endif
-  if (event) {
-    auto pollFds = libusb_get_pollfds(ctx);
-    for (auto it = pollFds; *it; it++) {
-      pollHandlers[(*it)->fd] =
-        event->addPollFd((*it)->fd, (*it)->events, [this]() {
-            handleUsbPollFdEvent(); });
-    }
-    free(pollFds);
-    libusb_set_pollfd_notifiers(ctx,
-      [](int fd, short events, void *data) {
-        Harmony *that = (Harmony *)data;
-        Event *event = that->event;
-        that->pollHandlers[fd] = event->addPollFd(fd, events, [that]() {
-                                            that->handleUsbPollFdEvent(); }); },
-      [](int fd, void *data) {
-        Harmony *that = (Harmony *)data;
-        Event *event = that->event;
-        event->removePollFd(that->pollHandlers[fd]); },
-      this);
-  }
-  openDevice();
-  libusb_hotplug_register_callback(
-    NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
-    HARMONY_VENDOR_ID, HARMONY_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
-    hotplugAttach, (void *)this, &hotplugHandleAttach);
-  libusb_hotplug_register_callback (
-    NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
-    HARMONY_VENDOR_ID, HARMONY_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
-    hotplugDetach, (void *)this, &hotplugHandleDetach);
-  initializeReceiver();
+Harmony::Harmony(Event *event, int numTransfers, bool usbThread)
+  : event(event ? event : new Event()), ownEvent(!event),
+    transport(new UsbTransport(numTransfers, usbThread)),
+    ownTransport(true) {
+  init();
+}
+
+Harmony::Harmony(Event *event, Transport *transport, MetadataCache *cache)
+  : event(event ? event : new Event()), ownEvent(!event),
+    transport(transport), cache(cache) {
+  init();
+}
+
+void Harmony::init() {
+  jitterSeed = (unsigned)Util::nanos();
+  transport->start(event, [this](const TransportEvent &ev) {
+                            handleTransportEvent(ev); });
+  // Receivers get brought up once the event loop runs. That is the
+  // caller's loop, or the private one in any of the synchronous calls.
+  openDevices();
 }
 
 Harmony::~Harmony() {
-  setKeyCallback(NULL);
-  if (event) {
-    libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
-    auto pollFds = libusb_get_pollfds(ctx);
-    for (auto it = pollFds; *it; it++) {
-      event->removePollFd(pollHandlers[(*it)->fd]);
+  // Outstanding HID++ requests are dropped silently
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    Receiver *r = it->second;
+    for (auto req = r->hidPPRequests.begin();
+         req != r->hidPPRequests.end(); req++) {
+      if (req->timeout) {
+        event->removeTimeout(req->timeout);
+      }
     }
-    free(pollFds);
+    r->hidPPRequests.clear();
   }
-  if (deviceHandle) {
-    libusb_release_interface(deviceHandle, HARMONY_DJ_INDEX);
-    libusb_attach_kernel_driver(deviceHandle, HARMONY_DJ_INDEX);
-    libusb_close(deviceHandle);
+  keySink = nullptr;
+  keyWaiters.clear();
+  setKeyCallback(nullptr);
+  while (!receivers.empty()) {
+    removeReceiver(receivers.begin()->second);
   }
-  if (hotplugHandleAttach) {
-    libusb_hotplug_deregister_callback(ctx, hotplugHandleAttach);
+  transport->stop();
+  if (ownTransport) {
+    delete transport;
   }
-  if (hotplugHandleDetach) {
-    libusb_hotplug_deregister_callback(ctx, hotplugHandleDetach);
+  if (ownEvent) {
+    delete event;
   }
-  libusb_exit(ctx);
 }
 
-unsigned int Harmony::getKey() {
-  bool isHIDpp = hidPPCallback || hidPPError;
-  auto oldCallback = keyCallback;
-  int input = 0;
-  while ((!isHIDpp && !input) ||
-         (isHIDpp && (hidPPCallback || hidPPError))) {
-    if (completed) {
-      setKeyCallback([&input](int key) { input = key; });
-    }
-    libusb_handle_events_completed(ctx, &completed);
+std::vector<int> Harmony::getReceivers() const {
+  std::vector<int> ids;
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    ids.push_back(it->second->id);
   }
-  setKeyCallback(oldCallback);
-  return input;
+  return ids;
 }
 
-void Harmony::setKeyCallback(std::function<void (int key)> cb) {
-  keyCallback = cb;
-  if (cb == NULL) {
-    cancelPendingTransfer();
-    key = 0;
-    return;
+std::string Harmony::getReceiverPath(int receiver) const {
+  Receiver *r = findReceiver(receiver);
+  return r ? r->path : "";
+}
+
+std::string Harmony::getDeviceName(int receiver, int device) const {
+  Receiver *r = findReceiver(receiver);
+  if (!r) {
+    return "";
+  }
+  auto it = r->meta.devices.find(device);
+  return it == r->meta.devices.end() ? "" : it->second.name;
+}
+
+bool Harmony::getFeatureIndex(int receiver, int device, uint16_t feature,
+                              std::function<void (int index)> cb) {
+  Receiver *r = findReceiver(receiver);
+  if (!r || device < 1 || device > HARMONY_MAX_DEVICES) {
+    return false;
   }
-  openDevice();
-  if (!deviceHandle) {
-    cancelPendingTransfer();
-    key = 0;
-  } else if (completed) {
-    int waitTime = HARMONY_TIMEOUT;
-    if (key) {
-      waitTime = HARMONY_LONGPRESS - (int)(Util::millis() - tm);
-      waitTime = std::min((int)HARMONY_TIMEOUT, std::max(1, waitTime));
+  // Until bring-up has revalidated the cache, indices could belong to
+  // another remote, or to other firmware
+  auto d = r->meta.devices.find(device);
+  if (r->state == STATE_READY && d != r->meta.devices.end()) {
+    auto f = d->second.features.find(feature);
+    if (f != d->second.features.end()) {
+      cb(f->second);
+      return true;
     }
-    transfer = libusb_alloc_transfer(0);
-    completed = 0;
-    libusb_fill_interrupt_transfer(transfer, deviceHandle,
-      ifaceDJDesc->endpoint[HARMONY_ENDPOINT_INDEX].bEndpointAddress,
-      buffer, sizeof(buffer), transferCompleted, this, waitTime);
-    if (transfer && libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
-      // Maybe the device doesn't currently exist. Let's hope that a hotplug
-      // event is going to fix things for us. There really isn't any other
-      // error recovery that we could do here.
-      libusb_free_transfer(transfer);
-      transfer = NULL;
-      completed = 1;
+  }
+  // Ask the root feature (IRoot.getFeature) of the device
+  const unsigned char buf[HARMONY_HIDPP_SHORT_COUNT + 1] =
+    { HARMONY_REPORT_HIDPP_SHORT, (unsigned char)device, 0x00, 0x00,
+      (unsigned char)(feature >> 8), (unsigned char)feature };
+  return sendHIDppRequest(receiver, buf,
+    [this, receiver, device, feature, cb](int, const unsigned char *buf) {
+      const int index = buf[HARMONY_SUBID_IDX + 2];
+      Receiver *r = findReceiver(receiver);
+      if (r) {
+        r->meta.devices[device].features[feature] = index;
+        if (cache && r->firmware) {
+          cache->setFeature(r->path, device, feature, index);
+        }
+      }
+      cb(index);
+    }, [cb](int, const unsigned char *) { cb(-1); });
+}
+
+Harmony::Receiver *Harmony::findReceiver(int id) const {
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    if (it->second->id == id) {
+      return it->second;
     }
   }
+  return NULL;
+}
+
+Harmony::Receiver *Harmony::defaultReceiver() const {
+  return receivers.empty() ? NULL : receivers.begin()->second;
+}
+
+unsigned int Harmony::getKey(KeyEvent *ev) {
+  // Keys go to a sink on our stack, instead of to the key callback. This
+  // doesn't copy or allocate anything, no matter what the callback holds.
+  KeyEvent input = { };
+  auto sink = [&input](const KeyEvent &ev) { input = ev; };
+  const auto oldSink = keySink;
+  keySink = sink;
+  updateReports();
+  while (!input.key) {
+    event->runOnce();
+  }
+  keySink = oldSink;
+  updateReports();
+  if (ev) {
+    *ev = input;
+  }
+  return input.key;
+}
+
+void Harmony::setKeyCallback(KeyCallback cb) {
+  keyCallback = std::move(cb);
+  updateReports();
+}
+
+void Harmony::waitForKey(FunctionRef<void (const KeyEvent &ev)> waiter) {
+  const bool wanted = wantsKeys();
+  keyWaiters.push_back(waiter);
+  if (!wanted) {
+    updateReports();
+  }
+}
+
+bool Harmony::wantsKeys() const {
+  return keyCallback || keySink || !keyWaiters.empty();
+}
+
+void Harmony::updateReports() {
+  // Start reading from all receivers, as soon as anybody wants keys
+  const bool wantsKeys = this->wantsKeys();
+  if (wantsKeys && receivers.empty()) {
+    openDevices();
+  }
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    Receiver *r = it->second;
+    if (!wantsKeys) {
+      // Keep reading, if there still is an outstanding HID++ request
+      if (!wantsReports(r)) {
+        stopReading(r);
+      }
+      releaseKeys(r);
+    } else {
+      startReading(r);
+    }
+  }
+}
+
+void Harmony::startReading(Receiver *r) {
+  if (r->online) {
+    transport->startReading(r->id);
+  }
+}
+
+void Harmony::stopReading(Receiver *r) {
+  if (r->online) {
+    transport->stopReading(r->id);
+  }
+}
+
+bool Harmony::wantsReports(const Receiver *r) const {
+  // Interrupt transfers are needed for key presses, but also for receiving
+  // responses to HID++ requests.
+  return wantsKeys() || !r->hidPPRequests.empty();
 }
 
 int Harmony::getReportLength(unsigned char ch) {
@@ -196,160 +220,350 @@ int Harmony::getReportLength(unsigned char ch) {
 }
 
 bool Harmony::sendHIDppRequest(const unsigned char *buf,
-                        std::function<void (int, const unsigned char *)> cb,
-                        std::function<void (int, const unsigned char *)> err) {
+                        HIDppCallback cb, HIDppCallback err,
+                        HIDppPolicy policy) {
+  if (receivers.empty()) {
+    openDevices();
+  }
+  return queueHIDppRequest(defaultReceiver(), buf, std::move(cb),
+                           std::move(err), policy) != 0;
+}
+
+bool Harmony::sendHIDppRequest(int receiver, const unsigned char *buf,
+                        HIDppCallback cb, HIDppCallback err,
+                        HIDppPolicy policy) {
+  return queueHIDppRequest(findReceiver(receiver), buf, std::move(cb),
+                           std::move(err), policy) != 0;
+}
+
+unsigned long Harmony::queueHIDppRequest(Receiver *r, const unsigned char *buf,
+                        HIDppCallback cb, HIDppCallback err,
+                        HIDppPolicy policy) {
   const bool isDJ = buf[0] == HARMONY_REPORT_DJ_SHORT ||
                     buf[0] == HARMONY_REPORT_DJ_LONG;
   int len = getReportLength(buf[HARMONY_REPORT_ID_IDX]);
-  if (!len || (!isDJ && (hidPPCallback || hidPPError)) || !openDevice()) {
+  if (!len || !r || !r->online) {
+    return 0;
+  }
+  if (isDJ) {
+    // DJ reports never receive a response. Send them right away.
+    return writeReport(r, buf, len) ? ++hidPPSeq : 0;
+  }
+  // Finished requests leave their list node behind, so that a steady
+  // stream of requests doesn't allocate
+  if (r->hidPPSpare.empty()) {
+    r->hidPPRequests.emplace_back();
+  } else {
+    r->hidPPRequests.splice(r->hidPPRequests.end(), r->hidPPSpare,
+                            r->hidPPSpare.begin());
+  }
+  HIDppRequest &req = r->hidPPRequests.back();
+  req.id = ++hidPPSeq;
+  memcpy(req.buf, buf, len);
+  req.len = len;
+  req.policy = policy;
+  req.attempts = 0;
+  req.inFlight = false;
+  req.timeout = Event::Handle();
+  req.cb = std::move(cb);
+  req.err = std::move(err);
+  if (req.buf[HARMONY_DEVICE_IDX] != 0xFF &&
+      req.buf[HARMONY_SUBID_IDX] < 0x80) {
+    // HID++ 2.0 requests carry a software id in the low nibble of the
+    // function byte. Responses echo it back, which tells apart requests
+    // that would otherwise look identical.
+    r->hidPPSwId = r->hidPPSwId % 15 + 1;
+    req.buf[HARMONY_SUBID_IDX + 1] =
+      (req.buf[HARMONY_SUBID_IDX + 1] & 0xF0) | r->hidPPSwId;
+  }
+  const unsigned long id = req.id;
+  pumpHIDppRequests(r);
+  return id;
+}
+
+bool Harmony::sendHIDppRequestAndWait(const unsigned char *buf,
+                        HIDppCallback cb, HIDppCallback err,
+                        HIDppPolicy policy) {
+  if (receivers.empty()) {
+    openDevices();
+  }
+  Receiver *r = defaultReceiver();
+  return sendHIDppRequestAndWait(r ? r->id : 0, buf, std::move(cb),
+                                 std::move(err), policy);
+}
+
+bool Harmony::sendHIDppRequestAndWait(int receiver, const unsigned char *buf,
+                        HIDppCallback cb, HIDppCallback err,
+                        HIDppPolicy policy) {
+  unsigned long id =
+    queueHIDppRequest(findReceiver(receiver), buf, std::move(cb),
+                      std::move(err), policy);
+  if (!id) {
     return false;
   }
-  if (!isDJ) {
-    hidPPCallback = cb;
-    hidPPError = err;
-    if (cb || err) {
-      memset(hidPPBuffer, 0, sizeof(hidPPBuffer));
-      memcpy(hidPPBuffer, buf, std::min((int)sizeof(hidPPBuffer), len));
-    }
+  while (isHIDppRequestPending(id)) {
+    event->runOnce();
   }
+  return true;
+}
+
+void Harmony::waitForHIDppRequests() {
   for (;;) {
-#if !defined(NDEBUG)
-    std::cout << "[ ";
-    for (int i = 0; i < len; i++) {
-      std::cout << std::hex << std::setw(2) << std::setfill('0')
-                << (0xFF & (unsigned)buf[i])
-                << std::dec << std::setw(0);
-      if (i != len - 1) {
-        std::cout << ", ";
-      }
+    bool pending = false;
+    for (auto it = receivers.begin(); it != receivers.end(); it++) {
+      pending |= !it->second->hidPPRequests.empty();
     }
-    std::cout << " ]" << std::endl;
-#endif
+    if (!pending) {
+      break;
+    }
+    event->runOnce();
+  }
+}
 
-    int rc = libusb_control_transfer(deviceHandle,
-      LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
-      0x09 /* HID Set_Report */, (2 /* HID output */ << 8) | buf[0],
-      HARMONY_DJ_INDEX, (unsigned char *)buf, len, HARMONY_TIMEOUT);
-    if (rc != len) {
-      memset(hidPPBuffer, 0, sizeof(hidPPBuffer));
-      if (!isDJ) {
-        hidPPCallback = NULL;
-        hidPPError = NULL;
+bool Harmony::isHIDppRequestPending(unsigned long id) const {
+  for (auto r = receivers.begin(); r != receivers.end(); r++) {
+    const auto &requests = r->second->hidPPRequests;
+    for (auto it = requests.begin(); it != requests.end(); it++) {
+      if (it->id == id) {
+        return true;
       }
-      return false;
     }
-    break;
   }
-  return true;
+  return false;
 }
 
-bool Harmony::sendHIDppRequestAndWait(const unsigned char *buf,
-                        std::function<void (int, const unsigned char *)> cb,
-                        std::function<void (int, const unsigned char *)> err) {
-  const bool isDJ = buf[0] == HARMONY_REPORT_DJ_SHORT ||
-                    buf[0] == HARMONY_REPORT_DJ_LONG;
-  if ((!isDJ && (hidPPCallback || hidPPError)) ||
-      !sendHIDppRequest(buf, cb, err)) {
-    return false;
+void Harmony::pumpHIDppRequests(Receiver *r) {
+  // Send as many queued requests as possible. Requests that could be
+  // confused with each other are never in flight at the same time, and
+  // each device only gets a limited number of outstanding requests.
+  auto &requests = r->hidPPRequests;
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    if (it->inFlight) {
+      continue;
+    }
+    int window = 0;
+    bool conflict = false;
+    for (auto other = requests.begin(); other != it; other++) {
+      if (other->inFlight &&
+          other->buf[HARMONY_DEVICE_IDX] == it->buf[HARMONY_DEVICE_IDX]) {
+        window++;
+        conflict |= isResponse(&*other, it->buf);
+      }
+    }
+    if (!conflict && window < HARMONY_HIDPP_WINDOW) {
+      transmitHIDppRequest(r, &*it);
+    }
   }
-  while (!isDJ && (hidPPCallback || hidPPError)) {
-    getKey();
+}
+
+void Harmony::transmitHIDppRequest(Receiver *r, HIDppRequest *req) {
+  req->inFlight = true;
+  req->attempts++;
+  req->timeout = event->addTimeout(req->policy.timeout, [this, r, req]() {
+    Trace::record(Trace::TIMEOUT, r->id, req->attempts, req->buf, req->len);
+    req->timeout = Event::Handle();
+    retryHIDppRequest(r, req);
+  });
+  if (!writeReport(r, req->buf, req->len)) {
+    // Don't retry from in here, as our caller is iterating over the queue.
+    // Let the timeout fire on the next iteration of the event loop instead.
+    event->removeTimeout(req->timeout);
+    req->timeout = event->addTimeout(0, [this, r, req]() {
+      req->timeout = Event::Handle();
+      retryHIDppRequest(r, req);
+    });
   }
-  return true;
 }
 
+void Harmony::retryHIDppRequest(Receiver *r, HIDppRequest *req) {
+  // Either the request timed out, or it couldn't be sent. Try again, if
+  // the policy allows for that.
+  if (req->timeout) {
+    event->removeTimeout(req->timeout);
+    req->timeout = Event::Handle();
+  }
+  req->inFlight = false;
+  if (req->attempts > req->policy.retries || !r->online) {
+    failHIDppRequest(r, req);
+  }
+  pumpHIDppRequests(r);
+}
 
-const char *Harmony::toString(int key) {
-  int code = key & ~KEY_LONGPRESS;
-  struct Map *entry =
-    (struct Map *)bsearch(&code, &map,
-                          sizeof(map)/sizeof(struct Map),
-                          sizeof(struct Map),
-                          [](const void *a, const void *b) -> int {
-                            return *(int *)a - *(int *)b; });
-  if (!entry) {
-    return "UNKNOWN KEY";
-  } else {
-    return key & KEY_LONGPRESS ? entry->str : entry->str + 5;
-  }
-}
-
-int Harmony::hotplugAttach(libusb_context *ctx,
-                           libusb_device *dev,
-                           libusb_hotplug_event event,
-                           void *data) {
-  // Attach event received
-  class Harmony *that = (class Harmony *)data;
-  libusb_device_descriptor desc;
-  if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
-    libusb_device_handle *handle;
-    if (libusb_open(dev, &handle) == LIBUSB_SUCCESS &&
-        openInterface(handle, &that->ifaceDJDesc)) {
-      // New Unifying receiver detected
-      if (that->deviceHandle) {
-        that->cancelPendingTransfer();
-        libusb_close(that->deviceHandle);
+void Harmony::failHIDppRequest(Receiver *r, HIDppRequest *req) {
+  // Report an error with a length of zero, and pass the original request
+  if (req->timeout) {
+    event->removeTimeout(req->timeout);
+  }
+  auto &requests = r->hidPPRequests;
+  for (auto it = requests.begin(); it != requests.end(); it++) {
+    if (&*it == req) {
+      unsigned char buf[sizeof(req->buf)];
+      memcpy(buf, req->buf, sizeof(buf));
+      auto err = req->err ? std::move(req->err) : std::move(req->cb);
+      releaseHIDppRequest(r, it);
+      if (err) {
+        err(0, buf);
       }
-      that->deviceHandle = handle;
-      that->setKeyCallback(that->keyCallback);
-      that->initializeReceiver();
+      break;
     }
   }
-  return 0;
 }
 
-int Harmony::hotplugDetach(libusb_context *ctx,
-                           libusb_device *dev,
-                           libusb_hotplug_event event,
-                           void *data) {
-  // Detach event received
-  class Harmony *that = (class Harmony *)data;
-  if (that->deviceHandle &&
-      libusb_get_device(that->deviceHandle) == dev) {
-    // Unifying receiver removed
-    that->cancelPendingTransfer();
-    libusb_close(that->deviceHandle);
-    that->deviceHandle = NULL;
-    that->ifaceDJDesc = NULL;
+void Harmony::releaseHIDppRequest(Receiver *r,
+                                  std::list<HIDppRequest>::iterator it) {
+  it->cb = nullptr;
+  it->err = nullptr;
+  r->hidPPSpare.splice(r->hidPPSpare.begin(), r->hidPPRequests, it);
+}
+
+void Harmony::failHIDppRequests(Receiver *r) {
+  // The receiver went away. None of the outstanding requests are going to
+  // be answered. Callbacks might queue new requests; these are left alone.
+  for (size_t n = r->hidPPRequests.size();
+       n-- && !r->hidPPRequests.empty(); ) {
+    failHIDppRequest(r, &r->hidPPRequests.front());
   }
-  return 0;
 }
 
-void Harmony::getFirmwareVersion(int retries) {
-  for (;;) {
-    // Request major and minor version numbers
-    sendHIDppRequestAndWait(
-      (unsigned char *)"\x10\xFF\x81\xF1\x01\x00\x00",
-      [this](int, const unsigned char *buffer) {
-        firmware = ((unsigned)buffer[5] << 24) |
-                   ((unsigned)buffer[6] << 16);
-      }, [](int, const unsigned char *){ });
-    if (firmware) {
-      sendHIDppRequestAndWait(
-        (unsigned char *)"\x10\xFF\x81\xF1\x02\x00\x00",
-        [this](int, const unsigned char *buffer) {
-          firmware |= ((unsigned)buffer[5] << 8) |
-                       (unsigned)buffer[6];
-        }, [](int, const unsigned char *){ });
-    }
-    // Sometimes, the USB device isn't quite ready to respond. Retry a couple
-    // of times. Depending on whether we have an event loop, this is either a
-    // synchronous or asynchronous operation
-    if (event) {
-      if (!firmware && retries-- > 0) {
-        event->addTimeout(1000, [this, retries]() {
-                                  getFirmwareVersion(retries);
-                                });
-      }
-      break;
-    } else {
-      if (firmware || !retries--) {
-        break;
-      } else {
-        poll(0, 0, 1000);
-      }
+bool Harmony::isResponse(const HIDppRequest *req, const unsigned char *buf) {
+  // Responses echo the device index, the sub-id and the register address
+  // (HID++ 1.0), or the feature index and the function/software id (HID++
+  // 2.0). Register reads also echo the first parameter. Errors report the
+  // sub-id and address of the failed request.
+  const unsigned char *cmd = req->buf;
+  if (buf[HARMONY_DEVICE_IDX] != cmd[HARMONY_DEVICE_IDX]) {
+    return false;
+  }
+  if (buf[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR ||
+      buf[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR2) {
+    return buf[HARMONY_SUBID_IDX + 1] == cmd[HARMONY_SUBID_IDX] &&
+           buf[HARMONY_SUBID_IDX + 2] == cmd[HARMONY_SUBID_IDX + 1];
+  }
+  if (buf[HARMONY_SUBID_IDX] != cmd[HARMONY_SUBID_IDX] ||
+      buf[HARMONY_SUBID_IDX + 1] != cmd[HARMONY_SUBID_IDX + 1]) {
+    return false;
+  }
+  return (cmd[HARMONY_SUBID_IDX] != HARMONY_SUBID_GET_REGISTER &&
+          cmd[HARMONY_SUBID_IDX] != HARMONY_SUBID_GET_LONG_REGISTER) ||
+         buf[HARMONY_SUBID_IDX + 2] == cmd[HARMONY_SUBID_IDX + 2];
+}
+
+bool Harmony::writeReport(Receiver *r, const unsigned char *buf, int len) {
+  Trace::record(Trace::REPORT_OUT, r->id, 0, buf, len);
+  if (!r->online) {
+    // Offline receivers can't send anything
+    return false;
+  }
+  if (capture.isOpen()) {
+    capture.write(Util::nanos(), CAPTURE_OUT, r->id, buf, len);
+  }
+  // With an event loop, the report gets sent asynchronously. Any failure is
+  // reported with a WRITTEN event. The synchronous API can afford to block.
+  // Either way, the response arrives as a report.
+  if (!transport->write(r->id, buf, len, ownEvent)) {
+    return false;
+  }
+  startReading(r);
+  return true;
+}
+
+void Harmony::openDevices() {
+  // Look for Logitech Unifying receivers that we haven't opened yet
+  const auto paths = transport->scan();
+  for (auto it = paths.begin(); it != paths.end(); it++) {
+    Receiver *r = addReceiver(*it);
+    if (r) {
+      const int id = r->id;
+      event->runLater([this, id]() {
+        Receiver *r = findReceiver(id);
+        if (r) {
+          initializeReceiver(r);
+        }
+      });
     }
   }
+}
+
+Harmony::Receiver *Harmony::newReceiver(const std::string &path) {
+  // Receivers keep their id, if they get unplugged and plugged back into
+  // the same port.
+  Receiver *r = new Receiver();
+  auto id = receiverIds.find(path);
+  if (id == receiverIds.end()) {
+    id = receiverIds.emplace(path, (int)receiverIds.size() + 1).first;
+  }
+  r->id = id->second;
+  r->path = path;
+  r->online = false;
+  receivers[path] = r;
+  return r;
+}
+
+Harmony::Receiver *Harmony::addReceiver(const std::string &path) {
+  if (receivers.count(path)) {
+    return NULL;
+  }
+  Receiver *r = newReceiver(path);
+  if (!transport->open(path, r->id)) {
+    receivers.erase(path);
+    delete r;
+    return NULL;
+  }
+  r->online = true;
+#if !defined(NDEBUG)
+  std::cout << "Opened receiver " << r->id << " at " << path << std::endl;
+#endif
+  if (wantsKeys()) {
+    startReading(r);
+  }
+  return r;
+}
+
+void Harmony::removeReceiver(Receiver *r) {
+  // Forget about the receiver first. Callbacks invoked from in here can't
+  // find it anymore.
+  receivers.erase(r->path);
+  if (r->bringUpTimer) {
+    event->removeTimeout(r->bringUpTimer);
+  }
+  if (r->online) {
+    transport->close(r->id);
+    r->online = false;
+  }
+  failHIDppRequests(r);
+  releaseKeys(r);
+#if !defined(NDEBUG)
+  std::cout << "Removed receiver " << r->id << " at " << r->path << std::endl;
+#endif
+  delete r;
+}
+
+int Harmony::addOfflineReceiver(const std::string &path) {
+  auto it = receivers.find(path);
+  if (it != receivers.end()) {
+    return it->second->id;
+  }
+  return newReceiver(path)->id;
+}
+
+bool Harmony::injectReport(int receiver, const unsigned char *buf, int len,
+                           Nanos tm) {
+  // Goes through the same path as a report read by the transport
+  if (!findReceiver(receiver) || len < 0 || len > TransportEvent::MAX_LEN) {
+    return false;
+  }
+  TransportEvent ev = { };
+  ev.type = TransportEvent::REPORT;
+  ev.receiver = receiver;
+  ev.status = TransportEvent::OK;
+  ev.len = len;
+  ev.tm = tm;
+  memcpy(ev.buf, buf, len);
+  handleTransportEvent(ev);
+  return true;
+}
+
+void Harmony::checkFirmwareVersion(Receiver *r) {
   // In debug builds, warn about unsupported firmware versions. Only older
   // unifying receivers can report all the keys on the Harmony remote. More
   // modern firmware broke this feature and all "media" keys are silently
@@ -357,183 +571,487 @@ void Harmony::getFirmwareVersion(int retries) {
   // numbers. Unfortunately, once upgraded there is no way to downgrade a
   // unifying receiver. Scour EBay until you find an old device.
 #if !defined(NDEBUG)
-  if (firmware && firmware > 0x12030025) {
-    std::cout << "Firmware version of unifying receiver " << std::hex
-              << firmware << " is probably too new. Downgrade, if direction "
+  if (r->firmware && r->firmware > 0x12030025) {
+    std::cout << "Firmware version of unifying receiver " << r->path
+              << " (" << std::hex << r->firmware << std::dec
+              << ") is probably too new. Downgrade, if direction "
                  "keys on remote don't work." << std::endl;
   }
 #endif
+  storeMetadata(r);
 }
 
-void Harmony::initializeReceiver() {
-  // Enable DJ mode & notifications
-  sendHIDppRequestAndWait(
-    (unsigned char *)"\x20\xFF\x80\x3F\x00\x00\x00\x00"
-                     "\x00\x00\x00\x00\x00\x00\x00");
-  sendHIDppRequestAndWait(
-    (unsigned char *)"\x10\xFF\x80\x00\x00\x09\x00",
-    [](int, const unsigned char *){ });
-  // Determine firmware version of unifying receiver
-  firmware = 0;
-  getFirmwareVersion();
-}
-
-bool Harmony::openInterface(libusb_device_handle *handle,
-                            const libusb_interface_descriptor **ifaceDJDesc) {
-  libusb_device *device;
-  libusb_device_descriptor desc;
-  libusb_config_descriptor *config;
-  if (!handle ||
-      (device = libusb_get_device(handle)) == NULL ||
-      libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS ||
-      libusb_get_config_descriptor(device, HARMONY_CONFIG_INDEX, &config) !=
-      LIBUSB_SUCCESS) {
-    return false;
+void Harmony::readDeviceNames(Receiver *r) {
+  // All requests are queued at once. Devices that answer with an error
+  // aren't paired. If there is no answer at all, keep what we knew.
+  const int id = r->id;
+  r->pendingNames = HARMONY_MAX_DEVICES;
+  for (int device = 1; device <= HARMONY_MAX_DEVICES; device++) {
+    unsigned char buf[HARMONY_HIDPP_SHORT_COUNT + 1] =
+      { HARMONY_REPORT_HIDPP_SHORT, 0xFF, HARMONY_SUBID_GET_LONG_REGISTER,
+        0xB5, (unsigned char)(0x40 + device - 1) };
+    auto done = [this, id, device](int len, const unsigned char *buf) {
+      Receiver *r = findReceiver(id);
+      if (!r) {
+        return;
+      }
+      if (len && (buf[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR ||
+                  buf[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR2)) {
+        r->meta.devices.erase(device);
+      } else if (len > HARMONY_NAME_LEN_IDX) {
+        const int n = std::min((int)buf[HARMONY_NAME_LEN_IDX],
+                               len - HARMONY_NAME_LEN_IDX - 1);
+        const std::string name((const char *)buf + HARMONY_NAME_LEN_IDX + 1,
+                               std::max(0, n));
+        MetadataCache::Device &d = r->meta.devices[device];
+        if (d.name != name) {
+          // Another remote got paired to this index. Whatever we knew about
+          // the old one's features doesn't apply.
+          d.name = name;
+          d.features.clear();
+        }
+      }
+      if (!--r->pendingNames) {
+        storeMetadata(r);
+        advanceBringUp(r, STATE_READY);
+      }
+    };
+    if (!sendHIDppRequest(id, buf, done, done)) {
+      r->pendingNames--;
+    }
   }
-  *ifaceDJDesc = &config->interface[HARMONY_DJ_INDEX].
-                 altsetting[HARMONY_ALT_SETTING_INDEX];
-  libusb_detach_kernel_driver(handle, HARMONY_DJ_INDEX);
-  libusb_claim_interface(handle, HARMONY_DJ_INDEX);
+  if (!r->pendingNames) {
+    advanceBringUp(r, STATE_READY);
+  }
+}
 
-  return true;
+void Harmony::storeMetadata(Receiver *r) {
+  // Only write complete entries. Names could still be missing, but the
+  // firmware version is what tells a warm start that the entry is good.
+  if (!cache || !r->firmware) {
+    return;
+  }
+  r->meta.firmware = r->firmware;
+  cache->update(r->path, r->meta);
 }
 
-libusb_device_handle *Harmony::openDevice() {
-  if (!deviceHandle) {
-    // Look for Logitech Unifying receiver
-    libusb_device_handle *handle;
-    if ((handle = libusb_open_device_with_vid_pid(
-           ctx, HARMONY_VENDOR_ID, HARMONY_PRODUCT_ID)) != NULL &&
-        openInterface(handle, &ifaceDJDesc)) {
-      // Opened Unifying receiver
-      deviceHandle = handle;
+void Harmony::initializeReceiver(Receiver *r) {
+  // Receivers are brought up by a state machine. Each step sends a single
+  // request, and its response moves on to the next step. Nothing ever waits
+  // for the receiver. Known receivers start out with what the cache says,
+  // and get revalidated along the way.
+  const MetadataCache::Receiver *cached = cache ? cache->find(r->path) : NULL;
+  r->meta = cached ? *cached : MetadataCache::Receiver();
+  r->firmware = cached ? cached->firmware : 0;
+  r->attempts = 0;
+  if (r->bringUpTimer) {
+    event->removeTimeout(r->bringUpTimer);
+    r->bringUpTimer = Event::Handle();
+  }
+  r->state = STATE_DETECTED;
+  r->bringUpStart = Util::nanos();
+  notifyProgress(r);
+  if (findReceiver(r->id) == r) {
+    bringUp(r);
+  }
+}
+
+void Harmony::bringUp(Receiver *r) {
+  static const unsigned char *djMode =
+    (unsigned char *)"\x20\xFF\x80\x3F\x00\x00\x00\x00"
+                     "\x00\x00\x00\x00\x00\x00\x00";
+  static const unsigned char *notifications =
+    (unsigned char *)"\x10\xFF\x80\x00\x00\x09\x00";
+  static const unsigned char *major =
+    (unsigned char *)"\x10\xFF\x81\xF1\x01\x00\x00";
+  static const unsigned char *build =
+    (unsigned char *)"\x10\xFF\x81\xF1\x02\x00\x00";
+  // Retries are handled by the backoff, not by the request queue. The
+  // receiver could go away at any time, so callbacks look it up by id.
+  static const HIDppPolicy once = { HARMONY_HIDPP_TIMEOUT, 0 };
+  const int id = r->id;
+  auto fail = [this, id](int, const unsigned char *) {
+    Receiver *r = findReceiver(id);
+    if (r) {
+      backOff(r);
+    }
+  };
+  switch (r->state) {
+  case STATE_DETECTED:
+    // DJ reports never have a response. As soon as the receiver is in DJ
+    // mode, keys start arriving.
+    if (sendHIDppRequest(id, djMode)) {
+      advanceBringUp(r, STATE_DJ_MODE);
+    } else {
+      backOff(r);
+    }
+    break;
+  case STATE_DJ_MODE:
+    if (!sendHIDppRequest(id, notifications,
+                          [this, id](int, const unsigned char *) {
+                            Receiver *r = findReceiver(id);
+                            if (r) {
+                              advanceBringUp(r, STATE_NOTIFICATIONS);
+                            }
+                          }, fail, once)) {
+      backOff(r);
+    }
+    break;
+  case STATE_NOTIFICATIONS:
+    // Right after being plugged in, receivers sometimes report a version
+    // of zero. That counts as a failure. Without the build number, the
+    // major and minor version still tell old and new firmware apart.
+    if (!sendHIDppRequest(id, major,
+          [this, id, fail](int, const unsigned char *buffer) {
+            Receiver *r = findReceiver(id);
+            const unsigned version = ((unsigned)buffer[5] << 24) |
+                                     ((unsigned)buffer[6] << 16);
+            if (!r) {
+              return;
+            } else if (!version) {
+              backOff(r);
+              return;
+            }
+            r->firmware = version;
+            auto done = [this, id](int len, const unsigned char *buffer) {
+              Receiver *r = findReceiver(id);
+              if (!r) {
+                return;
+              }
+              if (len && buffer[HARMONY_SUBID_IDX] ==
+                           HARMONY_SUBID_GET_REGISTER) {
+                r->firmware |= ((unsigned)buffer[5] << 8) |
+                                (unsigned)buffer[6];
+              }
+              if (r->meta.firmware && r->meta.firmware != r->firmware) {
+                // Feature indices could have moved with the firmware. Drop
+                // the cached entry, and read the names afresh.
+                r->meta = MetadataCache::Receiver();
+              }
+              checkFirmwareVersion(r);
+              advanceBringUp(r, STATE_FIRMWARE);
+            };
+            if (!sendHIDppRequest(id, build, done, done, once)) {
+              done(0, NULL);
+            }
+          }, fail, once)) {
+      backOff(r);
     }
+    break;
+  case STATE_FIRMWARE:
+    readDeviceNames(r);
+    break;
+  default:
+    break;
   }
-  return deviceHandle;
 }
 
-void Harmony::transferCompleted(libusb_transfer *transfer) {
-  Harmony *that = (Harmony *)transfer->user_data;
-  if (transfer != that->transfer) {
-    // What just happened?! There should only ever be a single transfer
-    // in flight!
-#if !defined(NDEBUG)
-    std::cout << "Unexpected transfer completion" << std::endl;
-#endif
+void Harmony::advanceBringUp(Receiver *r, State state) {
+  r->state = state;
+  r->attempts = 0;
+  notifyProgress(r);
+  if (findReceiver(r->id) == r) {
+    bringUp(r);
+  }
+}
+
+void Harmony::backOff(Receiver *r) {
+  // Exponential backoff. Half of each delay is random, so that receivers
+  // that failed together don't all retry at the same time.
+  if (++r->attempts >= HARMONY_BRINGUP_ATTEMPTS) {
+    r->state = STATE_FAILED;
+    notifyProgress(r);
     return;
   }
-  const auto status = transfer->status;
-  const auto actual_length = transfer->actual_length;
-  libusb_free_transfer(transfer);
-  that->transfer = NULL;
-  that->completed = 1;
-  if (status == LIBUSB_TRANSFER_TIMED_OUT && that->key) {
-    if (that->keyCallback) {
-      that->keyCallback(that->key | KEY_LONGPRESS);
+  const unsigned delay = std::min((unsigned)HARMONY_BRINGUP_MAX_DELAY,
+                                  (unsigned)HARMONY_BRINGUP_DELAY <<
+                                  (r->attempts - 1));
+  const unsigned tmo = delay/2 + rand_r(&jitterSeed) % (delay/2 + 1);
+  const int id = r->id;
+  r->bringUpTimer = event->addTimeout(tmo, [this, id]() {
+    Receiver *r = findReceiver(id);
+    if (r) {
+      r->bringUpTimer = Event::Handle();
+      bringUp(r);
     }
-    that->key = 0;
-  } else if (status != LIBUSB_TRANSFER_COMPLETED) {
-    that->key = 0;
-  } else {
-    const auto buffer = that->buffer;
+  });
+}
+
+void Harmony::notifyProgress(Receiver *r) {
 #if !defined(NDEBUG)
-    std::cout << "[ ";
-    for (int i = 0; i < actual_length; i++) {
-      std::cout << std::hex << std::setw(2) << std::setfill('0')
-                << (0xFF & (unsigned)buffer[i])
-                << std::dec << std::setw(0);
-      if (i != actual_length - 1) {
-        std::cout << ", ";
+  std::cout << "Receiver " << r->id << " at " << r->path << ": "
+            << toString(r->state) << " after "
+            << (Util::nanos() - r->bringUpStart) / NANOS_PER_MS << "ms"
+            << std::endl;
+#endif
+  if (progressCallback) {
+    progressCallback(r->id, r->state);
+  }
+}
+
+Harmony::State Harmony::getState(int receiver) const {
+  Receiver *r = findReceiver(receiver);
+  return r ? r->state : STATE_FAILED;
+}
+
+const char *Harmony::toString(State state) {
+  static const char *names[] = { "detected", "DJ mode", "notifications",
+                                 "firmware", "ready", "failed" };
+  return state >= 0 && state < (int)(sizeof(names)/sizeof(*names))
+         ? names[state] : "unknown";
+}
+
+void Harmony::waitForReceivers() {
+  for (;;) {
+    bool pending = false;
+    for (auto it = receivers.begin(); it != receivers.end(); it++) {
+      pending |= it->second->online &&
+                 it->second->state != STATE_READY &&
+                 it->second->state != STATE_FAILED;
+    }
+    if (!pending) {
+      break;
+    }
+    event->runOnce();
+  }
+}
+
+void Harmony::handleTransportEvent(const TransportEvent &ev) {
+  // Runs on the event loop's thread
+  Receiver *r = findReceiver(ev.receiver);
+  switch (ev.type) {
+  case TransportEvent::REPORT:
+    if (ev.status == TransportEvent::OK) {
+      if (capture.isOpen()) {
+        capture.write(ev.tm, CAPTURE_IN, ev.receiver, ev.buf, ev.len);
+      }
+      stats.reports++;
+      if (ev.queueEmpty) {
+        stats.queueEmpty++;
       }
     }
-    std::cout << " ]" << std::endl;
- #endif
-
-    that->tm = Util::millis();
-    const unsigned char *hidPPBuffer = that->hidPPBuffer;
-    if (actual_length > 0 && actual_length ==
-        getReportLength(buffer[HARMONY_REPORT_ID_IDX])) {
-      if (buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_DJ_SHORT) {
-        if (buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_KEYBOARD ||
-            buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_CONSUMER_CTRL) {
-          if (buffer[HARMONY_KEY_MSB_IDX] ||
-              buffer[HARMONY_KEY_LSB_IDX]) {
-            // Key pressed
-            that->key = ((buffer[HARMONY_SUBID_IDX] & 0x3) << 16) |
-                         (buffer[HARMONY_KEY_MSB_IDX] << 8) |
-                          buffer[HARMONY_KEY_LSB_IDX];
-          } else if (that->key) {
-            // Key released
-            if (that->keyCallback) {
-              that->keyCallback(that->key);
-            }
-            that->key = 0;
-          }
-        } else if (buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_CONN_NOTIF) {
-          if (buffer[HARMONY_KEY_MSB_IDX]) {
-            // Remote was disconnected or maybe lost RF connectivity. Clear
-            // any pending depressed keys.
+    if (ev.resubmitted) {
+      stats.resubmits++;
+      stats.resubmitNanos += ev.resubmitNanos;
+      stats.maxResubmitNanos = std::max(stats.maxResubmitNanos,
+                                        ev.resubmitNanos);
+    }
+    stats.dropped = transport->getDropped();
+    if (!r) {
+      break;
+    }
+    if (ev.status != TransportEvent::OK) {
+      releaseKeys(r);
+    } else {
+      handleReport(r, ev.buf, ev.len, ev.tm);
+    }
+    break;
+  case TransportEvent::WRITTEN:
+    // If sending a HID++ request failed, there won't ever be a response.
+    // Retry or give up right away, instead of waiting for the request to
+    // time out.
+    if (r && ev.status == TransportEvent::ERROR) {
+      for (auto it = r->hidPPRequests.begin();
+           it != r->hidPPRequests.end(); it++) {
+        if (it->inFlight && it->len == ev.len &&
+            !memcmp(it->buf, ev.buf, ev.len)) {
+          retryHIDppRequest(r, &*it);
+          break;
+        }
+      }
+    }
+    break;
+  case TransportEvent::ATTACH:
+    // Opening and initializing the receiver needs more requests. Don't send
+    // them from inside of a transport's callback.
+    event->runLater([this]() { openDevices(); });
+    break;
+  case TransportEvent::DETACH: {
+    // Anything that is still in flight fails, and won't be retried. Clean
+    // up once we are back in the event loop.
+    const std::string path = (const char *)ev.buf;
+    event->runLater([this, path]() {
+      auto it = receivers.find(path);
+      if (it != receivers.end()) {
+        removeReceiver(it->second);
+      }
+    });
+    break; }
+  }
+}
+
+void Harmony::handleReport(Receiver *r, const unsigned char *buffer,
+                           int actual_length, Nanos tm) {
+  Trace::record(tm, Trace::REPORT_IN, r->id, 0, buffer, actual_length);
+  if (actual_length > 0 && actual_length ==
+      getReportLength(buffer[HARMONY_REPORT_ID_IDX])) {
+    const int device = buffer[HARMONY_DEVICE_IDX];
+    if (buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_DJ_SHORT) {
+      if (device < 1 || device > HARMONY_MAX_DEVICES) {
+        // Not a valid DJ device index
+      } else if (buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_KEYBOARD ||
+                 buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_CONSUMER_CTRL) {
+        if (buffer[HARMONY_KEY_MSB_IDX] ||
+            buffer[HARMONY_KEY_LSB_IDX]) {
+          // Key pressed
+          pressKey(r, device, ((buffer[HARMONY_SUBID_IDX] & 0x3) << 16) |
+                               (buffer[HARMONY_KEY_MSB_IDX] << 8) |
+                                buffer[HARMONY_KEY_LSB_IDX], tm);
+        } else {
+          // Key released
+          releaseKey(r, device, true);
+        }
+      } else if (buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_CONN_NOTIF) {
+        if (buffer[HARMONY_KEY_MSB_IDX]) {
+          // Remote was disconnected or maybe lost RF connectivity. Clear
+          // any pending depressed keys.
 #if !defined(NDEBUG)
-            if (that->key) {
-              std::cout << "Lost key: " << toString(that->key) << std::endl;
-            } else {
-              std::cout << "RF connectivity lost" << std::endl;
-            }
-#endif
-            that->key = 0;
+          if (r->keys[device].key) {
+            std::cout << "Lost key: " << toString(r->keys[device].key)
+                      << std::endl;
+          } else {
+            std::cout << "RF connectivity lost" << std::endl;
           }
+#endif
+          releaseKey(r, device, false);
         }
-      } else if ((buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_HIDPP_SHORT ||
-                  buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_HIDPP_LONG) &&
-                 buffer[HARMONY_DEVICE_IDX] == hidPPBuffer[HARMONY_DEVICE_IDX]&&
-                 (that->hidPPCallback || that->hidPPError)) {
-        if ((buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR ||
-             buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR2) &&
-            buffer[HARMONY_SUBID_IDX + 1] == hidPPBuffer[HARMONY_SUBID_IDX]) {
-          // Positively identified report to be an error message for our
-          // most recent request
-          if (that->hidPPError) {
-            that->hidPPError(actual_length, buffer);
-          } else if (that->hidPPCallback) {
-              that->hidPPCallback(actual_length, buffer);
+      }
+    } else if (buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_HIDPP_SHORT ||
+               buffer[HARMONY_REPORT_ID_IDX] == HARMONY_REPORT_HIDPP_LONG) {
+      // Find the oldest request in flight that this report answers
+      auto &requests = r->hidPPRequests;
+      for (auto it = requests.begin(); it != requests.end(); it++) {
+        if (it->inFlight && isResponse(&*it, buffer)) {
+          const bool isError =
+            buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR ||
+            buffer[HARMONY_SUBID_IDX] == HARMONY_SUBID_ERROR2;
+          auto cb = isError && it->err ? std::move(it->err)
+                                       : std::move(it->cb);
+          if (it->timeout) {
+            event->removeTimeout(it->timeout);
           }
-          goto clearHIDppCallback;
-        } else if (buffer[HARMONY_SUBID_IDX] == hidPPBuffer[HARMONY_SUBID_IDX]){
-          // Positively identified report to be a response to our most recent
-          // request
-          if (that->hidPPCallback) {
-            that->hidPPCallback(actual_length, buffer);
+          // Forget about the request before invoking the callback. This
+          // allows the callback to queue more requests.
+          releaseHIDppRequest(r, it);
+          const int id = r->id;
+          if (cb) {
+            Trace::record(Trace::CALLBACK_START, id, Trace::CB_HIDPP_RESPONSE);
+            cb(actual_length, buffer);
+            Trace::record(Trace::CALLBACK_END, id, Trace::CB_HIDPP_RESPONSE);
           }
-        clearHIDppCallback:
-          memset(that->hidPPBuffer, 0, sizeof(that->hidPPBuffer));
-          that->hidPPCallback = NULL;
-          that->hidPPError = NULL;
+          if ((r = findReceiver(id)) != NULL) {
+            pumpHIDppRequests(r);
+          }
+          break;
         }
       }
     }
   }
-  if (that->event) {
-    that->event->runLater([that]() {
-      that->setKeyCallback(that->keyCallback);
+}
+
+void Harmony::setAutoRepeat(int key, unsigned delay, unsigned interval) {
+  if (interval) {
+    autoRepeat[key] = { delay, interval };
+  } else {
+    autoRepeat.erase(key);
+  }
+}
+
+void Harmony::pressKey(Receiver *r, int device, int code, Nanos tm) {
+  // Start timing a new key press. If the key is held for long enough, it
+  // turns into a long press. Auto-repeat keys report right away, and then
+  // keep repeating for as long as they are held. Every remote has its own
+  // timer, and none of this needs any more USB requests. Timing starts
+  // when the report arrived, not when it got dispatched.
+  KeyState *k = &r->keys[device];
+  if (k->timeout) {
+    event->removeTimeout(k->timeout);
+  }
+  k->key = code;
+  k->tm = tm;
+  auto it = autoRepeat.find(code);
+  k->repeating = it != autoRepeat.end();
+  if (k->repeating) {
+    k->deadline = tm + it->second.delay*NANOS_PER_MS;
+    k->timeout = event->addTimeoutAt(k->deadline, [this, r, device, k]() {
+      k->timeout = Event::Handle();
+      repeatKey(r, device);
     });
+    notifyKey(r, device, code, false);
   } else {
-    that->setKeyCallback(that->keyCallback);
+    k->deadline = tm + longPress*NANOS_PER_MS;
+    k->timeout = event->addTimeoutAt(k->deadline, [this, r, device, k]() {
+      k->timeout = Event::Handle();
+      releaseKey(r, device, true, true);
+    });
   }
 }
 
-void Harmony::cancelPendingTransfer() {
-  if (!completed) {
-    libusb_cancel_transfer(transfer);
-    while (!completed) {
-      libusb_handle_events_completed(ctx, &completed);
+void Harmony::repeatKey(Receiver *r, int device) {
+  // Re-arm the timer before calling out. The callback could release the key.
+  // Repeats are scheduled relative to the previous deadline, so that they
+  // don't drift. But if we fell behind, don't try to catch up.
+  KeyState *k = &r->keys[device];
+  auto it = autoRepeat.find(k->key);
+  if (it == autoRepeat.end()) {
+    return;
+  }
+  const Nanos now = Util::nanos();
+  k->deadline += it->second.interval*NANOS_PER_MS;
+  if ((int64_t)(k->deadline - now) < 0) {
+    k->deadline = now;
+  }
+  k->timeout = event->addTimeoutAt(k->deadline, [this, r, device, k]() {
+    k->timeout = Event::Handle();
+    repeatKey(r, device);
+  });
+  notifyKey(r, device, k->key, true);
+}
+
+void Harmony::releaseKey(Receiver *r, int device, bool notify,
+                         bool longPress) {
+  // Forget about the key currently held on this remote (if any), and
+  // optionally tell the caller about it. Auto-repeat keys have already
+  // been reported when they were pressed.
+  KeyState *k = &r->keys[device];
+  if (k->timeout) {
+    event->removeTimeout(k->timeout);
+    k->timeout = Event::Handle();
+  }
+  const int code = k->key;
+  k->key = 0;
+  if (code && notify && !k->repeating) {
+    notifyKey(r, device, longPress ? code | KEY_LONGPRESS : code, false);
+  }
+  k->repeating = false;
+}
+
+void Harmony::notifyKey(Receiver *r, int device, int code, bool repeat) {
+  const KeyEvent ev = { code, r->id, device, r->keys[device].tm, repeat };
+  const unsigned char args[2] = { (unsigned char)device, repeat };
+  Trace::record(Trace::KEY, r->id, code, args, sizeof(args));
+  if (keySink) {
+    keySink(ev);
+  } else if (!keyWaiters.empty()) {
+    // Waiters are one-shot. They can wait again from in here, so swap them
+    // out first. Both vectors keep their capacity.
+    firedWaiters.swap(keyWaiters);
+    for (auto it = firedWaiters.begin(); it != firedWaiters.end(); it++) {
+      (*it)(ev);
+    }
+    firedWaiters.clear();
+    if (!wantsKeys()) {
+      updateReports();
     }
-    memset(hidPPBuffer, 0, sizeof(hidPPBuffer));
-    hidPPCallback = NULL;
-    hidPPError = NULL;
+  } else if (keyCallback) {
+    Trace::record(Trace::CALLBACK_START, r->id, Trace::CB_KEY);
+    keyCallback(ev);
+    Trace::record(Trace::CALLBACK_END, r->id, Trace::CB_KEY);
   }
 }
 
-void Harmony::handleUsbPollFdEvent() {
-  struct timeval zero_tv = { };
-  libusb_handle_events_timeout(ctx, &zero_tv);
+void Harmony::releaseKeys(Receiver *r) {
+  for (int device = 1; device <= HARMONY_MAX_DEVICES; device++) {
+    releaseKey(r, device, false);
+  }
 }
@@ -1,98 +1,171 @@
 #pragma once
 
 #include <linux/hid.h>
-#include <libusb-1.0/libusb.h>
+#include <stdint.h>
 
 #include <functional>
+#include <list>
 #include <map>
+#include <string>
+#include <vector>
 
+#include "callback.h"
+#include "capture.h"
 #include "event.h"
+#include "keys.h"
+#include "metacache.h"
+#include "transport.h"
+#include "util.h"
 
-// Handles USB hotplugging, and can support multiple remotes. But only works
-// with a single Logitech Unifying receiver. If more than one receiver is
-// attached, the behavior is undefined (but shouldn't crash).
-// There is both a synchronous and an asynchronous API. Internally, the latter
-// is implemented in terms of the former. Mixing both modes isn't recommended.
-// At any given time, there should only be a single active USB request in
-// flight. This means that special care must be taken if using this class
-// from multiple threads.
+// Handles hotplugging, and can support multiple remotes on multiple
+// Logitech Unifying receivers. All receivers share the same transport and
+// the same event loop. Each one is identified by its transport's path,
+// and gets a small integer id that stays the same for as long as the
+// program runs.
+// There is both a synchronous and an asynchronous API. If the caller doesn't
+// provide an event loop, the synchronous API runs a private one whenever it
+// waits for input. Mixing both modes isn't recommended. With an event loop,
+// HID++ requests are sent asynchronously and never block the loop.
+// HID++ requests are queued, and several of them can be in flight at the
+// same time. Responses are matched to their requests, and each request has
+// its own timeout and retry policy.
+// Receivers are reached through a Transport. By default, that is libusb
+// (see usbtransport.h), optionally serviced from a dedicated thread. All
+// callbacks run on the event loop's thread. Apart from that, this class is
+// not thread-safe.
 class Harmony {
 public:
-  Harmony(Event *event = NULL);
+  struct Stats {
+    uint64_t reports;          // Reports received on the DJ endpoint
+    uint64_t queueEmpty;       // Reports that found no other transfer queued
+    uint64_t resubmits;        // Number of transfers resubmitted
+    uint64_t resubmitNanos;    // Total time spent resubmitting transfers
+    uint64_t maxResubmitNanos; // Slowest resubmission of a transfer
+    uint64_t dropped;          // Lost, because the USB thread got too far ahead
+  };
+
+  // How long to wait for a response to a HID++ request (in milliseconds),
+  // and how often to resend the request if there was no response.
+  struct HIDppPolicy {
+    unsigned timeout;
+    int      retries;
+  };
+
+  struct KeyEvent {
+    int key;      // KEY_* code, possibly with KEY_LONGPRESS set
+    int receiver; // Receiver that reported the key
+    int device;   // DJ device index of the remote on that receiver
+    Nanos tm;     // Util::nanos() when the key was pressed
+    bool repeat;  // Generated by auto-repeat, while the key is held
+  };
+
+  typedef InlineFunction<void (const KeyEvent &ev)> KeyCallback;
+  typedef InlineFunction<void (int len, const unsigned char *buf)>
+    HIDppCallback;
+
+  // Receivers are brought up in the background. Keys are delivered from
+  // STATE_DJ_MODE onwards; STATE_READY means that firmware version and
+  // device names are known as well. A receiver that stops responding
+  // ends up in STATE_FAILED, and stays there until it gets replugged.
+  enum State {
+    STATE_DETECTED, STATE_DJ_MODE, STATE_NOTIFICATIONS, STATE_FIRMWARE,
+    STATE_READY, STATE_FAILED
+  };
+  typedef std::function<void (int receiver, State state)> ProgressCallback;
+
+  Harmony(Event *event = NULL, int numTransfers = HARMONY_TRANSFERS,
+          bool usbThread = false);
+  // Uses the given transport instead of libusb. It has to outlive us, and
+  // so does the optional metadata cache. Receivers that are found in the
+  // cache start delivering keys right away, and get revalidated in the
+  // background.
+  Harmony(Event *event, Transport *transport, MetadataCache *cache = NULL);
   ~Harmony();
-  unsigned int getKey();
-  void setKeyCallback(std::function<void (int key)> cb);
+  const Stats &getStats() const { return stats; }
+  std::vector<int> getReceivers() const;
+  std::string getReceiverPath(int receiver) const;
+  // Names of paired devices get read when a receiver is initialized. Until
+  // then, only cached names are known.
+  std::string getDeviceName(int receiver, int device) const;
+  // Looks up the index of a HID++ 2.0 feature on a paired device. Indices
+  // are cached, but the cache is only used once the receiver is ready. The
+  // callback receives -1 on failure, and 0 if the device doesn't support
+  // the feature.
+  bool getFeatureIndex(int receiver, int device, uint16_t feature,
+                       std::function<void (int index)> cb);
+  unsigned int getKey(KeyEvent *ev = NULL);
+  void setKeyCallback(KeyCallback cb);
+  // The next key goes to the waiter instead of the key callback. Waiters
+  // are referenced, not copied, and have to stay alive until they get
+  // called. This is what Coro::nextKey() builds on.
+  void waitForKey(FunctionRef<void (const KeyEvent &ev)> waiter);
+  void setProgressCallback(ProgressCallback cb) { progressCallback = cb; }
+  State getState(int receiver) const;
+  // Runs the event loop until all receivers are ready or failed
+  void waitForReceivers();
+  // An offline receiver has no USB device behind it. Reports can be
+  // injected, and go through exactly the same decoding and key handling as
+  // reports read from a real receiver. This allows replaying traffic
+  // without any hardware. HID++ requests sent to it fail.
+  int addOfflineReceiver(const std::string &path);
+  bool injectReport(int receiver, const unsigned char *buf, int len,
+                    Nanos tm);
+  // Records all reports to and from the receivers into a capture file.
+  // See capture.h for the format, and for how to replay it.
+  bool startCapture(const char *path) { return capture.open(path); }
+  bool stopCapture() { return capture.close(); }
+  // Keys that are held for longer than the threshold (in milliseconds)
+  // report KEY_LONGPRESS as soon as the threshold is reached.
+  void setLongPressThreshold(unsigned ms) { longPress = ms; }
+  unsigned getLongPressThreshold() const { return longPress; }
+  // Auto-repeat keys report as soon as they are pressed, and then again
+  // every "interval" milliseconds after an initial "delay", until they are
+  // released. They never turn into long presses. An interval of zero turns
+  // off auto-repeat for the key.
+  void setAutoRepeat(int key, unsigned delay, unsigned interval);
+  // If a request fails without a response from the receiver, the error
+  // callback gets invoked with a length of zero and the original request.
+  // Without an error callback, the normal callback gets invoked instead.
+  // Unless a receiver is given, requests go to the first receiver.
   bool sendHIDppRequest(const unsigned char *buf,
-                   std::function<void (int, const unsigned char *)> cb = NULL,
-                   std::function<void (int, const unsigned char *)> err = NULL);
+                   HIDppCallback cb = nullptr, HIDppCallback err = nullptr,
+                   HIDppPolicy policy = { HARMONY_HIDPP_TIMEOUT,
+                                          HARMONY_HIDPP_RETRIES });
+  bool sendHIDppRequest(int receiver, const unsigned char *buf,
+                   HIDppCallback cb = nullptr, HIDppCallback err = nullptr,
+                   HIDppPolicy policy = { HARMONY_HIDPP_TIMEOUT,
+                                          HARMONY_HIDPP_RETRIES });
   bool sendHIDppRequestAndWait(const unsigned char *buf,
-                   std::function<void (int, const unsigned char *)> cb = NULL,
-                   std::function<void (int, const unsigned char *)> err = NULL);
-  static const char *toString(int key);
+                   HIDppCallback cb = nullptr, HIDppCallback err = nullptr,
+                   HIDppPolicy policy = { HARMONY_HIDPP_TIMEOUT,
+                                          HARMONY_HIDPP_RETRIES });
+  bool sendHIDppRequestAndWait(int receiver, const unsigned char *buf,
+                   HIDppCallback cb = nullptr, HIDppCallback err = nullptr,
+                   HIDppPolicy policy = { HARMONY_HIDPP_TIMEOUT,
+                                          HARMONY_HIDPP_RETRIES });
+  void waitForHIDppRequests();
+  static const char *toString(int key) { return Keys::toString(key); }
+  static const char *toString(State state);
 
+  // KEY_OK, KEY_LONG_OK, ... See keys.h for the list of keys.
   enum {
-    KEY_OFF       = 0x3EC01, KEY_LONG_OFF      = 0x7EC01,
-    KEY_DEVICE_1  = 0x3E801, KEY_LONG_DEVICE_1 = 0x7E801,
-    KEY_DEVICE_2  = 0x3ED01, KEY_LONG_DEVICE_2 = 0x7ED01,
-    KEY_DEVICE_3  = 0x3E901, KEY_LONG_DEVICE_3 = 0x7E901,
-    KEY_DIM_UP    = 0x3F00f, KEY_LONG_DIM_UP   = 0x7F00f,
-    KEY_DIM_DOWN  = 0x3F10f, KEY_LONG_DIM_DOWN = 0x7F10f,
-    KEY_BULB_1    = 0x3F20F, KEY_LONG_BULB_1   = 0x7F20F,
-    KEY_BULB_2    = 0x3F30F, KEY_LONG_BULB_2   = 0x7F30F,
-    KEY_PLUG_1    = 0x3F40F, KEY_LONG_PLUG_1   = 0x7F40F,
-    KEY_PLUG_2    = 0x3F50F, KEY_LONG_PLUG_2   = 0x7F50F,
-    KEY_RED       = 0x3F701, KEY_LONG_RED      = 0x7F701,
-    KEY_GREEN     = 0x3F601, KEY_LONG_GREEN    = 0x7F601,
-    KEY_YELLOW    = 0x3F501, KEY_LONG_YELLOW   = 0x7F501,
-    KEY_BLUE      = 0x3F401, KEY_LONG_BLUE     = 0x7F401,
-    KEY_DVR       = 0x39A00, KEY_LONG_DVR      = 0x79A00,
-    KEY_GUIDE     = 0x38D00, KEY_LONG_GUIDE    = 0x78D00,
-    KEY_INFO      = 0x3FF01, KEY_LONG_INFO     = 0x7FF01,
-    KEY_EXIT      = 0x39400, KEY_LONG_EXIT     = 0x79400,
-    KEY_MENU      = 0x10065, KEY_LONG_MENU     = 0x50065,
-    KEY_VOL_UP    = 0x3E900, KEY_LONG_VOL_UP   = 0x7E900,
-    KEY_VOL_DOWN  = 0x3EA00, KEY_LONG_VOL_DOWN = 0x7EA00,
-    KEY_CHN_UP    = 0x39C00, KEY_LONG_CHN_UP   = 0x79C00,
-    KEY_CHN_DOWN  = 0x39D00, KEY_LONG_CHN_DOWN = 0x79D00,
-    KEY_UP        = 0x10052, KEY_LONG_UP       = 0x50052,
-    KEY_DOWN      = 0x10051, KEY_LONG_DOWN     = 0x50051,
-    KEY_LEFT      = 0x10050, KEY_LONG_LEFT     = 0x50050,
-    KEY_RIGHT     = 0x1004F, KEY_LONG_RIGHT    = 0x5004F,
-    KEY_OK        = 0x10058, KEY_LONG_OK       = 0x50058,
-    KEY_MUTE      = 0x3E200, KEY_LONG_MUTE     = 0x7E200,
-    KEY_BACK      = 0x32402, KEY_LONG_BACK     = 0x72402,
-    KEY_RWD       = 0x3B400, KEY_LONG_RWD      = 0x7B400,
-    KEY_FWD       = 0x3B300, KEY_LONG_FWD      = 0x7B300,
-    KEY_RECORD    = 0x3B200, KEY_LONG_RECORD   = 0x7B200,
-    KEY_STOP      = 0x3B700, KEY_LONG_STOP     = 0x7B700,
-    KEY_PLAY      = 0x3B000, KEY_LONG_PLAY     = 0x7B000,
-    KEY_PAUSE     = 0x3B100, KEY_LONG_PAUSE    = 0x7B100,
-    KEY_NUM1      = 0x1001E, KEY_LONG_NUM1     = 0x5001E,
-    KEY_NUM2      = 0x1001F, KEY_LONG_NUM2     = 0x5001F,
-    KEY_NUM3      = 0x10020, KEY_LONG_NUM3     = 0x50020,
-    KEY_NUM4      = 0x10021, KEY_LONG_NUM4     = 0x50021,
-    KEY_NUM5      = 0x10022, KEY_LONG_NUM5     = 0x50022,
-    KEY_NUM6      = 0x10023, KEY_LONG_NUM6     = 0x50023,
-    KEY_NUM7      = 0x10024, KEY_LONG_NUM7     = 0x50024,
-    KEY_NUM8      = 0x10025, KEY_LONG_NUM8     = 0x50025,
-    KEY_NUM9      = 0x10026, KEY_LONG_NUM9     = 0x50026,
-    KEY_NUM0      = 0x10027, KEY_LONG_NUM0     = 0x50027,
-    KEY_CLEAR     = 0x10056, KEY_LONG_CLEAR    = 0x50056,
-    KEY_ENTER     = 0x10028, KEY_LONG_ENTER    = 0x50028,
-    KEY_LONGPRESS = 0x40000,
+#define X(id, code, name, category, repeatable, longPress) \
+    KEY_##id = code, KEY_LONG_##id = code | Keys::LONGPRESS,
+    HARMONY_KEYS(X)
+#undef X
+    KEY_LONGPRESS = Keys::LONGPRESS,
   };
 
 private:
   enum {
-    HARMONY_TRANSFER_SIZE      = 32,
-    HARMONY_CONFIG_INDEX       = 0,
-    HARMONY_DJ_INDEX           = 2,
-    HARMONY_ALT_SETTING_INDEX  = 0,
-    HARMONY_ENDPOINT_INDEX     = 0,
-    HARMONY_VENDOR_ID          = 0x46d,
-    HARMONY_PRODUCT_ID         = 0xc52b,
-    HARMONY_TIMEOUT            = 10*1000,
+    HARMONY_TRANSFERS          = 4,
+    HARMONY_HIDPP_TIMEOUT      = 1000,
+    HARMONY_HIDPP_RETRIES      = 2,
+    HARMONY_HIDPP_WINDOW       = 4,
     HARMONY_LONGPRESS          = 250,
+    HARMONY_BRINGUP_DELAY      = 100,  // First retry, doubling from there
+    HARMONY_BRINGUP_MAX_DELAY  = 5000,
+    HARMONY_BRINGUP_ATTEMPTS   = 10,   // Per step
     HARMONY_REPORT_ID_IDX      = 0,
     HARMONY_REPORT_HIDPP_SHORT = 0x10,
     HARMONY_REPORT_HIDPP_LONG  = 0x11,
@@ -102,6 +175,7 @@ private:
     HARMONY_HIDPP_LONG_COUNT   = 3 + 16, // 0x11: 20 bytes
     HARMONY_DJ_SHORT_COUNT     = 3 + 11, // 0x20: 15 bytes
     HARMONY_DJ_LONG_COUNT      = 3 + 28, // 0x21: 32 bytes
+    HARMONY_MAX_DEVICES        = 6,
     HARMONY_DEVICE_IDX         = 1,
     HARMONY_SUBID_IDX          = 2,
     HARMONY_SUBID_ERROR        = 0x8F,
@@ -109,42 +183,119 @@ private:
     HARMONY_SUBID_KEYBOARD     = 1,
     HARMONY_SUBID_CONSUMER_CTRL= 3,
     HARMONY_SUBID_CONN_NOTIF   = 0x42,
+    HARMONY_SUBID_GET_REGISTER = 0x81,
+    HARMONY_SUBID_GET_LONG_REGISTER = 0x83,
+    HARMONY_NAME_LEN_IDX       = 5,
     HARMONY_KEY_MSB_IDX        = 3,
     HARMONY_KEY_LSB_IDX        = 4,
     HARMONY_ERROR_IDX          = 6
   };
 
+  struct HIDppRequest {
+    unsigned long id;
+    unsigned char buf[HARMONY_HIDPP_LONG_COUNT + 1];
+    int len;
+    HIDppPolicy policy;
+    int attempts;
+    bool inFlight;
+    Event::Handle timeout;
+    HIDppCallback cb, err;
+  };
+
+  // Up to six remotes can be paired with a receiver. Each one of them can
+  // hold down its own key.
+  struct KeyState {
+    Nanos tm = 0;
+    Nanos deadline = 0;   // Next long press or auto-repeat
+    int key = 0;
+    bool repeating = false;
+    Event::Handle timeout; // Long press or auto-repeat timer
+  };
+
+  struct AutoRepeat {
+    unsigned delay;
+    unsigned interval;
+  };
+
+  // Everything that we know about one Unifying receiver
+  struct Receiver {
+    int id;
+    std::string path;
+    bool online;  // Opened through the transport
+    unsigned firmware = 0;
+    MetadataCache::Receiver meta;  // What goes into the cache
+    int pendingNames = 0;
+    State state = STATE_DETECTED;
+    int attempts = 0;             // Failures in the current state
+    Nanos bringUpStart = 0;
+    Event::Handle bringUpTimer;   // Backoff
+    KeyState keys[HARMONY_MAX_DEVICES + 1]; // Indexed by DJ device index
+    std::list<HIDppRequest> hidPPRequests;
+    std::list<HIDppRequest> hidPPSpare; // Finished requests, for reuse
+    int hidPPSwId = 0;
+  };
+
   Event *event;
-  libusb_context *ctx = NULL;
-  libusb_device_handle *deviceHandle = NULL;
-  unsigned firmware = 0;
-  libusb_hotplug_callback_handle hotplugHandleAttach = 0;
-  libusb_hotplug_callback_handle hotplugHandleDetach = 0;
-  std::map<int, void *> pollHandlers;
-  const libusb_interface_descriptor *ifaceDJDesc = NULL;
-  unsigned tm = 0;
-  int key = 0;
-  unsigned char buffer[HARMONY_TRANSFER_SIZE];
-  libusb_transfer *transfer = NULL;
-  int completed = 1;
-  std::function<void (int key)> keyCallback = NULL;
-  unsigned char hidPPBuffer[HARMONY_HIDPP_LONG_COUNT + 1];
-  std::function<void (int len, const unsigned char *buf)> hidPPCallback = NULL;
-  std::function<void (int len, const unsigned char *buf)> hidPPError = NULL;
-
-  static const struct Map { int code; const char *str; } map[];
+  bool ownEvent = false;
+  Transport *transport;
+  bool ownTransport = false;
+  std::map<std::string, Receiver *> receivers;
+  std::map<std::string, int> receiverIds;
+  CaptureWriter capture;
+  MetadataCache *cache = NULL;
+  Stats stats = { };
+  KeyCallback keyCallback;
+  ProgressCallback progressCallback;
+  FunctionRef<void (const KeyEvent &ev)> keySink; // Used by getKey()
+  std::vector<FunctionRef<void (const KeyEvent &ev)> > keyWaiters;
+  std::vector<FunctionRef<void (const KeyEvent &ev)> > firedWaiters;
+  unsigned longPress = HARMONY_LONGPRESS;
+  std::map<int, AutoRepeat> autoRepeat;
+  unsigned long hidPPSeq = 0;
+  unsigned jitterSeed = 0;
+
 
   static int getReportLength(unsigned char ch);
-  static int hotplugAttach(libusb_context *ctx, libusb_device *dev,
-                           libusb_hotplug_event event, void *data);
-  static int hotplugDetach(libusb_context *ctx, libusb_device *dev,
-                           libusb_hotplug_event event, void *data);
-  void getFirmwareVersion(int retries = 10);
-  void initializeReceiver();
-  static bool openInterface(libusb_device_handle *handle,
-                            const libusb_interface_descriptor **ifaceDJDesc);
-  libusb_device_handle *openDevice();
-  static void transferCompleted(libusb_transfer *transfer);
-  void cancelPendingTransfer();
-  void handleUsbPollFdEvent();
+  void init();
+  Receiver *findReceiver(int id) const;
+  Receiver *defaultReceiver() const;
+  void openDevices();
+  Receiver *newReceiver(const std::string &path);
+  Receiver *addReceiver(const std::string &path);
+  void removeReceiver(Receiver *r);
+  void checkFirmwareVersion(Receiver *r);
+  void readDeviceNames(Receiver *r);
+  void storeMetadata(Receiver *r);
+  void initializeReceiver(Receiver *r);
+  void bringUp(Receiver *r);
+  void advanceBringUp(Receiver *r, State state);
+  void backOff(Receiver *r);
+  void notifyProgress(Receiver *r);
+  unsigned long queueHIDppRequest(Receiver *r, const unsigned char *buf,
+                                  HIDppCallback cb, HIDppCallback err,
+                                  HIDppPolicy policy);
+  void releaseHIDppRequest(Receiver *r,
+                           std::list<HIDppRequest>::iterator it);
+  bool isHIDppRequestPending(unsigned long id) const;
+  void pumpHIDppRequests(Receiver *r);
+  void transmitHIDppRequest(Receiver *r, HIDppRequest *req);
+  void retryHIDppRequest(Receiver *r, HIDppRequest *req);
+  void failHIDppRequest(Receiver *r, HIDppRequest *req);
+  void failHIDppRequests(Receiver *r);
+  static bool isResponse(const HIDppRequest *req, const unsigned char *buf);
+  bool writeReport(Receiver *r, const unsigned char *buf, int len);
+  bool wantsKeys() const;
+  bool wantsReports(const Receiver *r) const;
+  void updateReports();
+  void handleReport(Receiver *r, const unsigned char *buffer,
+                    int actual_length, Nanos tm);
+  void pressKey(Receiver *r, int device, int code, Nanos tm);
+  void releaseKey(Receiver *r, int device, bool notify,
+                  bool longPress = false);
+  void releaseKeys(Receiver *r);
+  void repeatKey(Receiver *r, int device);
+  void notifyKey(Receiver *r, int device, int code, bool repeat);
+  void startReading(Receiver *r);
+  void stopReading(Receiver *r);
+  void handleTransportEvent(const TransportEvent &ev);
 };
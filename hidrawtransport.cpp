@@ -0,0 +1,297 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hidrawtransport.h"
+#include "util.h"
+
+HidrawTransport::HidrawTransport() {
+}
+
+HidrawTransport::~HidrawTransport() {
+  stop();
+  while (!devices.empty()) {
+    close(devices.begin()->first);
+  }
+}
+
+void HidrawTransport::start(Event *event, Listener listener) {
+  this->event = event;
+  this->listener = std::move(listener);
+  // Kernel uevents don't need udev to be running. Without the socket,
+  // everything still works, except for hotplugging.
+  ueventFd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT);
+  if (ueventFd >= 0) {
+    sockaddr_nl addr = { };
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(ueventFd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+      ::close(ueventFd);
+      ueventFd = -1;
+    } else {
+      ueventHandler = event->addPollFd(ueventFd, POLLIN, [this]() {
+                                         handleUevent(); });
+    }
+  }
+}
+
+void HidrawTransport::stop() {
+  if (!event) {
+    return;
+  }
+  if (ueventFd >= 0) {
+    event->removePollFd(ueventHandler);
+    ::close(ueventFd);
+    ueventFd = -1;
+  }
+  if (settleTimeout) {
+    event->removeTimeout(settleTimeout);
+    settleTimeout = Event::Handle();
+  }
+  for (auto it = devices.begin(); it != devices.end(); it++) {
+    stopReading(it->first);
+  }
+  listener = nullptr;
+}
+
+std::map<std::string, std::string> HidrawTransport::findNodes() {
+  // Each hidraw node links to its HID device, which sits below the USB
+  // interface ("1-1.3:1.2") and the USB device ("1-1.3"). The HID device's
+  // name has the bus type, vendor and product id.
+  std::map<std::string, std::string> nodes;
+  DIR *dir = opendir("/sys/class/hidraw");
+  if (!dir) {
+    return nodes;
+  }
+  while (dirent *ent = readdir(dir)) {
+    if (strncmp(ent->d_name, "hidraw", 6)) {
+      continue;
+    }
+    char link[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device", ent->d_name);
+    char *real = realpath(link, NULL);
+    if (!real) {
+      continue;
+    }
+    const std::string dev = real;
+    free(real);
+    const size_t hid = dev.rfind('/');
+    const size_t iface = hid == std::string::npos || !hid
+                         ? std::string::npos : dev.rfind('/', hid - 1);
+    unsigned bus, vendor, product, config, index;
+    char port[64];
+    if (iface == std::string::npos ||
+        sscanf(dev.c_str() + hid + 1, "%x:%x:%x", &bus, &vendor,
+               &product) != 3 ||
+        sscanf(dev.c_str() + iface + 1, "%63[^:]:%u.%u", port, &config,
+               &index) != 3 ||
+        bus != BUS_USB || vendor != HIDRAW_VENDOR_ID ||
+        product != HIDRAW_PRODUCT_ID || index != HIDRAW_DJ_INDEX) {
+      continue;
+    }
+    nodes[port] = ent->d_name;
+  }
+  closedir(dir);
+  return nodes;
+}
+
+std::vector<std::string> HidrawTransport::scan() {
+  std::vector<std::string> paths;
+  const auto nodes = findNodes();
+  for (auto it = nodes.begin(); it != nodes.end(); it++) {
+    paths.push_back(it->first);
+  }
+  return paths;
+}
+
+bool HidrawTransport::open(const std::string &path, int id) {
+  const auto nodes = findNodes();
+  auto node = nodes.find(path);
+  if (node == nodes.end() || devices.count(id)) {
+    return false;
+  }
+  const std::string dev = "/dev/" + node->second;
+  const int fd = ::open(dev.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+#if !defined(NDEBUG)
+    perror(dev.c_str());
+#endif
+    return false;
+  }
+  Device *d = new Device();
+  d->id = id;
+  d->path = path;
+  d->node = node->second;
+  d->fd = fd;
+  devices[id] = d;
+  return true;
+}
+
+void HidrawTransport::close(int id) {
+  Device *d = findDevice(id);
+  if (!d) {
+    return;
+  }
+  stopReading(id);
+  devices.erase(id);
+  ::close(d->fd);
+  delete d;
+}
+
+void HidrawTransport::startReading(int id) {
+  Device *d = findDevice(id);
+  if (!d || d->reading || !event) {
+    return;
+  }
+  d->reading = true;
+  d->handler = event->addPollFd(d->fd, POLLIN, [this, id]() {
+                                  Device *d = findDevice(id);
+                                  if (d) {
+                                    readReports(d);
+                                  } });
+}
+
+void HidrawTransport::stopReading(int id) {
+  Device *d = findDevice(id);
+  if (!d || !d->reading) {
+    return;
+  }
+  d->reading = false;
+  event->removePollFd(d->handler);
+  d->handler = Event::Handle();
+}
+
+bool HidrawTransport::write(int id, const unsigned char *buf, int len,
+                            bool wait) {
+  // The kernel sends the report before write() returns. There is nothing
+  // left to wait for, but the asynchronous API still expects its event.
+  Device *d = findDevice(id);
+  if (!d || len <= 0 || len > TransportEvent::MAX_LEN) {
+    return false;
+  }
+  ssize_t rc;
+  while ((rc = ::write(d->fd, buf, len)) < 0 && errno == EINTR) { }
+  if (rc != len) {
+    return false;
+  }
+  if (!wait) {
+    TransportEvent ev = { };
+    ev.type = TransportEvent::WRITTEN;
+    ev.receiver = id;
+    ev.status = TransportEvent::OK;
+    ev.len = len;
+    memcpy(ev.buf, buf, len);
+    event->runLater([this, ev]() {
+                      if (listener) {
+                        listener(ev);
+                      } });
+  }
+  return true;
+}
+
+HidrawTransport::Device *HidrawTransport::findDevice(int id) const {
+  auto it = devices.find(id);
+  return it == devices.end() ? NULL : it->second;
+}
+
+void HidrawTransport::readReports(Device *d) {
+  // hidraw returns exactly one report per read(). Don't hog the event loop,
+  // if reports keep arriving; poll() reports the fd as readable again.
+  const int id = d->id;
+  TransportEvent ev;
+  ev.type = TransportEvent::REPORT;
+  ev.receiver = id;
+  ev.status = TransportEvent::OK;
+  ev.resubmitted = false;
+  ev.resubmitNanos = 0;
+  for (int i = 0; i < HIDRAW_MAX_READS; i++) {
+    const ssize_t rc = read(d->fd, ev.buf, sizeof(ev.buf));
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // The receiver went away. The uevent might not have arrived yet.
+        stopReading(id);
+        detach(d->path);
+      }
+      return;
+    }
+    ev.len = rc;
+    ev.tm = Util::nanos();
+    ev.queueEmpty = false;
+    if (listener) {
+      listener(ev);
+    }
+    // Listeners can close the receiver
+    if (findDevice(id) != d || !d->reading) {
+      return;
+    }
+  }
+}
+
+void HidrawTransport::handleUevent() {
+  // Kernel uevents are an "action@devpath" header, followed by
+  // NUL-separated KEY=value pairs.
+  char buf[HIDRAW_UEVENT_SIZE];
+  ssize_t len;
+  while ((len = recv(ueventFd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\000';
+    const char *action = NULL, *subsystem = NULL, *devname = NULL;
+    for (const char *s = buf + strlen(buf) + 1; s < buf + len;
+         s += strlen(s) + 1) {
+      if (!strncmp(s, "ACTION=", 7)) {
+        action = s + 7;
+      } else if (!strncmp(s, "SUBSYSTEM=", 10)) {
+        subsystem = s + 10;
+      } else if (!strncmp(s, "DEVNAME=", 8)) {
+        devname = s + 8;
+      }
+    }
+    if (!action || !subsystem || strcmp(subsystem, "hidraw")) {
+      continue;
+    }
+    if (!strcmp(action, "add")) {
+      // Give udev a moment to create the device node and to set its
+      // permissions. Several receivers can share a single scan.
+      if (!settleTimeout) {
+        settleTimeout = event->addTimeout(HIDRAW_SETTLE, [this]() {
+          settleTimeout = Event::Handle();
+          TransportEvent ev = { };
+          ev.type = TransportEvent::ATTACH;
+          if (listener) {
+            listener(ev);
+          }
+        });
+      }
+    } else if (!strcmp(action, "remove") && devname) {
+      const char *node = strrchr(devname, '/');
+      node = node ? node + 1 : devname;
+      for (auto it = devices.begin(); it != devices.end(); it++) {
+        if (it->second->node == node) {
+          stopReading(it->first);
+          detach(it->second->path);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void HidrawTransport::detach(const std::string &path) {
+  TransportEvent ev = { };
+  ev.type = TransportEvent::DETACH;
+  snprintf((char *)ev.buf, sizeof(ev.buf), "%s", path.c_str());
+  if (listener) {
+    listener(ev);
+  }
+}
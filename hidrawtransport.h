@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "event.h"
+#include "transport.h"
+
+// Talks to Unifying receivers through the kernel's hid-logitech-dj driver,
+// instead of taking them away from it. The driver exposes all DJ and HID++
+// reports on the receiver's /dev/hidraw* node. Each receiver is a single
+// fd on the event loop; reports get read with plain read() into a fixed
+// buffer, and written with write(). Other HID consumers keep working.
+// Hotplugging comes from kernel uevents on a netlink socket. Receiver paths
+// are the same USB bus/port paths that UsbTransport uses.
+class HidrawTransport : public Transport {
+ public:
+  HidrawTransport();
+  ~HidrawTransport();
+  void start(Event *event, Listener listener) override;
+  void stop() override;
+  std::vector<std::string> scan() override;
+  bool open(const std::string &path, int id) override;
+  void close(int id) override;
+  void startReading(int id) override;
+  void stopReading(int id) override;
+  bool write(int id, const unsigned char *buf, int len, bool wait) override;
+
+ private:
+  enum {
+    HIDRAW_VENDOR_ID   = 0x46d,
+    HIDRAW_PRODUCT_ID  = 0xc52b,
+    HIDRAW_DJ_INDEX    = 2,
+    HIDRAW_MAX_READS   = 64,   // Reports read per wakeup, for fairness
+    HIDRAW_SETTLE      = 250,  // Time (ms) for udev to create the node
+    HIDRAW_UEVENT_SIZE = 4096,
+  };
+
+  struct Device {
+    int id;
+    std::string path;
+    std::string node;          // hidrawN
+    int fd;
+    bool reading = false;
+    Event::Handle handler;
+  };
+
+  static std::map<std::string, std::string> findNodes();
+  Device *findDevice(int id) const;
+  void readReports(Device *d);
+  void handleUevent();
+  void detach(const std::string &path);
+
+  Event *event = NULL;
+  Listener listener;
+  int ueventFd = -1;
+  Event::Handle ueventHandler;
+  Event::Handle settleTimeout;
+  std::map<int, Device *> devices;
+};
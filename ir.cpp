@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/lirc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "ir.h"
+
+static void add(std::vector<uint32_t> *out, bool pulse, uint32_t us) {
+  // Even entries are pulses, and odd entries are spaces. Adjacent pulses or
+  // spaces merge, and there is nothing to send before the first pulse.
+  if (!out->empty() && (out->size() % 2 == 1) == pulse) {
+    out->back() += us;
+  } else if (!out->empty() || pulse) {
+    out->push_back(us);
+  }
+}
+
+static void finish(std::vector<uint32_t> *out) {
+  // LIRC wants the buffer to end with a pulse
+  if (!out->empty() && out->size() % 2 == 0) {
+    out->pop_back();
+  }
+}
+
+static void nec(uint32_t address, uint32_t command, IrCode *code) {
+  // 9ms leader, 4.5ms space and 32 bits, LSB first. Bits are a 562us pulse
+  // followed by a short space for zero, or a long space for one. Standard
+  // addresses and the command are sent twice, the second time inverted.
+  if (address <= 0xFF) {
+    address |= (~address & 0xFF) << 8;
+  }
+  const uint32_t bits = address | (command | (~command & 0xFF) << 8) << 16;
+  code->carrier = 38000;
+  add(&code->press, true, 9000);
+  add(&code->press, false, 4500);
+  for (int i = 0; i < 32; i++) {
+    add(&code->press, true, 562);
+    add(&code->press, false, bits >> i & 1 ? 1687 : 562);
+  }
+  add(&code->press, true, 562);
+  // While the key is held, only a short repeat code gets sent
+  code->repeat = { 9000, 2250, 562 };
+}
+
+static void rc5(uint32_t address, uint32_t command, bool toggle,
+                std::vector<uint32_t> *out) {
+  // 14 bits, MSB first, Manchester coded with 889us halves: a one is a
+  // space followed by a pulse, a zero is the other way around. The second
+  // start bit doubles as an inverted seventh command bit (RC5X).
+  const uint32_t bits = 1 << 13 | !(command & 0x40) << 12 | toggle << 11 |
+                        address << 6 | (command & 0x3F);
+  for (int i = 13; i >= 0; i--) {
+    add(out, !(bits >> i & 1), 889);
+    add(out, bits >> i & 1, 889);
+  }
+  finish(out);
+}
+
+static void sony(uint32_t bits, int count, IrCode *code) {
+  // 2.4ms leader, then the bits LSB first, each one a 1.2ms (one) or 600us
+  // (zero) pulse followed by a 600us space. Receivers want to see the frame
+  // three times, at intervals of 45ms.
+  code->carrier = 40000;
+  for (int frame = 0; frame < 3; frame++) {
+    uint32_t us = 2400 + 600;
+    add(&code->press, true, 2400);
+    add(&code->press, false, 600);
+    for (int i = 0; i < count; i++) {
+      const uint32_t pulse = bits >> i & 1 ? 1200 : 600;
+      add(&code->press, true, pulse);
+      add(&code->press, false, 600);
+      us += pulse + 600;
+    }
+    add(&code->press, false, 45000 - us);
+  }
+  finish(&code->press);
+}
+
+std::shared_ptr<IrCode> IrCode::compile(const std::string &spec,
+                                        std::string *error) {
+  std::istringstream in(spec);
+  std::string protocol, word;
+  in >> protocol;
+  std::vector<uint32_t> args;
+  while (in >> word) {
+    char *end;
+    const unsigned long value = strtoul(word.c_str(), &end, 0);
+    if (*end || word[0] == '-' || value > UINT32_MAX) {
+      *error = "\"" + word + "\" isn't a number";
+      return NULL;
+    }
+    args.push_back(value);
+  }
+  auto fail = [&](const char *msg) {
+    *error = protocol + ": " + msg;
+    return std::shared_ptr<IrCode>();
+  };
+
+  std::shared_ptr<IrCode> code = std::make_shared<IrCode>();
+  if (protocol == "nec") {
+    if (args.size() != 2) {
+      return fail("expected an address and a command");
+    } else if (args[0] > 0xFFFF || args[1] > 0xFF) {
+      return fail("addresses go up to 0xFFFF, commands up to 0xFF");
+    }
+    nec(args[0], args[1], code.get());
+  } else if (protocol == "rc5") {
+    if (args.size() != 2) {
+      return fail("expected an address and a command");
+    } else if (args[0] > 31 || args[1] > 127) {
+      return fail("addresses go up to 31, commands up to 127");
+    }
+    code->carrier = 36000;
+    rc5(args[0], args[1], false, &code->press);
+    rc5(args[0], args[1], true, &code->toggled);
+  } else if (protocol == "sony12" || protocol == "sony15") {
+    const int addressBits = protocol == "sony12" ? 5 : 8;
+    if (args.size() != 2) {
+      return fail("expected an address and a command");
+    } else if (args[0] >> addressBits || args[1] > 127) {
+      return fail(addressBits == 5
+                  ? "addresses go up to 31, commands up to 127"
+                  : "addresses go up to 255, commands up to 127");
+    }
+    sony(args[1] | args[0] << 7, 7 + addressBits, code.get());
+  } else if (protocol == "sony20") {
+    if (args.size() != 3) {
+      return fail("expected an address, a command and an extended byte");
+    } else if (args[0] > 31 || args[1] > 127 || args[2] > 255) {
+      return fail("addresses go up to 31, commands up to 127, extended "
+                  "bytes up to 255");
+    }
+    sony(args[1] | args[0] << 7 | args[2] << 12, 20, code.get());
+  } else if (protocol == "raw") {
+    if (args.size() < 2 || args.size() % 2) {
+      return fail("expected a carrier, and pulses and spaces that start "
+                  "and end with a pulse");
+    }
+    code->carrier = args[0];
+    for (size_t i = 1; i < args.size(); i++) {
+      if (!args[i]) {
+        return fail("durations can't be zero");
+      }
+      code->press.push_back(args[i]);
+    }
+  } else {
+    *error = "unknown IR protocol \"" + protocol + "\"";
+    return NULL;
+  }
+  return code;
+}
+
+IrOutput::IrOutput(Event *event) : event(event) {
+}
+
+IrOutput::~IrOutput() {
+  if (worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cond.notify_one();
+    worker.join();
+  }
+  if (pollFd) {
+    event->removePollFd(pollFd);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool IrOutput::open(const std::string &path, std::string *error) {
+  // FIFOs get opened for reading, too, so that they never need a reader,
+  // and never raise SIGPIPE
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    *error = strerror(errno);
+    return false;
+  }
+  threaded = S_ISCHR(st.st_mode);
+  fd = ::open(path.c_str(), threaded ? O_WRONLY | O_CLOEXEC
+              : S_ISFIFO(st.st_mode) ? O_RDWR | O_NONBLOCK | O_CLOEXEC
+              : O_WRONLY | O_NONBLOCK | O_APPEND | O_CLOEXEC);
+  if (fd < 0) {
+    *error = strerror(errno);
+    return false;
+  }
+
+  // Character devices that don't know about LIRC (e.g. /dev/null) are
+  // still fine as stand-ins
+  uint32_t features;
+  if (threaded && !ioctl(fd, LIRC_GET_FEATURES, &features)) {
+    if (!(features & LIRC_CAN_SEND_PULSE)) {
+      *error = "not an IR transmitter";
+      close(fd);
+      fd = -1;
+      return false;
+    }
+    uint32_t mode = LIRC_MODE_PULSE;
+    ioctl(fd, LIRC_SET_SEND_MODE, &mode);
+    setCarrier = features & LIRC_CAN_SET_SEND_CARRIER;
+  }
+  if (threaded) {
+    worker = std::thread([this]() { transmit(); });
+  }
+  return true;
+}
+
+bool IrOutput::send(const std::shared_ptr<const IrCode> &code,
+                    bool repeat) {
+  if (fd < 0 || !code) {
+    return false;
+  }
+  // RC5 flips the toggle bit for every new key press, so that receivers
+  // can tell them apart from a held key
+  const std::vector<uint32_t> *pulses = &code->press;
+  if (repeat && !code->repeat.empty()) {
+    pulses = &code->repeat;
+  } else if (!code->toggled.empty()) {
+    toggle ^= !repeat;
+    pulses = toggle ? &code->toggled : &code->press;
+  }
+  if (!queue.push({ code, pulses, Util::nanos() })) {
+    dropped++;
+    return false;
+  }
+  if (threaded) {
+    // Taking the lock makes sure that the worker either sees the new code,
+    // or is already waiting for the notification
+    { std::lock_guard<std::mutex> lock(mutex); }
+    cond.notify_one();
+  } else if (!pollFd) {
+    flush();
+  }
+  return true;
+}
+
+IrOutput::Stats IrOutput::getStats() const {
+  return { sent, dropped, errors, latency, maxLatency };
+}
+
+void IrOutput::flush() {
+  // Runs on the event loop. Codes usually go out with a single write(), but
+  // a FIFO that is full can make it take several.
+  for (;;) {
+    if (!current.pulses) {
+      if (!queue.pop(current)) {
+        break;
+      }
+      offset = 0;
+    }
+    const size_t len = current.pulses->size()*sizeof(uint32_t);
+    const Nanos start = Util::nanos();
+    const ssize_t rc = write(fd, (const char *)current.pulses->data() +
+                             offset, len - offset);
+    if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (!pollFd) {
+        pollFd = event->addPollFd(fd, POLLOUT, [this]() { flush(); });
+      }
+      return;
+    } else if (rc > 0 && (offset += rc) < len) {
+      continue;
+    }
+    account(current, start, rc > 0);
+    current = Frame();
+  }
+  if (pollFd) {
+    event->removePollFd(pollFd);
+    pollFd = Event::Handle();
+  }
+}
+
+void IrOutput::transmit() {
+  // Runs on the worker thread. LIRC sends the whole code, or nothing at
+  // all.
+  unsigned carrier = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    cond.wait(lock, [this]() { return stopping || !queue.empty(); });
+    if (stopping) {
+      break;
+    }
+    lock.unlock();
+    Frame frame;
+    while (queue.pop(frame)) {
+      if (setCarrier && frame.code->carrier != carrier) {
+        carrier = frame.code->carrier;
+        ioctl(fd, LIRC_SET_SEND_CARRIER, &carrier);
+      }
+      const size_t len = frame.pulses->size()*sizeof(uint32_t);
+      const Nanos start = Util::nanos();
+      account(frame, start, write(fd, frame.pulses->data(), len) ==
+                            (ssize_t)len);
+      frame = Frame();
+    }
+    lock.lock();
+  }
+}
+
+void IrOutput::account(const Frame &frame, Nanos start, bool ok) {
+  // Only ever called from one thread, either the event loop or the worker
+  if (!ok) {
+#if !defined(NDEBUG)
+    perror("IR output");
+#endif
+    errors++;
+    return;
+  }
+  const uint64_t late = start - frame.tm;
+  sent++;
+  latency += late;
+  if (late > maxLatency.load(std::memory_order_relaxed)) {
+    maxLatency.store(late, std::memory_order_relaxed);
+  }
+}
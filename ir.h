@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "ring.h"
+#include "util.h"
+
+// An infrared code, compiled into the format that LIRC's transmit interface
+// expects: alternating pulse and space durations in microseconds, starting
+// and ending with a pulse. Codes are given as
+//   nec <address> <command>            (addresses above 0xFF are extended)
+//   rc5 <address> <command>            (commands above 63 are RC5X)
+//   sony12|sony15 <address> <command>
+//   sony20 <address> <command> <extended>
+//   raw <carrier> <pulse> <space> ... <pulse>
+// Numbers can be decimal or hex. Everything gets encoded up front, so that
+// sending a code just means writing out a buffer.
+struct IrCode {
+  // Returns NULL, and describes the problem in "error", if "spec" doesn't
+  // parse
+  static std::shared_ptr<IrCode> compile(const std::string &spec,
+                                         std::string *error);
+
+  unsigned carrier;              // Hz
+  std::vector<uint32_t> press;
+  std::vector<uint32_t> repeat;  // NEC only; others send "press" again
+  std::vector<uint32_t> toggled; // RC5 only; "press" with the toggle bit set
+};
+
+// Sends IR codes to a LIRC device (/dev/lirc*), or to a file or FIFO that
+// stands in for one. Each code goes out with a single write().
+// LIRC devices only return from write() once the code has been transmitted,
+// which takes tens of milliseconds. So, they get their own thread, and the
+// event loop just hands over codes through a ring buffer. Anything else is
+// written to from the event loop, waiting for POLLOUT if it has to.
+// Codes that can't be queued get dropped; by the time the queue has room,
+// they would be stale anyway.
+class IrOutput {
+ public:
+  struct Stats {
+    uint64_t sent;            // Codes written out
+    uint64_t dropped;         // Codes that didn't fit into the queue
+    uint64_t errors;          // Failed writes
+    uint64_t latencyNanos;    // Total time from send() to write()
+    uint64_t maxLatencyNanos; // Longest time from send() to write()
+  };
+
+  explicit IrOutput(Event *event);
+  ~IrOutput();
+  bool open(const std::string &path, std::string *error);
+  bool isOpen() const { return fd >= 0; }
+  // Must be called from the event loop's thread. "repeat" is set for
+  // auto-repeats of a key that is being held. Returns false, if the code
+  // couldn't be queued.
+  bool send(const std::shared_ptr<const IrCode> &code, bool repeat);
+  Stats getStats() const;
+
+ private:
+  enum { IR_QUEUE = 16 };
+
+  struct Frame {
+    std::shared_ptr<const IrCode> code; // Keeps "pulses" alive
+    const std::vector<uint32_t> *pulses;
+    Nanos tm;                           // When it got queued
+  };
+
+  void flush();
+  void transmit();
+  void account(const Frame &frame, Nanos start, bool ok);
+
+  Event *event;
+  int fd = -1;
+  bool threaded = false;
+  bool setCarrier = false;
+  bool toggle = false;
+  Ring<Frame, IR_QUEUE> queue;
+
+  // Only used when writing from the event loop
+  Frame current = { };
+  size_t offset = 0;
+  Event::Handle pollFd;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopping = false;
+
+  std::atomic<uint64_t> sent = { 0 }, dropped = { 0 }, errors = { 0 };
+  std::atomic<uint64_t> latency = { 0 }, maxLatency = { 0 };
+};
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "keymap.h"
+
+Keymap *Keymap::compile(const std::string &text, std::string *error) {
+  // Collect the bindings first. An ordinal of -1 stands for any key.
+  struct Binding {
+    int receiver, device, ordinal;
+    std::vector<Action> actions;
+  };
+  std::vector<Binding> bindings;
+  size_t pos = 0;
+  for (int line = 1; pos < text.size(); line++) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const std::string l = text.substr(pos, end - pos);
+    pos = end + 1;
+    auto fail = [&](const std::string &msg) {
+      *error = "line " + std::to_string(line) + ": " + msg;
+      return (Keymap *)NULL;
+    };
+    const char *spaces = " \t\r";
+    const size_t keyStart = l.find_first_not_of(spaces);
+    if (keyStart == std::string::npos || l[keyStart] == '#') {
+      continue;
+    }
+    const size_t keyEnd = std::min(l.find_first_of(spaces, keyStart),
+                                   l.size());
+    const size_t actionStart = l.find_first_not_of(spaces, keyEnd);
+    if (actionStart == std::string::npos) {
+      return fail("missing action");
+    }
+    const size_t actionEnd = std::min(l.find_first_of(spaces, actionStart),
+                                      l.size());
+    const size_t argStart = std::min(l.find_first_not_of(spaces, actionEnd),
+                                     l.size());
+    const size_t argEnd = l.find_last_not_of(spaces) + 1;
+
+    // <key>[@<receiver>[.<device>]]
+    Binding b = { 0, 0, -1, { } };
+    const std::string spec = l.substr(keyStart, keyEnd - keyStart);
+    const size_t at = spec.find('@');
+    const std::string name = spec.substr(0, at);
+    if (name != "*") {
+      const int code = Keys::fromString(name.c_str());
+      if (!code) {
+        return fail("unknown key \"" + name + "\"");
+      } else if (code & Keys::LONGPRESS && !Keys::find(code)->longPress) {
+        // The key auto-repeats, so the binding would never fire
+        return fail("\"" + name + "\" has no long press");
+      }
+      b.ordinal = 2*(Keys::find(code) - Keys::keys) +
+                  !!(code & Keys::LONGPRESS);
+    }
+    if (at != std::string::npos) {
+      const char *ptr = spec.c_str() + at + 1;
+      char *endPtr;
+      b.receiver = strtol(ptr, &endPtr, 10);
+      if (*endPtr == '.') {
+        b.device = strtol(ptr = endPtr + 1, &endPtr, 10);
+        if (b.device < 1 || b.device > MAX_DEVICES) {
+          return fail("device numbers go from 1 to " +
+                      std::to_string(MAX_DEVICES));
+        }
+      }
+      if (*endPtr || endPtr == ptr ||
+          b.receiver < 1 || b.receiver > MAX_RECEIVERS) {
+        return fail("expected receiver from 1 to " +
+                    std::to_string(MAX_RECEIVERS) + " after '@'");
+      }
+    }
+
+    Action action;
+    const std::string type = l.substr(actionStart, actionEnd - actionStart);
+    action.arg = argStart < argEnd ? l.substr(argStart, argEnd - argStart)
+                                   : "";
+    if (type == "print") {
+      action.type = Action::PRINT;
+    } else if (type == "exit") {
+      action.type = Action::EXIT;
+    } else if (type == "exec" && !action.arg.empty()) {
+      action.type = Action::EXEC;
+    } else if (type == "exec") {
+      return fail("exec needs a command");
+    } else if (type == "ir") {
+      std::string msg;
+      action.type = Action::IR;
+      action.ir = IrCode::compile(action.arg, &msg);
+      if (!action.ir) {
+        return fail(msg);
+      }
+    } else if (type == "wait") {
+      char *end;
+      const double ms = strtod(action.arg.c_str(), &end);
+      if (action.arg.empty() || *end || !(ms >= 0 && ms <= 3600000)) {
+        return fail("wait needs a time in milliseconds");
+      }
+      action.type = Action::WAIT;
+    } else {
+      return fail("unknown action \"" + type + "\"");
+    }
+
+    auto it = bindings.begin();
+    while (it != bindings.end() && (it->receiver != b.receiver ||
+           it->device != b.device || it->ordinal != b.ordinal)) {
+      it++;
+    }
+    if (it == bindings.end()) {
+      it = bindings.insert(it, b);
+    }
+    it->actions.push_back(action);
+  }
+
+  // Bindings that wait turn into macros
+  for (auto &b : bindings) {
+    auto isWait = [](const Action &a) { return a.type == Action::WAIT; };
+    if (std::none_of(b.actions.begin(), b.actions.end(), isWait)) {
+      continue;
+    }
+    std::shared_ptr<Macro> macro = std::make_shared<Macro>();
+    double offset = 0;
+    for (const auto &action : b.actions) {
+      if (isWait(action)) {
+        offset += strtod(action.arg.c_str(), NULL)*NANOS_PER_MS;
+      } else {
+        macro->steps.push_back({ (Nanos)offset, action });
+      }
+    }
+    Action action;
+    action.type = Action::MACRO;
+    action.macro = macro;
+    b.actions.assign(1, action);
+  }
+
+  // Lay out each binding's actions back to back, and point every slot at
+  // the most specific binding that covers it
+  Keymap *keymap = new Keymap();
+  std::vector<Slot> ranges;
+  for (auto it = bindings.begin(); it != bindings.end(); it++) {
+    if (keymap->actions.size() + it->actions.size() > UINT16_MAX) {
+      delete keymap;
+      *error = "too many actions";
+      return NULL;
+    }
+    ranges.push_back({ (uint16_t)keymap->actions.size(),
+                       (uint16_t)it->actions.size() });
+    keymap->actions.insert(keymap->actions.end(), it->actions.begin(),
+                           it->actions.end());
+  }
+  for (int receiver = 0; receiver <= MAX_RECEIVERS; receiver++) {
+    for (int device = 0; device <= MAX_DEVICES; device++) {
+      for (int ordinal = 0; ordinal < ORDINALS; ordinal++) {
+        Slot &slot = keymap->slots[index(receiver, device, ordinal)];
+        slot = { 0, 0 };
+        int best = -1;
+        for (size_t i = 0; i < bindings.size(); i++) {
+          const Binding &b = bindings[i];
+          if ((b.ordinal < 0 || b.ordinal == ordinal) &&
+              (!b.receiver || b.receiver == receiver) &&
+              (!b.device || b.device == device)) {
+            const int score = 4*(b.ordinal >= 0) + 2*!!b.receiver +
+                              !!b.device;
+            if (score > best) {
+              best = score;
+              slot = ranges[i];
+            }
+          }
+        }
+      }
+    }
+  }
+  return keymap;
+}
+
+Keymap *Keymap::load(const std::string &path, std::string *error) {
+  FILE *fp = fopen(path.c_str(), "re");
+  if (!fp) {
+    *error = strerror(errno);
+    return NULL;
+  }
+  std::string text;
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0; ) {
+    text.append(buf, n);
+  }
+  const bool ok = !ferror(fp);
+  fclose(fp);
+  if (!ok) {
+    *error = "read error";
+    return NULL;
+  }
+  return compile(text, error);
+}
+
+KeymapWatcher::KeymapWatcher(Event *event, const std::string &path,
+                             const std::string &fallback)
+  : event(event), path(path), fallback(fallback) {
+}
+
+KeymapWatcher::~KeymapWatcher() {
+  if (settle) {
+    event->removeTimeout(settle);
+  }
+  if (pollFd) {
+    event->removePollFd(pollFd);
+  }
+  if (inotifyFd >= 0) {
+    close(inotifyFd);
+  }
+  if (worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cond.notify_one();
+    worker.join();
+  }
+  delete current.load();
+}
+
+bool KeymapWatcher::start(std::string *error) {
+  Keymap *keymap = access(path.c_str(), F_OK) && errno == ENOENT
+                   ? Keymap::compile(fallback, error)
+                   : Keymap::load(path, error);
+  if (!keymap) {
+    return false;
+  }
+  current.store(keymap, std::memory_order_release);
+
+  // Watch the directory, as editors tend to write a new file and rename it
+  const size_t slash = path.rfind('/');
+  const std::string dir = slash == std::string::npos ? "."
+                        : slash ? path.substr(0, slash) : "/";
+  inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotifyFd < 0 ||
+      inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE |
+                        IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+#if !defined(NDEBUG)
+    perror(dir.c_str());
+#endif
+    // Still usable, just without reloading
+    if (inotifyFd >= 0) {
+      close(inotifyFd);
+      inotifyFd = -1;
+    }
+    return true;
+  }
+  pollFd = event->addPollFd(inotifyFd, POLLIN, [this]() { handleInotify(); });
+  worker = std::thread([this]() { work(); });
+  return true;
+}
+
+void KeymapWatcher::handleInotify() {
+  const size_t slash = path.rfind('/');
+  const char *name = path.c_str() + (slash == std::string::npos
+                                     ? 0 : slash + 1);
+  alignas(struct inotify_event) char buf[4096];
+  bool changed = false;
+  for (;;) {
+    const ssize_t len = read(inotifyFd, buf, sizeof(buf));
+    if (len <= 0) {
+      break;
+    }
+    for (ssize_t i = 0; i < len; ) {
+      const struct inotify_event *ev = (const struct inotify_event *)(buf + i);
+      changed |= ev->len && !strcmp(ev->name, name);
+      i += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  if (changed) {
+    requestReload();
+  }
+}
+
+void KeymapWatcher::requestReload() {
+  // Editors often write in several steps. Wait for things to settle, and
+  // then reload once.
+  if (settle) {
+    return;
+  }
+  settle = event->addTimeout(KEYMAP_SETTLE, [this]() {
+    settle = Event::Handle();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = true;
+    }
+    cond.notify_one();
+  });
+}
+
+void KeymapWatcher::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    cond.wait(lock, [this]() { return pending || stopping; });
+    if (stopping) {
+      break;
+    }
+    pending = false;
+    lock.unlock();
+    std::string error;
+    if (!access(path.c_str(), F_OK) || errno != ENOENT) {
+      Keymap *keymap = Keymap::load(path, &error);
+      if (keymap) {
+        install(keymap);
+      } else {
+        // A broken file leaves the old keymap in place
+#if !defined(NDEBUG)
+        fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+#endif
+      }
+    }
+    lock.lock();
+  }
+}
+
+void KeymapWatcher::install(Keymap *keymap) {
+  // The loop could be dispatching a key with the old keymap right now. It
+  // gets released once the loop is done with its current callbacks.
+  Keymap *old = current.exchange(keymap, std::memory_order_acq_rel);
+  reloads++;
+  if (old) {
+    event->runLater([old]() { delete old; });
+  }
+#if !defined(NDEBUG)
+  fprintf(stderr, "Reloaded keymap from %s\n", path.c_str());
+#endif
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "ir.h"
+#include "keys.h"
+
+// Maps keys to actions. The config file has one binding per line:
+//   <key>[@<receiver>[.<device>]] <action> [<argument>]
+// for example
+//   *            print
+//   LONG_OFF     exit
+//   VOL_UP@1.2   exec amixer -q set Master 5%+
+//   DEVICE_1@2   ir nec 0x04 0x08
+// Keys are named like Keys::toString() does, with '_' for spaces, and "*"
+// stands for any key. Only keys that have a long press (see keys.h) can be
+// bound as LONG_<key>. Receivers and devices are numbered from 1, and
+// default to any. The most specific binding wins: a named key beats "*",
+// then a receiver beats none, then a device beats none. If several lines
+// have the same binding, all their actions run in order. Lines that start
+// with '#' are comments. "ir" takes a code as described for IrCode.
+// Commands for "exec" get the number of key presses that they stand for in
+// $1; this is more than one, if several presses got merged while they
+// were waiting for their turn (see OutputQueue).
+// "wait <ms>" delays the actions that come after it, which turns the
+// binding into a macro:
+//   DEVICE_1     ir nec 0x04 0x08
+//   DEVICE_1     wait 2000
+//   DEVICE_1     ir nec 0x04 0x0C
+// A macro runs once per key press. Auto-repeat leaves it running.
+// Compiling resolves all of this up front. Every combination of receiver,
+// device and key gets a slot in one flat array, so dispatching a key costs
+// a hash probe for its ordinal and a single table load.
+class Keymap {
+ public:
+  enum { MAX_RECEIVERS = 4, MAX_DEVICES = 6 };
+
+  struct Macro;
+
+  struct Action {
+    enum Type { PRINT, EXIT, EXEC, IR, WAIT, MACRO };
+    Type type;
+    std::string arg;
+    std::shared_ptr<const IrCode> ir;   // Compiled from "arg"
+    std::shared_ptr<const Macro> macro; // Only for MACRO
+  };
+
+  // A binding that waits somewhere compiles into a single MACRO action.
+  // Its steps hold all the other actions, each with the time from the key
+  // press at which it is due. Steps are sorted by that time.
+  struct Macro {
+    struct Step {
+      Nanos offset;
+      Action action;
+    };
+    std::vector<Step> steps;
+  };
+
+  // Returns NULL, and describes the first problem in "error", if the config
+  // doesn't parse
+  static Keymap *compile(const std::string &text, std::string *error);
+  static Keymap *load(const std::string &path, std::string *error);
+
+  // Actions bound to a key, possibly with KEY_LONGPRESS set. Receivers and
+  // devices beyond the maximum only match bindings for any receiver or
+  // device.
+  const Action *find(int receiver, int device, int key, int *count) const {
+    const Keys::Info *info = Keys::find(key);
+    if (!info) {
+      *count = 0;
+      return NULL;
+    }
+    const int ordinal = 2*(info - Keys::keys) + !!(key & Keys::LONGPRESS);
+    const Slot &slot = slots[index(receiver > 0 && receiver <= MAX_RECEIVERS
+                                   ? receiver : 0,
+                                   device > 0 && device <= MAX_DEVICES
+                                   ? device : 0, ordinal)];
+    *count = slot.count;
+    return actions.data() + slot.first;
+  }
+
+ private:
+  enum { ORDINALS = 2*Keys::COUNT,
+         SLOTS = (MAX_RECEIVERS + 1)*(MAX_DEVICES + 1)*ORDINALS };
+
+  struct Slot {
+    uint16_t first;
+    uint16_t count;
+  };
+
+  static int index(int receiver, int device, int ordinal) {
+    return (receiver*(MAX_DEVICES + 1) + device)*ORDINALS + ordinal;
+  }
+
+  Slot slots[SLOTS];
+  std::vector<Action> actions;
+};
+
+// Keeps a keymap loaded from a file, and reloads it whenever the file
+// changes. inotify watches the file's directory, so that editors which
+// replace the file are noticed, too. Reloads get compiled on a worker
+// thread and then swapped in with a single atomic store. The key path never
+// waits for a reload, and a config that doesn't parse leaves the previous
+// keymap in place.
+// Replaced keymaps are released from the event loop. get() is meant to be
+// called from the loop's thread, and its result shouldn't be kept beyond
+// the current callback.
+class KeymapWatcher {
+ public:
+  KeymapWatcher(Event *event, const std::string &path,
+                const std::string &fallback = "");
+  ~KeymapWatcher();
+  // Loads the keymap right away. If there is no file, the "fallback"
+  // config takes its place until the file shows up. Returns false, if
+  // neither can be compiled.
+  bool start(std::string *error);
+  const Keymap *get() const {
+    return current.load(std::memory_order_acquire); }
+  unsigned long getReloads() const { return reloads; }
+
+ private:
+  enum { KEYMAP_SETTLE = 100 };  // Time (ms) for a burst of writes to end
+
+  void handleInotify();
+  void requestReload();
+  void work();
+  void install(Keymap *keymap);
+
+  Event *event;
+  std::string path, fallback;
+  std::atomic<Keymap *> current = { NULL };
+  std::atomic<unsigned long> reloads = { 0 };
+  int inotifyFd = -1;
+  Event::Handle pollFd;
+  Event::Handle settle;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool pending = false;
+  bool stopping = false;
+};
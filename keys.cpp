@@ -0,0 +1,20 @@
+#include "keys.h"
+
+int Keys::fromString(const char *name) {
+  if (!name) {
+    return 0;
+  }
+  // Names of long presses are only prefixed. Strip that, and hash the rest.
+  int flags = 0;
+  static const char prefix[] = "LONG ";
+  int i = 0;
+  while (prefix[i] && normalize(name[i]) == prefix[i]) {
+    i++;
+  }
+  if (!prefix[i]) {
+    name += i;
+    flags = LONGPRESS;
+  }
+  const Info &info = keys[nameHash.slots[nameSlot(name, nameHash.seed)]];
+  return equals(info.name, name) ? info.code | flags : 0;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every key on the Harmony remote. This is the only list of keys: Harmony's
+// KEY_* constants, the names, the metadata, and the lookup tables in both
+// directions are all generated from it.
+//   X(identifier, code, name, category, repeatable, long press)
+// Codes are HID usages, with the report type in bits 16 and 17. Repeatable
+// keys are meant to be held down, e.g. to ramp up the volume, and get
+// auto-repeat. Keys with a long press report KEY_LONG_* when held. A key
+// can't have both, as auto-repeat keys never turn into long presses.
+#define HARMONY_KEYS(X)                                              \
+  X(OFF,      0x3EC01, "OFF",      POWER,      false, true)          \
+  X(DEVICE_1, 0x3E801, "DEVICE 1", DEVICE,     false, true)          \
+  X(DEVICE_2, 0x3ED01, "DEVICE 2", DEVICE,     false, true)          \
+  X(DEVICE_3, 0x3E901, "DEVICE 3", DEVICE,     false, true)          \
+  X(DIM_UP,   0x3F00F, "DIM UP",   LIGHTS,     true,  false)         \
+  X(DIM_DOWN, 0x3F10F, "DIM DOWN", LIGHTS,     true,  false)         \
+  X(BULB_1,   0x3F20F, "BULB 1",   LIGHTS,     false, true)          \
+  X(BULB_2,   0x3F30F, "BULB 2",   LIGHTS,     false, true)          \
+  X(PLUG_1,   0x3F40F, "PLUG 1",   LIGHTS,     false, true)          \
+  X(PLUG_2,   0x3F50F, "PLUG 2",   LIGHTS,     false, true)          \
+  X(RED,      0x3F701, "RED",      COLOR,      false, true)          \
+  X(GREEN,    0x3F601, "GREEN",    COLOR,      false, true)          \
+  X(YELLOW,   0x3F501, "YELLOW",   COLOR,      false, true)          \
+  X(BLUE,     0x3F401, "BLUE",     COLOR,      false, true)          \
+  X(DVR,      0x39A00, "DVR",      MEDIA,      false, true)          \
+  X(GUIDE,    0x38D00, "GUIDE",    NAVIGATION, false, true)          \
+  X(INFO,     0x3FF01, "INFO",     NAVIGATION, false, true)          \
+  X(EXIT,     0x39400, "EXIT",     NAVIGATION, false, true)          \
+  X(MENU,     0x10065, "MENU",     NAVIGATION, false, true)          \
+  X(VOL_UP,   0x3E900, "VOL UP",   VOLUME,     true,  false)         \
+  X(VOL_DOWN, 0x3EA00, "VOL DOWN", VOLUME,     true,  false)         \
+  X(CHN_UP,   0x39C00, "CHN UP",   CHANNEL,    false, true)          \
+  X(CHN_DOWN, 0x39D00, "CHN DOWN", CHANNEL,    false, true)          \
+  X(UP,       0x10052, "UP",       NAVIGATION, false, true)          \
+  X(DOWN,     0x10051, "DOWN",     NAVIGATION, false, true)          \
+  X(LEFT,     0x10050, "LEFT",     NAVIGATION, false, true)          \
+  X(RIGHT,    0x1004F, "RIGHT",    NAVIGATION, false, true)          \
+  X(OK,       0x10058, "OK",       NAVIGATION, false, true)          \
+  X(MUTE,     0x3E200, "MUTE",     VOLUME,     false, true)          \
+  X(BACK,     0x32402, "BACK",     NAVIGATION, false, true)          \
+  X(RWD,      0x3B400, "RWD",      MEDIA,      false, true)          \
+  X(FWD,      0x3B300, "FWD",      MEDIA,      false, true)          \
+  X(RECORD,   0x3B200, "RECORD",   MEDIA,      false, true)          \
+  X(STOP,     0x3B700, "STOP",     MEDIA,      false, true)          \
+  X(PLAY,     0x3B000, "PLAY",     MEDIA,      false, true)          \
+  X(PAUSE,    0x3B100, "PAUSE",    MEDIA,      false, true)          \
+  X(NUM1,     0x1001E, "NUM 1",    NUMBER,     false, true)          \
+  X(NUM2,     0x1001F, "NUM 2",    NUMBER,     false, true)          \
+  X(NUM3,     0x10020, "NUM 3",    NUMBER,     false, true)          \
+  X(NUM4,     0x10021, "NUM 4",    NUMBER,     false, true)          \
+  X(NUM5,     0x10022, "NUM 5",    NUMBER,     false, true)          \
+  X(NUM6,     0x10023, "NUM 6",    NUMBER,     false, true)          \
+  X(NUM7,     0x10024, "NUM 7",    NUMBER,     false, true)          \
+  X(NUM8,     0x10025, "NUM 8",    NUMBER,     false, true)          \
+  X(NUM9,     0x10026, "NUM 9",    NUMBER,     false, true)          \
+  X(NUM0,     0x10027, "NUM 0",    NUMBER,     false, true)          \
+  X(CLEAR,    0x10056, "CLEAR",    NUMBER,     false, true)          \
+  X(ENTER,    0x10028, "ENTER",    NUMBER,     false, true)
+
+// Lookups in both directions are a single probe into a perfect hash table.
+// The hash parameters are searched for at compile time, so adding a key
+// never needs anything but a new line in HARMONY_KEYS.
+class Keys {
+ public:
+  enum Category { POWER, DEVICE, LIGHTS, COLOR, NAVIGATION, MEDIA, VOLUME,
+                  CHANNEL, NUMBER };
+  enum { LONGPRESS = 0x40000 };
+
+  struct Info {
+    int code;
+    const char *name;
+    const char *longName;
+    Category category;
+    bool repeatable;
+    bool longPress;
+  };
+
+  // Position of each key in "keys", e.g. Keys::IDX_OK
+  enum Index {
+#define X(id, code, name, category, repeatable, longPress) IDX_##id,
+    HARMONY_KEYS(X)
+#undef X
+    COUNT
+  };
+
+  static constexpr Info keys[] = {
+#define X(id, code, name, category, repeatable, longPress) \
+    { code, name, "LONG " name, category, repeatable, longPress },
+    HARMONY_KEYS(X)
+#undef X
+  };
+
+  // NULL for unknown codes. KEY_LONGPRESS is ignored.
+  static const Info *find(int code) {
+    const Info &info = keys[codeHash.slots[codeSlot(code & ~LONGPRESS,
+                                                    codeHash.mul)]];
+    return info.code == (code & ~LONGPRESS) ? &info : NULL;
+  }
+
+  static const char *toString(int key) {
+    const Info *info = find(key);
+    return !info ? "UNKNOWN KEY" : key & LONGPRESS ? info->longName
+                                                   : info->name;
+  }
+
+  // Accepts the names that toString() returns. Case doesn't matter, and
+  // '_' or '-' can stand in for spaces, e.g. "long vol_up". Returns zero
+  // for unknown names.
+  static int fromString(const char *name);
+
+ private:
+  enum { SLOTS = 256 };
+
+  struct CodeHash {
+    uint32_t mul = 0;
+    uint8_t slots[SLOTS] = { };
+  };
+
+  struct NameHash {
+    uint32_t seed = 0;
+    uint8_t slots[SLOTS] = { };
+  };
+
+  static constexpr unsigned codeSlot(int code, uint32_t mul) {
+    return (uint32_t)(code * mul) >> 24;
+  }
+
+  static constexpr char normalize(char ch) {
+    return ch == '_' || ch == '-' ? ' '
+         : ch >= 'a' && ch <= 'z' ? ch - 'a' + 'A' : ch;
+  }
+
+  static constexpr unsigned nameSlot(const char *name, uint32_t seed) {
+    // FNV-1a over the normalized name
+    uint32_t hash = seed;
+    for (; *name; name++) {
+      hash = (hash ^ (uint8_t)normalize(*name)) * 16777619u;
+    }
+    return hash >> 24;
+  }
+
+  // Tries multipliers until every key lands in a slot of its own. Slots
+  // that no key maps to can point anywhere, as lookups compare the code.
+  // Consecutive multipliers hash the codes much alike, so candidates come
+  // from an LCG instead.
+  static constexpr CodeHash makeCodeHash() {
+    CodeHash hash;
+    if (!isUnique()) {
+      return hash;  // No multiplier would ever do
+    }
+    for (uint32_t mul = 0x9E3779B1u; ;
+         mul = (mul * 1664525u + 1013904223u) | 1) {
+      bool used[SLOTS] = { };
+      bool ok = true;
+      for (int i = 0; ok && i < COUNT; i++) {
+        const unsigned slot = codeSlot(keys[i].code, mul);
+        ok = !used[slot];
+        used[slot] = true;
+        hash.slots[slot] = i;
+      }
+      if (ok) {
+        hash.mul = mul;
+        return hash;
+      }
+    }
+  }
+
+  static constexpr NameHash makeNameHash() {
+    NameHash hash;
+    if (!isUnique()) {
+      return hash;
+    }
+    for (uint32_t seed = 2166136261u; ; seed++) {
+      bool used[SLOTS] = { };
+      bool ok = true;
+      for (int i = 0; ok && i < COUNT; i++) {
+        const unsigned slot = nameSlot(keys[i].name, seed);
+        ok = !used[slot];
+        used[slot] = true;
+        hash.slots[slot] = i;
+      }
+      if (ok) {
+        hash.seed = seed;
+        return hash;
+      }
+    }
+  }
+
+  static constexpr bool equals(const char *a, const char *b) {
+    for (; *a && normalize(*a) == normalize(*b); a++, b++) { }
+    return normalize(*a) == normalize(*b);
+  }
+
+  // Defined below, once the class is complete
+  static const CodeHash codeHash;
+  static const NameHash nameHash;
+
+ public:
+  // No two keys can share a code, or a name that only differs in case or
+  // in how spaces are spelled
+  static constexpr bool isUnique() {
+    for (int i = 0; i < COUNT; i++) {
+      for (int j = 0; j < i; j++) {
+        if (keys[i].code == keys[j].code ||
+            equals(keys[i].name, keys[j].name)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Auto-repeat keys never turn into long presses
+  static constexpr bool hasValidFlags() {
+    for (int i = 0; i < COUNT; i++) {
+      if (keys[i].repeatable && keys[i].longPress) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Every key has to be found by its code and by its name, and codes must
+  // leave room for the long press flag
+  static constexpr bool isComplete() {
+    for (int i = 0; i < COUNT; i++) {
+      if (keys[i].code & LONGPRESS ||
+          codeHash.slots[codeSlot(keys[i].code, codeHash.mul)] != i ||
+          nameHash.slots[nameSlot(keys[i].name, nameHash.seed)] != i) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static_assert((int)COUNT < (int)SLOTS, "Too many keys for the hash tables");
+};
+
+inline constexpr Keys::CodeHash Keys::codeHash = Keys::makeCodeHash();
+inline constexpr Keys::NameHash Keys::nameHash = Keys::makeNameHash();
+static_assert(Keys::isUnique(), "HARMONY_KEYS has duplicate codes or names");
+static_assert(Keys::hasValidFlags(),
+              "Keys can't both auto-repeat and have a long press");
+static_assert(Keys::isComplete(), "Keys are missing from the hash tables");
@@ -0,0 +1,113 @@
+#include "macro.h"
+
+MacroEngine::MacroEngine(Event *event, StepCallback cb)
+  : event(event), cb(std::move(cb)) {
+}
+
+MacroEngine::~MacroEngine() {
+  for (const auto &it : running) {
+    if (runs[it.second].timer) {
+      event->removeTimeout(runs[it.second].timer);
+    }
+  }
+}
+
+void MacroEngine::start(const std::shared_ptr<const Keymap::Macro> &macro,
+                        const Harmony::KeyEvent &ev) {
+  cancel(ev.receiver, ev.device);
+  if (!macro || macro->steps.empty()) {
+    return;
+  }
+  stats.started++;
+  const uint32_t slot = runs.alloc();
+  Run &r = runs[slot];
+  r.macro = macro;
+  r.ev = ev;
+  r.pos = 0;
+  r.start = Util::nanos();
+  r.deadline = r.start + macro->steps[0].offset;
+  r.timer = Event::Handle();
+  r.id = ++nextId;
+  running[std::make_pair(ev.receiver, ev.device)] = slot;
+  // Steps that are due right away don't count against the loop's budget
+  int budget = MACRO_BATCH;
+  runSteps(slot, &budget);
+}
+
+bool MacroEngine::cancel(int receiver, int device) {
+  const auto it = running.find(std::make_pair(receiver, device));
+  if (it == running.end()) {
+    return false;
+  }
+  stats.cancelled++;
+  stop(it->second);
+  return true;
+}
+
+void MacroEngine::runSteps(uint32_t slot, int *budget) {
+  // The step gets taken off its macro before calling out, so that the
+  // callback can start or cancel macros, including this one.
+  const unsigned long id = runs[slot].id;
+  while (*budget > 0) {
+    Run &r = runs[slot];
+    const uint64_t late = Util::nanos() - r.deadline;
+    if ((int64_t)late < 0) {
+      break;
+    }
+    --*budget;
+    const uint64_t us = late / 1000;
+    stats.steps++;
+    stats.jitterNanos += late;
+    stats.maxJitterNanos = std::max(stats.maxJitterNanos, late);
+    stats.jitter[us ? std::min(64 - __builtin_clzll(us),
+                               (int)JITTER_BUCKETS - 1) : 0]++;
+
+    const std::shared_ptr<const Keymap::Macro> macro = r.macro;
+    const Keymap::Action &action = macro->steps[r.pos].action;
+    const Harmony::KeyEvent ev = r.ev;
+    const bool last = ++r.pos == macro->steps.size();
+    if (last) {
+      stats.completed++;
+      stop(slot);
+    } else {
+      r.deadline = r.start + macro->steps[r.pos].offset;
+    }
+    cb(action, ev);
+    if (last || runs[slot].id != id) {
+      return;
+    }
+  }
+  arm(slot);
+}
+
+void MacroEngine::arm(uint32_t slot) {
+  // If the budget ran out, the deadline has already passed, and the step
+  // runs on the next iteration of the loop, after it checked for input
+  Run &r = runs[slot];
+  if (r.timer) {
+    event->removeTimeout(r.timer);
+  }
+  r.timer = event->addTimeoutAt(r.deadline, [this, slot]() {
+    runs[slot].timer = Event::Handle();
+    if (!budget) {
+      arm(slot);
+      return;
+    } else if (budget == MACRO_BATCH) {
+      // Hand out a new budget once this iteration is done
+      event->runLater([this]() { budget = MACRO_BATCH; });
+    }
+    runSteps(slot, &budget);
+  });
+}
+
+void MacroEngine::stop(uint32_t slot) {
+  Run &r = runs[slot];
+  if (r.timer) {
+    event->removeTimeout(r.timer);
+    r.timer = Event::Handle();
+  }
+  running.erase(std::make_pair(r.ev.receiver, r.ev.device));
+  r.macro.reset();
+  r.id = 0;
+  runs.release(slot);
+}
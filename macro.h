@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "callback.h"
+#include "event.h"
+#include "harmony.h"
+#include "keymap.h"
+#include "slab.h"
+#include "util.h"
+
+// Runs the macros that Keymap compiles. Each running macro is a small
+// record that remembers its next step, and has an Event timer for when that
+// step is due. Steps are scheduled relative to when the macro started, so
+// delays never add up.
+// Each remote runs at most one macro at a time; starting another one, or
+// cancelling, stops whatever it was running. Only so many steps run per
+// iteration of the event loop. Steps beyond that wait for the next one, and
+// the loop gets to look at its file descriptors in between. That way, a
+// pile of macros that all come due at once never holds up decoding keys.
+class MacroEngine {
+ public:
+  typedef InlineFunction<void (const Keymap::Action &action,
+                               const Harmony::KeyEvent &ev)> StepCallback;
+
+  enum { JITTER_BUCKETS = 16 };
+
+  struct Stats {
+    uint64_t started;
+    uint64_t completed;
+    uint64_t cancelled;       // Stopped before their last step
+    uint64_t steps;
+    uint64_t jitterNanos;     // Total time that steps ran late
+    uint64_t maxJitterNanos;
+    // Steps by how late they ran: less than 1us, less than 2us, less than
+    // 4us and so on. The last bucket counts everything beyond that.
+    uint64_t jitter[JITTER_BUCKETS];
+  };
+
+  MacroEngine(Event *event, StepCallback cb);
+  ~MacroEngine();
+  // Starts a macro on behalf of the remote that sent "ev". Steps that are
+  // due right away run before this returns.
+  void start(const std::shared_ptr<const Keymap::Macro> &macro,
+             const Harmony::KeyEvent &ev);
+  // Returns true, if the remote was running a macro
+  bool cancel(int receiver, int device);
+  size_t getRunning() const { return running.size(); }
+  const Stats &getStats() const { return stats; }
+  void resetStats() { stats = { }; }
+
+ private:
+  enum { MACRO_BATCH = 16 };  // Steps to run before checking for input
+
+  struct Run {
+    std::shared_ptr<const Keymap::Macro> macro;
+    Harmony::KeyEvent ev;
+    size_t pos;               // Next step
+    Nanos start;
+    Nanos deadline;           // When the next step is due
+    Event::Handle timer;
+    unsigned long id;         // Zero once stopped
+  };
+
+  void runSteps(uint32_t slot, int *budget);
+  void arm(uint32_t slot);
+  void stop(uint32_t slot);
+
+  Event *event;
+  StepCallback cb;
+  Slab<Run> runs;
+  std::map<std::pair<int, int>, uint32_t> running; // By receiver, device
+  unsigned long nextId = 0;
+  int budget = MACRO_BATCH;   // Steps left in this iteration of the loop
+  Stats stats = { };
+};
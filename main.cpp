@@ -1,9 +1,26 @@
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <iostream>
+#include <memory>
 
 #include "event.h"
 #include "harmony.h"
+#include "hidrawtransport.h"
+#include "ir.h"
+#include "keymap.h"
+#include "keys.h"
+#include "macro.h"
+#include "metacache.h"
+#include "outputqueue.h"
+#include "trace.h"
+#include "usbtransport.h"
+#include "util.h"
 
 // Modern (non-working) receiver: 0x24110026
 // Old (working) receiver:        0x12030025
@@ -32,59 +49,288 @@
 //  18: [1E90]  HI unknown
 //  19: [18B0]  HI unknown
 
-static void readName(Harmony *harmony, int idx) {
-  unsigned char buf[16] = "\x10\xFF\x83\xB5\x40\x00\x00";
-  buf[4] = 0x40 + idx;
-  harmony->sendHIDppRequestAndWait(buf, [idx](
-    int len, const unsigned char *buf) {
-      unsigned char out[16] = { };
-      std::cout << "Device name #" << idx << ": ";
-      memcpy(out, buf + 6,
-             std::max(0, std::min((int)buf[5],
-                                  std::min(len-6, (int)sizeof(out)-1))));
-      std::cout << out << std::endl;
-    },
-    [idx](
-    int len, const unsigned char *buf) {
-      std::cout << "Failed to get device name #" << idx << ": "
-                << buf[6] << std::endl;
-    });
+static void printNames(Harmony *harmony, int receiver) {
+  // Harmony reads the names of all paired devices while bringing up the
+  // receiver
+  for (int device = 1; device <= 6; device++) {
+    const std::string name = harmony->getDeviceName(receiver, device);
+    if (!name.empty()) {
+      std::cout << "Device name #" << receiver << "." << device << ": "
+                << name << std::endl;
+    }
+  }
+}
+
+static std::string cacheFile(const char *suffix = "") {
+  // What we know about receivers survives restarts, so that keys work
+  // right away
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  const std::string dir = xdg && *xdg ? xdg
+                        : std::string(home ? home : "/tmp") + "/.cache";
+  mkdir(dir.c_str(), 0700);
+  return dir + "/harmonizerc" + suffix;
+}
+
+static int decodeTrace(const char *path, bool json) {
+  FILE *fp = fopen(path, "rbe");
+  if (!fp) {
+    perror(path);
+    return 1;
+  }
+  const bool ok = Trace::decode(fp, stdout, json);
+  fclose(fp);
+  if (!ok) {
+    fprintf(stderr, "%s: not a valid trace\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+static void configureHarmony(Harmony *harmony) {
+  // Keys that are meant to be held down (volume, brightness) repeat,
+  // instead of turning into long presses
+  for (const auto &key : Keys::keys) {
+    if (key.repeatable) {
+      harmony->setAutoRepeat(key.code, 400, 100);
+    }
+  }
+}
+
+static std::string configFile(const char *name) {
+  const char *xdg = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+  return std::string(xdg && *xdg ? xdg
+                     : std::string(home ? home : "/tmp") + "/.config") +
+         "/" + name;
+}
+
+// Used until there is a keymap file
+static const char defaultKeymap[] =
+  "*         print\n"
+  "LONG_OFF  print\n"
+  "LONG_OFF  exit\n";
+
+static void printKey(Harmony *harmony, const Harmony::KeyEvent &ev) {
+  const int key = ev.key;
+  std::cout << harmony->getReceiverPath(ev.receiver) << "#" << ev.device
+            << " (" << (Util::nanos() - ev.tm) / NANOS_PER_MS << "ms): "
+            << std::hex << "KEY => " << key
+            << ", " << Harmony::toString(key)
+            << (ev.repeat ? " (repeat)" : "") << std::endl << std::dec;
+}
+
+static void runAction(Event *event, Harmony *harmony, IrOutput *ir,
+                      const Keymap::Action &action,
+                      const Harmony::KeyEvent &ev, unsigned count = 1) {
+  switch (action.type) {
+  case Keymap::Action::PRINT:
+    printKey(harmony, ev);
+    break;
+  case Keymap::Action::EXIT:
+    event->exitLoop();
+    break;
+  case Keymap::Action::EXEC: {
+    // Don't wait for the command. SIGCHLD is ignored, so children get
+    // reaped automatically. The number of merged key presses goes into $1.
+    char n[16];
+    snprintf(n, sizeof(n), "%u", count);
+    const char *argv[] = { "/bin/sh", "-c", action.arg.c_str(),
+                           "harmonizerc", n, NULL };
+    pid_t pid;
+    if (posix_spawn(&pid, "/bin/sh", NULL, NULL, (char **)argv, environ)) {
+      perror(action.arg.c_str());
+    }
+    break; }
+  case Keymap::Action::IR:
+    for (unsigned i = 0; i < count; i++) {
+      ir->send(action.ir, ev.repeat);
+    }
+    break;
+  case Keymap::Action::WAIT:
+  case Keymap::Action::MACRO:
+    // Keymap turns these into macros, and macros into steps
+    break;
+  }
+}
+
+// Rate limits for outputs that talk to other devices. IR codes take about
+// 100ms to transmit, so anything that is still waiting after a few of
+// those is stale. Commands get merged, and find out how many key presses
+// they stand for.
+enum { TARGET_IR, TARGET_EXEC };
+static const OutputQueue::Rules irRules = { 10, 3, 16, false, 300 };
+static const OutputQueue::Rules execRules = { 20, 5, 32, true, 500 };
+
+// Outputs that talk to other devices go through their queues, whether a key
+// or a macro step asked for them
+static void dispatchAction(Event *event, Harmony *harmony, IrOutput *ir,
+                           OutputQueue *outputs,
+                           const Keymap::Action &action,
+                           const Harmony::KeyEvent &ev) {
+  if (action.type == Keymap::Action::IR) {
+    outputs->push(TARGET_IR, action, ev);
+  } else if (action.type == Keymap::Action::EXEC) {
+    outputs->push(TARGET_EXEC, action, ev);
+  } else {
+    runAction(event, harmony, ir, action, ev);
+  }
 }
 
-static void handleHarmonyKey(Event *event, Harmony *harmony, int key) {
-  std::cout << std::hex << "KEY => " << key
-            << ", " << Harmony::toString(key) << std::endl << std::dec;
-  if (event) {
-    if (key == Harmony::KEY_LONG_OFF) {
-      event->exitLoop();
+static void handleHarmonyKey(Event *event, Harmony *harmony,
+                             IrOutput *ir, MacroEngine *macros,
+                             OutputQueue *outputs, const Keymap *keymap,
+                             const Harmony::KeyEvent &ev) {
+  // Pressing another key stops the macro that the remote is running
+  if (!ev.repeat) {
+    macros->cancel(ev.receiver, ev.device);
+  }
+  int count;
+  const Keymap::Action *actions = keymap->find(ev.receiver, ev.device,
+                                               ev.key, &count);
+  for (int i = 0; i < count; i++) {
+    if (actions[i].type == Keymap::Action::MACRO) {
+      // Auto-repeat would restart the macro before it gets anywhere
+      if (!ev.repeat) {
+        macros->start(actions[i].macro, ev);
+      }
+    } else {
+      dispatchAction(event, harmony, ir, outputs, actions[i], ev);
     }
   }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
 #if 1
-  Event event;
-  Harmony harmony(&event);
-  event.runLater([&]() {
-    for (int i = 0; i < 6; i++) {
-      readName(&harmony, i);
+  // With "--hidraw", receivers stay with the kernel's hid-logitech-dj
+  // driver. By default, libusb takes them over.
+  // "--trace-socket PATH" serves the trace ring to anyone who connects;
+  // SIGUSR1 always dumps it next to the metadata cache. Dumps can be read
+  // with "--decode-trace FILE [--json]".
+  // Keys are bound to actions by ~/.config/harmonizerc.keymap, unless
+  // "--keymap PATH" says otherwise. See keymap.h for the format. IR codes
+  // go to /dev/lirc0, or to "--ir-output PATH".
+  bool hidraw = false;
+  const char *traceSocket = NULL, *irFile = "/dev/lirc0";
+  std::string keymapFile = configFile("harmonizerc.keymap");
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--hidraw")) {
+      hidraw = true;
+    } else if (!strcmp(argv[i], "--keymap") && i + 1 < argc) {
+      keymapFile = argv[++i];
+    } else if (!strcmp(argv[i], "--ir-output") && i + 1 < argc) {
+      irFile = argv[++i];
+    } else if (!strcmp(argv[i], "--trace-socket") && i + 1 < argc) {
+      traceSocket = argv[++i];
+    } else if (!strcmp(argv[i], "--decode-trace") && i + 1 < argc) {
+      return decodeTrace(argv[i + 1],
+                         i + 2 < argc && !strcmp(argv[i + 2], "--json"));
+    }
+  }
+  // Macros want their steps on time, not rounded up to the millisecond
+  Event event(Event::BACKEND_EPOLL, true);
+  Trace::dumpOnSignal(SIGUSR1, cacheFile(".trace").c_str());
+  signal(SIGCHLD, SIG_IGN);
+  KeymapWatcher keymap(&event, keymapFile, defaultKeymap);
+  std::string error;
+  if (!keymap.start(&error)) {
+    std::cerr << keymapFile << ": " << error << std::endl;
+    return 1;
+  }
+  if (traceSocket && !Trace::serve(&event, traceSocket)) {
+    perror(traceSocket);
+  }
+  // Without an IR transmitter, everything else still works
+  IrOutput ir(&event);
+  if (!ir.open(irFile, &error)) {
+    std::cerr << irFile << ": " << error << std::endl;
+  }
+  std::unique_ptr<Transport> transport;
+  if (hidraw) {
+    transport.reset(new HidrawTransport());
+  } else {
+    transport.reset(new UsbTransport());
+  }
+  MetadataCache cache(cacheFile());
+  cache.load();
+  Harmony harmony(&event, transport.get(), &cache);
+  configureHarmony(&harmony);
+  harmony.setProgressCallback([&harmony](int receiver,
+                                         Harmony::State state) {
+    if (state == Harmony::STATE_READY) {
+      printNames(&harmony, receiver);
+    } else if (state == Harmony::STATE_FAILED) {
+      std::cout << "Failed to initialize receiver #" << receiver
+                << std::endl;
     }
   });
-  harmony.setKeyCallback([&event, &harmony](int key) {
-    handleHarmonyKey(&event, &harmony, key);
+  OutputQueue outputs(&event, [&event, &harmony, &ir](
+                              const Keymap::Action &action,
+                              const Harmony::KeyEvent &ev, unsigned count) {
+    runAction(&event, &harmony, &ir, action, ev, count);
+  });
+  outputs.addTarget(irRules);
+  outputs.addTarget(execRules);
+  MacroEngine macros(&event, [&event, &harmony, &ir, &outputs](
+                              const Keymap::Action &action,
+                              const Harmony::KeyEvent &ev) {
+    dispatchAction(&event, &harmony, &ir, &outputs, action, ev);
+  });
+  harmony.setKeyCallback([&event, &harmony, &ir, &macros, &outputs,
+                          &keymap](const Harmony::KeyEvent &ev) {
+    handleHarmonyKey(&event, &harmony, &ir, &macros, &outputs, keymap.get(),
+                     ev);
   });
   event.loop();
+  Trace::stopServing();
+#if !defined(NDEBUG)
+  const auto &stats = harmony.getStats();
+  std::cout << "Reports received: " << stats.reports
+            << ", queue ran empty: " << stats.queueEmpty
+            << ", average resubmit: "
+            << (stats.resubmits ? stats.resubmitNanos / stats.resubmits : 0)
+            << "ns, slowest resubmit: " << stats.maxResubmitNanos << "ns"
+            << std::endl;
+  std::cout << "Longest event loop stall: " << event.getMaxStall() / 1000
+            << "us" << std::endl;
+  const IrOutput::Stats irStats = ir.getStats();
+  std::cout << "IR codes sent: " << irStats.sent
+            << ", dropped: " << irStats.dropped
+            << ", failed: " << irStats.errors
+            << ", average latency: "
+            << (irStats.sent ? irStats.latencyNanos / irStats.sent / 1000 : 0)
+            << "us, worst latency: " << irStats.maxLatencyNanos / 1000 << "us"
+            << std::endl;
+  const MacroEngine::Stats &macroStats = macros.getStats();
+  std::cout << "Macros started: " << macroStats.started
+            << ", cancelled: " << macroStats.cancelled
+            << ", steps: " << macroStats.steps
+            << ", average jitter: "
+            << (macroStats.steps ? macroStats.jitterNanos / macroStats.steps
+                                   / 1000 : 0)
+            << "us, worst jitter: " << macroStats.maxJitterNanos / 1000 << "us"
+            << std::endl;
+  for (int target : { TARGET_IR, TARGET_EXEC }) {
+    const OutputQueue::Stats s = outputs.getStats(target);
+    std::cout << (target == TARGET_IR ? "IR" : "Exec")
+              << " queue: sent " << s.sent << ", merged " << s.merged
+              << ", stale " << s.stale << ", dropped " << s.dropped
+              << ", deepest " << s.maxDepth << ", worst lag "
+              << s.maxLagNanos / NANOS_PER_MS << "ms" << std::endl;
+  }
+#endif
 #else
   Harmony harmony;
-  int key;
+  Harmony::KeyEvent ev;
+  configureHarmony(&harmony);
 
-  for (int i = 0; i < 6; i++) {
-    readName(&harmony, i);
+  harmony.waitForReceivers();
+  const auto receivers = harmony.getReceivers();
+  for (auto it = receivers.begin(); it != receivers.end(); it++) {
+    printNames(&harmony, *it);
   }
   do {
-    key = harmony.getKey();
-    handleHarmonyKey(NULL, &harmony, key);
-  } while (key != Harmony::KEY_LONG_OFF);
+    harmony.getKey(&ev);
+    printKey(&harmony, ev);
+  } while (ev.key != Harmony::KEY_LONG_OFF);
 #endif
 
   return 0;
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metacache.h"
+
+bool MetadataCache::load() {
+  receivers.clear();
+  FILE *fp = fopen(file.c_str(), "re");
+  if (!fp) {
+    return false;
+  }
+  Receiver *r = NULL;
+  char line[512];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\000';
+    char path[256];
+    unsigned firmware, feature, index;
+    int device, n = 0;
+    if (sscanf(line, "receiver %255s %x", path, &firmware) == 2) {
+      r = &receivers[path];
+      *r = Receiver();
+      r->firmware = firmware;
+    } else if (r && sscanf(line, "device %d %n", &device, &n) == 1 && n) {
+      r->devices[device].name = line + n;
+    } else if (r && sscanf(line, "feature %d %x %u", &device, &feature,
+                           &index) == 3) {
+      r->devices[device].features[feature] = index;
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+bool MetadataCache::save() const {
+  // Write a new file, and then move it into place. Readers never see a
+  // partial update, even if we crash.
+  const std::string tmp = file + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "we");
+  if (!fp) {
+    return false;
+  }
+  for (auto r = receivers.begin(); r != receivers.end(); r++) {
+    fprintf(fp, "receiver %s %x\n", r->first.c_str(), r->second.firmware);
+    for (auto d = r->second.devices.begin();
+         d != r->second.devices.end(); d++) {
+      fprintf(fp, "device %d %s\n", d->first, d->second.name.c_str());
+      for (auto f = d->second.features.begin();
+           f != d->second.features.end(); f++) {
+        fprintf(fp, "feature %d %04x %u\n", d->first, f->first, f->second);
+      }
+    }
+  }
+  if (fclose(fp) || rename(tmp.c_str(), file.c_str())) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+const MetadataCache::Receiver *MetadataCache::find(
+  const std::string &path) const {
+  auto it = receivers.find(path);
+  return it == receivers.end() ? NULL : &it->second;
+}
+
+bool MetadataCache::update(const std::string &path, const Receiver &info) {
+  auto it = receivers.find(path);
+  if (it != receivers.end() && it->second == info) {
+    return true;
+  }
+  receivers[path] = info;
+  return save();
+}
+
+bool MetadataCache::setFeature(const std::string &path, int device,
+                               uint16_t feature, uint8_t index) {
+  auto &features = receivers[path].devices[device].features;
+  auto it = features.find(feature);
+  if (it != features.end() && it->second == index) {
+    return true;
+  }
+  features[feature] = index;
+  return save();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+// What we learned about receivers and their paired devices, kept on disk
+// so that the next start doesn't have to ask again. Entries are keyed by
+// the receiver's path. A different receiver plugged into the same port
+// shows up as soon as the cached entry gets revalidated.
+// The file is plain text, one record per line:
+//   receiver <path> <firmware, hex>
+//   device <DJ index> <name>
+//   feature <DJ index> <feature id, hex> <feature index>
+// "device" and "feature" records belong to the preceding receiver. Updates
+// replace the file atomically.
+class MetadataCache {
+ public:
+  struct Device {
+    std::string name;
+    std::map<uint16_t, uint8_t> features;  // HID++ 2.0 feature indices
+    bool operator==(const Device &o) const {
+      return name == o.name && features == o.features; }
+  };
+
+  struct Receiver {
+    unsigned firmware = 0;
+    std::map<int, Device> devices;         // Paired, by DJ device index
+    bool operator==(const Receiver &o) const {
+      return firmware == o.firmware && devices == o.devices; }
+  };
+
+  MetadataCache(const std::string &file) : file(file) { }
+  // Missing or unreadable files leave the cache empty
+  bool load();
+  bool save() const;
+  const Receiver *find(const std::string &path) const;
+  // Writes the file, if anything changed
+  bool update(const std::string &path, const Receiver &info);
+  bool setFeature(const std::string &path, int device, uint16_t feature,
+                  uint8_t index);
+
+ private:
+  std::string file;
+  std::map<std::string, Receiver> receivers;
+};
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <utility>
+
+#include "outputqueue.h"
+
+OutputQueue::OutputQueue(Event *event, OutputCallback cb)
+  : event(event), cb(std::move(cb)) {
+}
+
+OutputQueue::~OutputQueue() {
+  for (auto &t : targets) {
+    if (t.timer) {
+      event->removeTimeout(t.timer);
+    }
+  }
+}
+
+int OutputQueue::addTarget(const Rules &rules) {
+  targets.emplace_back();
+  Target &t = targets.back();
+  t.rules = rules;
+  t.rules.burst = std::max(1u, rules.burst);
+  t.rules.capacity = std::max(1u, rules.capacity);
+  t.entries.resize(t.rules.capacity);
+  t.tokens = t.rules.burst;
+  t.refilled = Util::nanos();
+  return targets.size() - 1;
+}
+
+void OutputQueue::push(int target, const Keymap::Action &action,
+                       const Harmony::KeyEvent &ev) {
+  Target &t = targets[target];
+  const Nanos now = Util::nanos();
+  const size_t capacity = t.entries.size();
+  t.stats.queued++;
+  if (t.rules.merge && t.size) {
+    Entry &last = t.entries[(t.head + t.size - 1) % capacity];
+    if (last.action.type == action.type && last.action.arg == action.arg) {
+      last.ev = ev;
+      last.updated = now;
+      last.count++;
+      t.stats.merged++;
+      return;
+    }
+  }
+  if (t.size == capacity) {
+    t.head = (t.head + 1) % capacity;
+    t.size--;
+    t.stats.dropped++;
+  }
+  // Assigning reuses the slot's string buffer, once it is big enough
+  Entry &e = t.entries[(t.head + t.size++) % capacity];
+  e.action = action;
+  e.ev = ev;
+  e.queued = e.updated = now;
+  e.count = 1;
+  t.stats.maxDepth = std::max(t.stats.maxDepth, t.size);
+  if (!t.draining) {
+    drain(target);
+  }
+}
+
+OutputQueue::Stats OutputQueue::getStats(int target) const {
+  Stats stats = targets[target].stats;
+  stats.depth = targets[target].size;
+  return stats;
+}
+
+void OutputQueue::drain(int target) {
+  Target &t = targets[target];
+  const size_t capacity = t.entries.size();
+  const Nanos now = Util::nanos();
+  if (t.rules.rate > 0) {
+    t.tokens = std::min((double)t.rules.burst,
+                        t.tokens + (now - t.refilled)*t.rules.rate / 1e9);
+  }
+  t.refilled = now;
+  t.draining = true;
+  while (t.size) {
+    Entry &e = t.entries[t.head];
+    if (t.rules.maxAge && e.ev.repeat &&
+        now - e.updated > t.rules.maxAge*NANOS_PER_MS) {
+      t.stats.stale++;
+    } else if (t.rules.rate > 0 && t.tokens < 1) {
+      // Come back once there is a token
+      if (!t.timer) {
+        t.timer = event->addTimeoutAt(
+          now + (Nanos)((1 - t.tokens)*1e9 / t.rules.rate),
+          [this, target]() {
+            targets[target].timer = Event::Handle();
+            drain(target);
+          });
+      }
+      break;
+    } else {
+      // Take the entry off the queue before calling out. Swapping keeps
+      // both slots' buffers around.
+      t.tokens -= t.rules.rate > 0;
+      const uint64_t lag = now - e.queued;
+      t.stats.sent++;
+      t.stats.lagNanos += lag;
+      t.stats.maxLagNanos = std::max(t.stats.maxLagNanos, lag);
+      std::swap(t.sending, e);
+      t.head = (t.head + 1) % capacity;
+      t.size--;
+      cb(t.sending.action, t.sending.ev, t.sending.count);
+      continue;
+    }
+    t.head = (t.head + 1) % capacity;
+    t.size--;
+  }
+  t.draining = false;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "callback.h"
+#include "event.h"
+#include "harmony.h"
+#include "keymap.h"
+#include "util.h"
+
+// Sits between the key callback and the outputs, so that keys that come in
+// faster than a device accepts commands don't pile up. Every target (e.g.
+// the IR transmitter) has a token bucket that limits its rate, and a
+// bounded queue of pending actions. Coalescing keeps the queue short:
+//  - "merge" folds an action into the newest pending one, if they are the
+//    same. The output then gets to act on both at once, e.g. turn the
+//    volume up by two steps.
+//  - "maxAge" drops auto-repeats that have been waiting for too long. When
+//    the key gets released, the output stops soon after.
+//  - If the queue fills up anyway, the oldest action gets dropped.
+// Actions get copied into preallocated slots, so that they can outlive a
+// keymap reload without allocating.
+class OutputQueue {
+ public:
+  // "count" is the number of actions that were merged into this one
+  typedef InlineFunction<void (const Keymap::Action &action,
+                               const Harmony::KeyEvent &ev,
+                               unsigned count)> OutputCallback;
+
+  struct Rules {
+    double rate;       // Actions per second, or zero for no limit
+    unsigned burst;    // Actions that can go out back to back
+    unsigned capacity; // Pending actions
+    bool merge;
+    unsigned maxAge;   // Milliseconds, or zero to never drop repeats
+  };
+
+  struct Stats {
+    uint64_t queued;
+    uint64_t sent;
+    uint64_t merged;       // Folded into a pending action
+    uint64_t stale;        // Repeats dropped for waiting too long
+    uint64_t dropped;      // Pushed out of a full queue
+    size_t depth;          // Pending actions right now
+    size_t maxDepth;
+    uint64_t lagNanos;     // Total time from queuing to sending
+    uint64_t maxLagNanos;
+  };
+
+  OutputQueue(Event *event, OutputCallback cb);
+  ~OutputQueue();
+  // Returns the new target's number
+  int addTarget(const Rules &rules);
+  // Runs the action right away, if the target has tokens to spare and
+  // nothing else is pending
+  void push(int target, const Keymap::Action &action,
+            const Harmony::KeyEvent &ev);
+  size_t getDepth(int target) const { return targets[target].size; }
+  Stats getStats(int target) const;
+
+ private:
+  struct Entry {
+    Keymap::Action action;
+    Harmony::KeyEvent ev;   // The latest one that got merged
+    Nanos queued;
+    Nanos updated;          // When "ev" was merged
+    unsigned count;
+  };
+
+  struct Target {
+    Rules rules;
+    std::vector<Entry> entries; // Ring buffer of "capacity" slots
+    size_t head = 0, size = 0;
+    double tokens;
+    Nanos refilled = 0;
+    Event::Handle timer;
+    Stats stats = { };
+    // While "cb" runs, the entry is taken off the queue, and pushes to the
+    // same target get picked up by the loop in drain(). Callbacks can push
+    // to other targets, which then drain right away.
+    Entry sending;
+    bool draining = false;
+  };
+
+  void drain(int target);
+
+  Event *event;
+  OutputCallback cb;
+  std::vector<Target> targets;
+};
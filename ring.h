@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. The capacity has to be a power of two. Neither push() nor pop()
+// ever blocks or allocates memory; push() fails if the queue is full.
+template<typename T, size_t N>
+class Ring {
+  static_assert(N && !(N & (N - 1)), "Ring size must be a power of two");
+
+ public:
+  bool push(const T &item) {
+    const size_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[tail & (N - 1)] = item;
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &item) {
+    const size_t head = this->head.load(std::memory_order_relaxed);
+    if (head == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items[head & (N - 1)];
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+
+ private:
+  // Keep the producer's and the consumer's index on separate cache lines
+  alignas(64) std::atomic<size_t> head = { 0 };
+  alignas(64) std::atomic<size_t> tail = { 0 };
+  alignas(64) T items[N];
+};
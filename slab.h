@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+// Pool of fixed-size records that are addressed by index. Memory is grabbed
+// in chunks and never moves, so references to a record stay valid while
+// other records get allocated. Released slots are reused before the pool
+// grows; once it has reached its high-water mark, neither alloc() nor
+// release() touches the heap.
+template<typename T, size_t ChunkSize = 64>
+class Slab {
+ public:
+  uint32_t alloc() {
+    if (!freeSlots.empty()) {
+      const uint32_t slot = freeSlots.back();
+      freeSlots.pop_back();
+      return slot;
+    }
+    if (used == chunks.size()*ChunkSize) {
+      chunks.emplace_back(new T[ChunkSize]);
+      freeSlots.reserve(chunks.size()*ChunkSize);
+    }
+    return used++;
+  }
+
+  void release(uint32_t slot) { freeSlots.push_back(slot); }
+  bool contains(uint32_t slot) const { return slot < used; }
+  T &operator[](uint32_t slot) {
+    return chunks[slot / ChunkSize][slot % ChunkSize];
+  }
+  const T &operator[](uint32_t slot) const {
+    return chunks[slot / ChunkSize][slot % ChunkSize];
+  }
+
+ private:
+  std::vector<std::unique_ptr<T[]> > chunks;
+  std::vector<uint32_t> freeSlots;
+  uint32_t used = 0;
+};
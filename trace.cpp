@@ -0,0 +1,287 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "event.h"
+#include "keys.h"
+#include "trace.h"
+
+static const unsigned char magic[8] = { 'H', 'R', 'M', 'T', 'R', 'C', 0, 1 };
+enum { HEADER_LEN = 16 };
+
+std::atomic<uint64_t> Trace::next = { 0 };
+Trace::Slot Trace::ring[Trace::SIZE];
+
+static char dumpPath[PATH_MAX], dumpTmpPath[PATH_MAX];
+
+// The socket that serve() listens on, if any
+static Event *serveEvent;
+static Event::Handle serveHandle;
+static int serveFd = -1;
+static std::string servePath;
+
+int Trace::snapshot(uint64_t *pos, uint64_t end, unsigned char *buf,
+                    int size) {
+  // Serializes records, starting at "pos", for as long as they fit. Slots
+  // that have been overwritten, or that are being written right now, get
+  // skipped.
+  int n = 0;
+  for (; *pos < end && size - n >= (int)HEADER_LEN + MAX_DATA; ++*pos) {
+    const Slot &slot = ring[*pos & (SIZE - 1)];
+    const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != *pos + 1) {
+      continue;
+    }
+    const Nanos tm = slot.tm;
+    const uint32_t arg = slot.arg;
+    const int len = std::min((int)slot.len, (int)MAX_DATA);
+    unsigned char *rec = buf + n;
+    rec[8] = slot.type;
+    rec[9] = slot.receiver;
+    rec[10] = slot.thread;
+    rec[15] = len;
+    memcpy(rec + HEADER_LEN, slot.data, len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    for (int i = 0; i < 8; i++) {
+      rec[i] = tm >> (8*i);
+    }
+    for (int i = 0; i < 4; i++) {
+      rec[11 + i] = arg >> (8*i);
+    }
+    n += HEADER_LEN + len;
+  }
+  return n;
+}
+
+static bool writeAll(int fd, const unsigned char *buf, int len) {
+  while (len > 0) {
+    const ssize_t rc = write(fd, buf, len);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    } else if (rc <= 0) {
+      return false;
+    }
+    buf += rc;
+    len -= rc;
+  }
+  return true;
+}
+
+bool Trace::dump(int fd) {
+  // Runs from signal handlers. Stay away from stdio and the heap.
+  const uint64_t end = next.load(std::memory_order_acquire);
+  uint64_t pos = end > SIZE ? end - SIZE : 0;
+  if (!writeAll(fd, magic, sizeof(magic))) {
+    return false;
+  }
+  unsigned char buf[4096];
+  while (pos < end) {
+    const int n = snapshot(&pos, end, buf, sizeof(buf));
+    if (!writeAll(fd, buf, n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void dumpSignalHandler(int) {
+  // Write a new file, and then move it into place. Readers never see a
+  // partial dump.
+  const int err = errno;
+  const int fd = open(dumpTmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd >= 0) {
+    const bool ok = Trace::dump(fd);
+    if (close(fd) || !ok || rename(dumpTmpPath, dumpPath)) {
+      unlink(dumpTmpPath);
+    }
+  }
+  errno = err;
+}
+
+bool Trace::dumpOnSignal(int sig, const char *path) {
+  if (snprintf(dumpPath, sizeof(dumpPath), "%s", path) >=
+        (int)sizeof(dumpPath) ||
+      snprintf(dumpTmpPath, sizeof(dumpTmpPath), "%s.tmp", path) >=
+        (int)sizeof(dumpTmpPath)) {
+    return false;
+  }
+  struct sigaction sa = { };
+  sa.sa_handler = dumpSignalHandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return !sigaction(sig, &sa, NULL);
+}
+
+bool Trace::serve(Event *event, const char *path) {
+  stopServing();
+  struct sockaddr_un addr = { };
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+  if (fd < 0) {
+    return false;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+    ::close(fd);
+    return false;
+  }
+  serveEvent = event;
+  serveFd = fd;
+  servePath = path;
+  serveHandle = event->addPollFd(fd, POLLIN, [event, fd]() {
+    // Take the snapshot right away, and then send it whenever the client
+    // is ready for more. A slow client never stalls the event loop.
+    struct Client {
+      int fd;
+      std::string data;
+      size_t sent;
+      Event::Handle handle;
+    };
+    const int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) {
+      return;
+    }
+    Client *c = new Client();
+    c->fd = cfd;
+    c->sent = 0;
+    c->data.assign((const char *)magic, sizeof(magic));
+    const uint64_t end = next.load(std::memory_order_acquire);
+    uint64_t pos = end > SIZE ? end - SIZE : 0;
+    unsigned char buf[4096];
+    while (pos < end) {
+      const int n = snapshot(&pos, end, buf, sizeof(buf));
+      c->data.append((const char *)buf, n);
+    }
+    c->handle = event->addPollFd(cfd, POLLOUT, [event, c]() {
+      const ssize_t rc = write(c->fd, c->data.data() + c->sent,
+                               c->data.size() - c->sent);
+      if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+      } else if (rc > 0 && (c->sent += rc) < c->data.size()) {
+        return;
+      }
+      event->removePollFd(c->handle);
+      ::close(c->fd);
+      delete c;
+    });
+  });
+  return true;
+}
+
+void Trace::stopServing() {
+  if (serveFd < 0) {
+    return;
+  }
+  serveEvent->removePollFd(serveHandle);
+  ::close(serveFd);
+  unlink(servePath.c_str());
+  serveEvent = NULL;
+  serveHandle = Event::Handle();
+  serveFd = -1;
+  servePath.clear();
+}
+
+const char *Trace::toString(Type type) {
+  static const char *names[] = { "report in", "report out", "submit",
+                                 "complete", "timeout", "key",
+                                 "callback start", "callback end" };
+  return type >= 0 && type < NUM_TYPES ? names[type] : "unknown";
+}
+
+static const char *callbackName(uint32_t cb) {
+  return cb == Trace::CB_KEY ? "key callback" :
+         cb == Trace::CB_HIDPP_RESPONSE ? "HID++ response" : "callback";
+}
+
+bool Trace::decode(FILE *in, FILE *out, bool json) {
+  unsigned char hdr[HEADER_LEN], data[256];
+  if (fread(hdr, sizeof(magic), 1, in) != 1 ||
+      memcmp(hdr, magic, sizeof(magic))) {
+    return false;
+  }
+  if (json) {
+    fprintf(out, "{\"traceEvents\":[");
+  }
+  Nanos start = 0;
+  bool first = true;
+  while (fread(hdr, sizeof(hdr), 1, in) == 1) {
+    Nanos tm = 0;
+    uint32_t arg = 0;
+    for (int i = 0; i < 8; i++) {
+      tm |= (Nanos)hdr[i] << (8*i);
+    }
+    for (int i = 0; i < 4; i++) {
+      arg |= (uint32_t)hdr[11 + i] << (8*i);
+    }
+    const Type type = (Type)hdr[8];
+    const int receiver = hdr[9], thread = hdr[10], len = hdr[15];
+    if (len && fread(data, len, 1, in) != 1) {
+      return false;
+    }
+    if (first) {
+      start = tm;
+    }
+    const double us = (double)(int64_t)(tm - start) / 1000.0;
+    std::string bytes;
+    for (int i = 0; i < len; i++) {
+      char hex[4];
+      snprintf(hex, sizeof(hex), i ? " %02x" : "%02x", data[i]);
+      bytes += hex;
+    }
+    if (!json) {
+      fprintf(out, "%14.3fus  thread %d  receiver %d  %-14s", us, thread,
+              receiver, toString(type));
+      if (type == KEY) {
+        fprintf(out, "  %s (0x%x) device %d%s", Keys::toString(arg), arg,
+                len > 0 ? data[0] : 0, len > 1 && data[1] ? " repeat" : "");
+      } else if (type == CALLBACK_START || type == CALLBACK_END) {
+        fprintf(out, "  %s", callbackName(arg));
+      } else if (type != REPORT_IN && type != REPORT_OUT) {
+        fprintf(out, "  %u", arg);
+      }
+      fprintf(out, "%s%s\n", len && type != KEY ? "  " : "",
+              type != KEY ? bytes.c_str() : "");
+      first = false;
+      continue;
+    }
+    // Callbacks become slices, everything else is an instant event
+    const char *ph = type == CALLBACK_START ? "B" :
+                     type == CALLBACK_END ? "E" : "i";
+    const char *name = type == CALLBACK_START || type == CALLBACK_END
+                       ? callbackName(arg) : toString(type);
+    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+            "\"pid\":1,\"tid\":%d%s,\"args\":{\"receiver\":%d",
+            first ? "" : ",", name, ph, us, thread,
+            *ph == 'i' ? ",\"s\":\"t\"" : "", receiver);
+    if (type == KEY) {
+      fprintf(out, ",\"key\":\"%s\",\"code\":%u,\"device\":%d,"
+              "\"repeat\":%d", Keys::toString(arg), arg,
+              len > 0 ? data[0] : 0, len > 1 ? data[1] : 0);
+    } else if (type != CALLBACK_START && type != CALLBACK_END) {
+      fprintf(out, ",\"arg\":%u,\"data\":\"%s\"", arg, bytes.c_str());
+    }
+    fprintf(out, "}}");
+    first = false;
+  }
+  if (json) {
+    fprintf(out, "\n]}\n");
+  }
+  return true;
+}
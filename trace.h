@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "util.h"
+
+class Event;
+
+// Always-on flight recorder. Harmony and the transports log reports, USB
+// transfers, HID++ timeouts, decoded keys and callbacks into a fixed-size
+// ring in memory. Recording is a relaxed atomic increment, and a copy into
+// a slot of its own cache line; it never blocks, allocates or formats
+// anything. Any thread can record. Once the ring is full, the oldest
+// records get overwritten.
+// A dump writes the most recent records as a binary file that starts with
+// 8 bytes: the magic "HRMTRC\0", and a version byte. Then, it holds:
+//   8 bytes  Util::nanos() timestamp, little-endian
+//   1 byte   type (Trace::Type)
+//   1 byte   receiver id, or zero
+//   1 byte   thread, numbered from 1 in the order they first recorded
+//            something. Numbers wrap around after 255 threads.
+//   4 bytes  type specific argument, little-endian
+//   1 byte   length
+//   n bytes  data, e.g. the raw report
+// "harmonizerc --decode-trace" turns dumps into text or Chrome trace JSON.
+class Trace {
+ public:
+  enum Type {
+    REPORT_IN,       // data: report
+    REPORT_OUT,      // data: report
+    SUBMIT,          // USB transfer submitted. arg: transfers in flight
+    COMPLETE,        // USB transfer completed. arg: libusb status
+    TIMEOUT,         // HID++ request timed out. arg: attempts, data: request
+    KEY,             // arg: key code, data: device, repeat
+    CALLBACK_START,  // arg: Trace::Callback
+    CALLBACK_END,    // arg: Trace::Callback
+    NUM_TYPES
+  };
+  enum Callback { CB_KEY, CB_HIDPP_RESPONSE };
+  enum { SIZE = 4096, MAX_DATA = 40 };
+
+  static void record(Type type, int receiver, uint32_t arg = 0,
+                     const void *data = NULL, int len = 0) {
+    record(Util::nanos(), type, receiver, arg, data, len);
+  }
+
+  static void record(Nanos tm, Type type, int receiver, uint32_t arg = 0,
+                     const void *data = NULL, int len = 0) {
+    // Slots are guarded by their sequence number. Zero marks a slot that is
+    // being written, and readers skip it.
+    const uint64_t idx = next.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = ring[idx & (SIZE - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.tm = tm;
+    slot.type = type;
+    slot.receiver = receiver;
+    slot.thread = threadId();
+    slot.arg = arg;
+    slot.len = len < 0 ? 0 : len > MAX_DATA ? MAX_DATA : len;
+    if (slot.len) {
+      memcpy(slot.data, data, slot.len);
+    }
+    slot.seq.store(idx + 1, std::memory_order_release);
+  }
+
+  // Writes the ring to "fd". This only uses async-signal-safe calls, and
+  // can run while other threads keep recording.
+  static bool dump(int fd);
+  // Dumps to "path" whenever the process receives "sig", e.g. SIGUSR1
+  static bool dumpOnSignal(int sig, const char *path);
+  // Listens on a Unix domain socket, and sends a dump to every client that
+  // connects. Clients get served by the event loop without blocking it.
+  // There is only one socket; serving again replaces it.
+  static bool serve(Event *event, const char *path);
+  // Closes and removes the socket. Clients that already connected still get
+  // their dump.
+  static void stopServing();
+  // Converts a dump to text, or to JSON for chrome://tracing
+  static bool decode(FILE *in, FILE *out, bool json);
+  static const char *toString(Type type);
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq;
+    Nanos tm;
+    uint32_t arg;
+    uint8_t type;
+    uint8_t receiver;
+    uint8_t thread;
+    uint8_t len;
+    unsigned char data[MAX_DATA];
+  };
+
+  static uint8_t threadId() {
+    // Zero means that the thread hasn't got a number yet
+    static std::atomic<unsigned> threads = { 0 };
+    static thread_local uint8_t id = 0;
+    if (!id) {
+      id = threads++ % 255 + 1;
+    }
+    return id;
+  }
+
+  static int snapshot(uint64_t *pos, uint64_t end, unsigned char *buf,
+                      int size);
+
+  static std::atomic<uint64_t> next;
+  static Slot ring[SIZE];
+};
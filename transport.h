@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "callback.h"
+#include "util.h"
+
+class Event;
+
+// Something that happened on a receiver. Transports deliver these on the
+// event loop's thread, no matter which thread they originated on.
+// Receivers are referenced by the id that Harmony assigned when opening
+// them, as they could be gone by the time that the event gets dispatched.
+struct TransportEvent {
+  enum Type { REPORT, WRITTEN, ATTACH, DETACH };
+  enum Status { OK, CANCELLED, ERROR };
+  enum { MAX_LEN = 32 };
+
+  Type type;
+  int receiver;
+  Status status;
+  int len;
+  Nanos tm;                    // Util::nanos() when the report arrived
+  bool queueEmpty;             // No other read was queued at that time
+  bool resubmitted;            // The read was queued again right away
+  uint64_t resubmitNanos;      // Time it took to queue the read again
+  unsigned char buf[MAX_LEN];  // Report, or path of a detached receiver
+};
+
+// How Harmony talks to Unifying receivers: finding them, reading reports
+// from them, and sending reports to them. Reads are continuous; once
+// started, every report that the receiver sends turns into a REPORT event,
+// until reading gets stopped. Writes either block, or complete
+// asynchronously with a WRITTEN event. Hotplugging shows up as ATTACH and
+// DETACH events.
+class Transport {
+ public:
+  typedef InlineFunction<void (const TransportEvent &ev)> Listener;
+
+  virtual ~Transport() { }
+  // Hooks the transport up to the event loop. Called once, before anything
+  // else.
+  virtual void start(Event *event, Listener listener) = 0;
+  // Stops delivering events. Called once, before the transport goes away.
+  virtual void stop() = 0;
+  // Paths of all receivers that are currently present. A path stays the
+  // same, if a receiver gets unplugged and plugged back in.
+  virtual std::vector<std::string> scan() = 0;
+  virtual bool open(const std::string &path, int id) = 0;
+  // Cancels everything that is still in flight, and waits for it
+  virtual void close(int id) = 0;
+  virtual void startReading(int id) = 0;
+  virtual void stopReading(int id) = 0;
+  // With "wait", this returns once the report has been sent, and there is
+  // no WRITTEN event. Otherwise, a successful return means that there will
+  // be a WRITTEN event later.
+  virtual bool write(int id, const unsigned char *buf, int len,
+                     bool wait) = 0;
+  // Reports that the transport had to throw away, because the event loop
+  // fell too far behind
+  virtual uint64_t getDropped() const { return 0; }
+};
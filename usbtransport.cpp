@@ -0,0 +1,583 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "trace.h"
+#include "usbtransport.h"
+#include "util.h"
+
+UsbTransport::UsbTransport(int numTransfers, bool usbThread)
+  : numTransfers(std::max(1, numTransfers)), threaded(usbThread) {
+  libusb_init(&ctx);
+#ifdef NDEBUG
+# if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000106)
+    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
+# else
+    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_NONE);
+# endif
+#else
+# if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000106)
+    libusb_set_option(ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_WARNING);
+# else
+    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_WARNING);
+# endif
+#endif
+}
+
+UsbTransport::~UsbTransport() {
+  stop();
+  while (!devices.empty()) {
+    close(devices.begin()->first);
+  }
+  libusb_exit(ctx);
+}
+
+void UsbTransport::start(Event *event, Listener listener) {
+  this->event = event;
+  this->listener = std::move(listener);
+  if (threaded &&
+      (eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    threaded = false;
+  }
+  if (threaded) {
+    // libusb gets serviced by its own thread. It wakes up the event loop,
+    // whenever there is something to dispatch.
+    ring.reset(new Ring<UsbEvent, USB_RING_SIZE>());
+    eventFdHandler = event->addPollFd(eventFd, POLLIN, [this]() {
+                                        drainUsbEvents(); });
+    this->usbThread = std::thread([this]() { runUsbThread(); });
+  } else {
+    auto pollFds = libusb_get_pollfds(ctx);
+    for (auto it = pollFds; *it; it++) {
+      pollHandlers[(*it)->fd] =
+        event->addPollFd((*it)->fd, (*it)->events, [this]() {
+            handleUsbPollFdEvent(); });
+    }
+    free(pollFds);
+  }
+  libusb_set_pollfd_notifiers(ctx,
+    [](int fd, short events, void *data) {
+      UsbTransport *that = (UsbTransport *)data;
+      if (!that->threaded) {
+        that->pollHandlers[fd] = that->event->addPollFd(fd, events, [that]() {
+                                            that->handleUsbPollFdEvent(); });
+      } },
+    [](int fd, void *data) {
+      UsbTransport *that = (UsbTransport *)data;
+      if (!that->threaded) {
+        that->event->removePollFd(that->pollHandlers[fd]);
+      } },
+    this);
+  libusb_hotplug_register_callback(
+    ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+    USB_VENDOR_ID, USB_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+    hotplugAttach, (void *)this, &hotplugHandleAttach);
+  libusb_hotplug_register_callback (
+    ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+    USB_VENDOR_ID, USB_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+    hotplugDetach, (void *)this, &hotplugHandleDetach);
+}
+
+void UsbTransport::stop() {
+  if (!event) {
+    return;
+  }
+  libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+  if (!threaded) {
+    auto pollFds = libusb_get_pollfds(ctx);
+    for (auto it = pollFds; *it; it++) {
+      event->removePollFd(pollHandlers[(*it)->fd]);
+    }
+    free(pollFds);
+  }
+  if (hotplugHandleAttach) {
+    libusb_hotplug_deregister_callback(ctx, hotplugHandleAttach);
+    hotplugHandleAttach = 0;
+  }
+  if (hotplugHandleDetach) {
+    libusb_hotplug_deregister_callback(ctx, hotplugHandleDetach);
+    hotplugHandleDetach = 0;
+  }
+  if (threaded) {
+    stopping = true;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    libusb_interrupt_event_handler(ctx);
+#endif
+    usbThread.join();
+    // Nothing is going to get dispatched anymore. Only release resources.
+    UsbEvent ev;
+    while (ring->pop(ev)) {
+      if (ev.transfer) {
+        libusb_free_transfer(ev.transfer);
+      }
+    }
+    event->removePollFd(eventFdHandler);
+    ::close(eventFd);
+    eventFd = -1;
+    threaded = false;
+  }
+  listener = nullptr;
+  event = NULL;
+}
+
+std::string UsbTransport::getDevicePath(libusb_device *dev) {
+  // Receivers are told apart by where they are plugged in. Unlike the
+  // device address, this stays the same when the receiver gets replugged.
+  uint8_t ports[8];
+  int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  std::string path = std::to_string(libusb_get_bus_number(dev));
+  for (int i = 0; i < n; i++) {
+    path += (i ? "." : "-") + std::to_string(ports[i]);
+  }
+  return path;
+}
+
+int UsbTransport::hotplugAttach(libusb_context *ctx,
+                                libusb_device *dev,
+                                libusb_hotplug_event event,
+                                void *data) {
+  // Attach event received
+  UsbTransport *that = (UsbTransport *)data;
+  UsbEvent ev = { };
+  ev.ev.type = TransportEvent::ATTACH;
+  that->postUsbEvent(ev);
+  return 0;
+}
+
+int UsbTransport::hotplugDetach(libusb_context *ctx,
+                                libusb_device *dev,
+                                libusb_hotplug_event event,
+                                void *data) {
+  // Detach event received. This can be called on the USB thread, so only
+  // the path of the device gets passed on.
+  UsbTransport *that = (UsbTransport *)data;
+  UsbEvent ev = { };
+  ev.ev.type = TransportEvent::DETACH;
+  snprintf((char *)ev.ev.buf, sizeof(ev.ev.buf), "%s",
+           getDevicePath(dev).c_str());
+  that->postUsbEvent(ev);
+  return 0;
+}
+
+std::vector<std::string> UsbTransport::scan() {
+  // Look for Logitech Unifying receivers
+  std::vector<std::string> paths;
+  libusb_device **list;
+  ssize_t n = libusb_get_device_list(ctx, &list);
+  for (ssize_t i = 0; i < n; i++) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS &&
+        desc.idVendor == USB_VENDOR_ID &&
+        desc.idProduct == USB_PRODUCT_ID) {
+      paths.push_back(getDevicePath(list[i]));
+    }
+  }
+  if (n >= 0) {
+    libusb_free_device_list(list, 1);
+  }
+  return paths;
+}
+
+bool UsbTransport::open(const std::string &path, int id) {
+  if (devices.count(id)) {
+    return false;
+  }
+  libusb_device **list;
+  libusb_device *dev = NULL;
+  ssize_t n = libusb_get_device_list(ctx, &list);
+  for (ssize_t i = 0; i < n && !dev; i++) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS &&
+        desc.idVendor == USB_VENDOR_ID &&
+        desc.idProduct == USB_PRODUCT_ID &&
+        getDevicePath(list[i]) == path) {
+      dev = list[i];
+    }
+  }
+  libusb_device_handle *handle = NULL;
+  libusb_config_descriptor *config = NULL;
+  if (dev && libusb_open(dev, &handle) == LIBUSB_SUCCESS &&
+      libusb_get_config_descriptor(dev, USB_CONFIG_INDEX, &config) !=
+      LIBUSB_SUCCESS) {
+    libusb_close(handle);
+    handle = NULL;
+  }
+  if (n >= 0) {
+    libusb_free_device_list(list, 1);
+  }
+  if (!handle) {
+    return false;
+  }
+  libusb_detach_kernel_driver(handle, USB_DJ_INDEX);
+  libusb_claim_interface(handle, USB_DJ_INDEX);
+
+  Device *d = new Device();
+  d->transport = this;
+  d->id = id;
+  d->path = path;
+  d->handle = handle;
+  d->config = config;
+  d->ifaceDJDesc = &config->interface[USB_DJ_INDEX].
+                   altsetting[USB_ALT_SETTING_INDEX];
+  d->transfers = std::vector<Transfer>(numTransfers);
+  for (auto it = d->transfers.begin(); it != d->transfers.end(); it++) {
+    it->device = d;
+    it->transfer = libusb_alloc_transfer(0);
+    it->pending = false;
+  }
+  devices[id] = d;
+  return true;
+}
+
+void UsbTransport::close(int id) {
+  Device *d = findDevice(id);
+  if (!d) {
+    return;
+  }
+  devices.erase(id);
+  d->reading = false;
+  cancelTransfers(d);
+  for (auto it = d->controls.begin(); it != d->controls.end(); it++) {
+    libusb_cancel_transfer(*it);
+  }
+  waitForUsb(d->pendingControls);
+  libusb_release_interface(d->handle, USB_DJ_INDEX);
+  libusb_attach_kernel_driver(d->handle, USB_DJ_INDEX);
+  libusb_close(d->handle);
+  for (auto it = d->transfers.begin(); it != d->transfers.end(); it++) {
+    if (it->transfer) {
+      libusb_free_transfer(it->transfer);
+    }
+  }
+  // With a USB thread, completed control transfers could still be queued.
+  // They get freed when dispatched.
+  libusb_free_config_descriptor(d->config);
+  delete d;
+}
+
+UsbTransport::Device *UsbTransport::findDevice(int id) const {
+  auto it = devices.find(id);
+  return it == devices.end() ? NULL : it->second;
+}
+
+void UsbTransport::startReading(int id) {
+  Device *d = findDevice(id);
+  if (d) {
+    d->reading = true;
+    submitTransfers(d);
+  }
+}
+
+void UsbTransport::stopReading(int id) {
+  Device *d = findDevice(id);
+  if (d) {
+    d->reading = false;
+    cancelTransfers(d);
+  }
+}
+
+void UsbTransport::submitTransfers(Device *d) {
+  // Interrupt transfers never time out. Long key presses are detected by
+  // a timer, instead.
+  for (auto it = d->transfers.begin(); it != d->transfers.end(); it++) {
+    if (it->pending || !it->transfer) {
+      continue;
+    }
+    libusb_fill_interrupt_transfer(it->transfer, d->handle,
+      d->ifaceDJDesc->endpoint[USB_ENDPOINT_INDEX].bEndpointAddress,
+      it->buffer, sizeof(it->buffer), transferCompleted, &*it, 0);
+    // With a USB thread, the transfer could complete before
+    // libusb_submit_transfer() even returns. Count it as pending first.
+    it->pending = true;
+    d->pendingTransfers++;
+    if (libusb_submit_transfer(it->transfer) != LIBUSB_SUCCESS) {
+      // Maybe the device doesn't currently exist. Let's hope that a hotplug
+      // event is going to fix things for us. There really isn't any other
+      // error recovery that we could do here.
+      it->pending = false;
+      d->pendingTransfers--;
+      break;
+    }
+    Trace::record(Trace::SUBMIT, d->id, d->pendingTransfers);
+  }
+}
+
+void UsbTransport::cancelTransfers(Device *d) {
+  if (d->pendingTransfers) {
+    d->cancelling = true;
+    for (auto it = d->transfers.begin(); it != d->transfers.end(); it++) {
+      if (it->pending) {
+        libusb_cancel_transfer(it->transfer);
+      }
+    }
+    waitForUsb(d->pendingTransfers);
+    d->cancelling = false;
+  }
+}
+
+libusb_transfer *UsbTransport::allocControl(Device *d,
+                                            const unsigned char *buf,
+                                            int len,
+                                            libusb_transfer_cb_fn cb,
+                                            void *data) {
+  // HID Set_Report on the DJ interface. The buffer gets released together
+  // with the transfer.
+  libusb_transfer *transfer = libusb_alloc_transfer(0);
+  unsigned char *setup =
+    (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+  if (!transfer || !setup) {
+    libusb_free_transfer(transfer);
+    free(setup);
+    return NULL;
+  }
+  libusb_fill_control_setup(setup,
+    (int)LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|
+    LIBUSB_ENDPOINT_OUT,
+    0x09 /* HID Set_Report */, (2 /* HID output */ << 8) | buf[0],
+    USB_DJ_INDEX, len);
+  memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, buf, len);
+  libusb_fill_control_transfer(transfer, d->handle, setup, cb, data,
+                               USB_TIMEOUT);
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  return transfer;
+}
+
+bool UsbTransport::write(int id, const unsigned char *buf, int len,
+                         bool wait) {
+  Device *d = findDevice(id);
+  if (!d) {
+    return false;
+  }
+  if (!wait) {
+    // Submit the control transfer and return right away. Any failure is
+    // reported from controlCompleted(). The transfer gets released, once
+    // the completion has been dispatched.
+    libusb_transfer *transfer = allocControl(d, buf, len, controlCompleted,
+                                             d);
+    if (!transfer) {
+      return false;
+    }
+    d->pendingControls++;
+    if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+      d->controls.push_back(transfer);
+      return true;
+    }
+    d->pendingControls--;
+    libusb_free_transfer(transfer);
+    return false;
+  }
+  if (threaded) {
+    // libusb_control_transfer() would handle events on this thread, and
+    // completions would then get queued from two threads at once. Submit
+    // the transfer instead, and wait for the USB thread to complete it.
+    std::atomic<int> pending = { 1 };
+    libusb_transfer *transfer = allocControl(d, buf, len,
+      [](libusb_transfer *transfer) {
+        ((std::atomic<int> *)transfer->user_data)->store(0); },
+      &pending);
+    if (!transfer) {
+      return false;
+    }
+    bool ok = libusb_submit_transfer(transfer) == LIBUSB_SUCCESS;
+    if (ok) {
+      waitForUsb(pending);
+      ok = transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+           transfer->actual_length == len;
+    }
+    libusb_free_transfer(transfer);
+    return ok;
+  }
+  // The synchronous API can afford to block
+  return libusb_control_transfer(d->handle,
+      (int)LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|
+      LIBUSB_ENDPOINT_OUT,
+      0x09 /* HID Set_Report */, (2 /* HID output */ << 8) | buf[0],
+      USB_DJ_INDEX, (unsigned char *)buf, len, USB_TIMEOUT) == len;
+}
+
+TransportEvent::Status UsbTransport::getStatus(int status) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return TransportEvent::OK;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return TransportEvent::CANCELLED;
+  default:
+    return TransportEvent::ERROR;
+  }
+}
+
+void UsbTransport::transferCompleted(libusb_transfer *transfer) {
+  // This can be called on the USB thread. Don't touch anything that the
+  // event loop owns; just resubmit the transfer and pass on the report.
+  Transfer *t = (Transfer *)transfer->user_data;
+  Device *d = t->device;
+  UsbTransport *that = d->transport;
+  const uint64_t start = Util::nanos();
+  UsbEvent ev;
+  ev.ev.type = TransportEvent::REPORT;
+  ev.ev.receiver = d->id;
+  ev.ev.status = getStatus(transfer->status);
+  ev.ev.len = std::min(transfer->actual_length,
+                       (int)TransportEvent::MAX_LEN);
+  ev.ev.tm = Util::nanos();
+  ev.ev.queueEmpty = d->pendingTransfers == 1;
+  ev.ev.resubmitted = false;
+  ev.ev.resubmitNanos = 0;
+  ev.transfer = NULL;
+  ev.retry = false;
+
+  // Copy the report, so that the transfer can be resubmitted right away.
+  // libusb completes transfers for the same endpoint in the order that they
+  // were submitted in. So, reports are still processed in order.
+  Trace::record(ev.ev.tm, Trace::COMPLETE, d->id, transfer->status);
+  if (ev.ev.status == TransportEvent::OK) {
+    memcpy(ev.ev.buf, t->buffer, ev.ev.len);
+  }
+  if (!d->cancelling && d->reading &&
+      (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+       transfer->status == LIBUSB_TRANSFER_TIMED_OUT ||
+       transfer->status == LIBUSB_TRANSFER_OVERFLOW) &&
+      libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
+    ev.ev.resubmitted = true;
+    ev.ev.resubmitNanos = Util::nanos() - start;
+    Trace::record(start + ev.ev.resubmitNanos, Trace::SUBMIT, d->id,
+                  d->pendingTransfers);
+  } else if (!d->cancelling &&
+             transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+             transfer->status != LIBUSB_TRANSFER_TIMED_OUT &&
+             transfer->status != LIBUSB_TRANSFER_OVERFLOW &&
+             transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+             transfer->status != LIBUSB_TRANSFER_NO_DEVICE) {
+    // Retrying immediately would likely just fail again
+    ev.retry = true;
+  }
+
+  // Once the transfer is no longer counted as pending, the device could
+  // be released at any time.
+  if (that->threaded) {
+    that->postUsbEvent(ev);
+    if (!ev.ev.resubmitted) {
+      t->pending = false;
+      d->pendingTransfers--;
+    }
+  } else {
+    if (!ev.ev.resubmitted) {
+      t->pending = false;
+      d->pendingTransfers--;
+    }
+    that->postUsbEvent(ev);
+  }
+}
+
+void UsbTransport::controlCompleted(libusb_transfer *transfer) {
+  // An asynchronous report has been sent to the receiver. This can be
+  // called on the USB thread. Only look at the device's atomic state.
+  Device *d = (Device *)transfer->user_data;
+  UsbTransport *that = d->transport;
+  UsbEvent ev;
+  ev.ev.type = TransportEvent::WRITTEN;
+  ev.ev.receiver = d->id;
+  ev.ev.status = getStatus(transfer->status);
+  ev.ev.len = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+  if (ev.ev.status == TransportEvent::OK &&
+      transfer->actual_length != ev.ev.len) {
+    ev.ev.status = TransportEvent::ERROR;
+  }
+  ev.ev.tm = Util::nanos();
+  ev.transfer = transfer;
+  ev.retry = false;
+  memcpy(ev.ev.buf, libusb_control_transfer_get_data(transfer),
+         std::min(ev.ev.len, (int)sizeof(ev.ev.buf)));
+  if (that->threaded) {
+    that->postUsbEvent(ev);
+    d->pendingControls--;
+  } else {
+    d->pendingControls--;
+    that->postUsbEvent(ev);
+  }
+}
+
+void UsbTransport::postUsbEvent(const UsbEvent &ev) {
+  if (!threaded) {
+    dispatchUsbEvent(ev);
+  } else if (ring->push(ev)) {
+    uint64_t one = 1;
+    if (::write(eventFd, &one, sizeof(one)) < 0) {
+      // The counter can't overflow in practice
+    }
+  } else {
+    // The event loop has fallen far behind. Any held key eventually turns
+    // into a long press.
+    dropped++;
+    if (ev.transfer) {
+      libusb_free_transfer(ev.transfer);
+    }
+  }
+}
+
+void UsbTransport::drainUsbEvents() {
+  uint64_t count;
+  if (read(eventFd, &count, sizeof(count)) < 0) {
+    // Spurious wakeup
+  }
+  UsbEvent ev;
+  while (ring->pop(ev)) {
+    dispatchUsbEvent(ev);
+  }
+}
+
+void UsbTransport::dispatchUsbEvent(const UsbEvent &ev) {
+  // Runs on the event loop's thread
+  Device *d = findDevice(ev.ev.receiver);
+  if (ev.transfer) {
+    if (d) {
+      auto it = std::find(d->controls.begin(), d->controls.end(),
+                          ev.transfer);
+      if (it != d->controls.end()) {
+        d->controls.erase(it);
+      }
+    }
+    libusb_free_transfer(ev.transfer);
+  }
+  if (ev.retry && d) {
+    // Give the device one iteration of the event loop to recover
+    const int id = d->id;
+    event->runLater([this, id]() {
+      Device *d = findDevice(id);
+      if (d && d->reading) {
+        submitTransfers(d);
+      }
+    });
+  }
+  if (listener) {
+    listener(ev.ev);
+  }
+}
+
+void UsbTransport::runUsbThread() {
+  while (!stopping) {
+    struct timeval tv = { 0, 100*1000 };
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+}
+
+void UsbTransport::waitForUsb(const std::atomic<int> &pending) {
+  // Either wait for the USB thread to finish up, or handle events ourselves
+  while (pending) {
+    if (threaded) {
+      poll(0, 0, 1);
+    } else {
+      libusb_handle_events(ctx);
+    }
+  }
+}
+
+void UsbTransport::handleUsbPollFdEvent() {
+  struct timeval zero_tv = { };
+  libusb_handle_events_timeout(ctx, &zero_tv);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event.h"
+#include "ring.h"
+#include "transport.h"
+
+// Talks to Unifying receivers through libusb. The kernel driver gets
+// detached from the DJ interface, and a configurable number of interrupt
+// transfers are kept in flight on its endpoint, so that there is no gap
+// between consecutive reports. Transfers are allocated once, and get
+// resubmitted straight from the completion callback.
+// Optionally, libusb can be serviced from a dedicated thread. Completions
+// are then timestamped on that thread and handed to the event loop through
+// a lock-free queue, so slow callbacks can't hold up reading from the
+// receiver. Only the USB thread ever handles libusb events, which makes it
+// the queue's single producer; synchronous writes wait for it, too. Events
+// are always delivered on the event loop's thread.
+class UsbTransport : public Transport {
+ public:
+  UsbTransport(int numTransfers = USB_TRANSFERS, bool usbThread = false);
+  ~UsbTransport();
+  void start(Event *event, Listener listener) override;
+  void stop() override;
+  std::vector<std::string> scan() override;
+  bool open(const std::string &path, int id) override;
+  void close(int id) override;
+  void startReading(int id) override;
+  void stopReading(int id) override;
+  bool write(int id, const unsigned char *buf, int len, bool wait) override;
+  uint64_t getDropped() const override { return dropped; }
+
+ private:
+  enum {
+    USB_TRANSFERS         = 4,
+    USB_RING_SIZE         = 256,
+    USB_CONFIG_INDEX      = 0,
+    USB_DJ_INDEX          = 2,
+    USB_ALT_SETTING_INDEX = 0,
+    USB_ENDPOINT_INDEX    = 0,
+    USB_VENDOR_ID         = 0x46d,
+    USB_PRODUCT_ID        = 0xc52b,
+    USB_TIMEOUT           = 10*1000,
+  };
+
+  struct Device;
+
+  struct Transfer {
+    Device *device;
+    libusb_transfer *transfer;
+    std::atomic<bool> pending = { false };
+    unsigned char buffer[TransportEvent::MAX_LEN];
+  };
+
+  // Everything that libusb reports from its callbacks. With a USB thread,
+  // these get queued up for the event loop.
+  struct UsbEvent {
+    TransportEvent ev;
+    libusb_transfer *transfer;   // Control transfer, freed on dispatch
+    bool retry;                  // Resubmit reads from the event loop
+  };
+
+  struct Device {
+    UsbTransport *transport;
+    int id;
+    std::string path;
+    libusb_device_handle *handle;
+    libusb_config_descriptor *config;
+    const libusb_interface_descriptor *ifaceDJDesc;
+    std::vector<Transfer> transfers;
+    std::atomic<int> pendingTransfers = { 0 };
+    std::atomic<bool> cancelling = { false };
+    std::atomic<bool> reading = { false };
+    std::vector<libusb_transfer *> controls;
+    std::atomic<int> pendingControls = { 0 };
+  };
+
+  static std::string getDevicePath(libusb_device *dev);
+  static int hotplugAttach(libusb_context *ctx, libusb_device *dev,
+                           libusb_hotplug_event event, void *data);
+  static int hotplugDetach(libusb_context *ctx, libusb_device *dev,
+                           libusb_hotplug_event event, void *data);
+  static void transferCompleted(libusb_transfer *transfer);
+  static void controlCompleted(libusb_transfer *transfer);
+  static TransportEvent::Status getStatus(int status);
+  Device *findDevice(int id) const;
+  libusb_transfer *allocControl(Device *d, const unsigned char *buf,
+                                int len, libusb_transfer_cb_fn cb,
+                                void *data);
+  void submitTransfers(Device *d);
+  void cancelTransfers(Device *d);
+  void waitForUsb(const std::atomic<int> &pending);
+  void postUsbEvent(const UsbEvent &ev);
+  void dispatchUsbEvent(const UsbEvent &ev);
+  void drainUsbEvents();
+  void runUsbThread();
+  void handleUsbPollFdEvent();
+
+  Event *event = NULL;
+  Listener listener;
+  int numTransfers;
+  libusb_context *ctx = NULL;
+  libusb_hotplug_callback_handle hotplugHandleAttach = 0;
+  libusb_hotplug_callback_handle hotplugHandleDetach = 0;
+  std::map<int, Event::Handle> pollHandlers;
+  bool threaded;
+  std::thread usbThread;
+  std::atomic<bool> stopping = { false };
+  std::unique_ptr<Ring<UsbEvent, USB_RING_SIZE> > ring;
+  int eventFd = -1;
+  Event::Handle eventFdHandler;
+  std::atomic<uint64_t> dropped = { 0 };
+  std::map<int, Device *> devices;
+};
@@ -2,8 +2,17 @@
 
 #include "util.h"
 
-unsigned int Util::millis() {
+Nanos (*Util::clock)(void) = NULL;
+
+Nanos Util::nanos() {
+  if (clock) {
+    return clock();
+  }
   struct timespec spec;
   clock_gettime(CLOCK_MONOTONIC, &spec);
-  return(spec.tv_sec*1000 + spec.tv_nsec / 1000000);
+  return(spec.tv_sec*1000000000ull + spec.tv_nsec);
+}
+
+void Util::setClock(Nanos (*clock)(void)) {
+  Util::clock = clock;
 }
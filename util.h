@@ -1,6 +1,22 @@
 #pragma once
 
+#include <stdint.h>
+
+// Monotonic time in nanoseconds. At 64 bits, this doesn't wrap around in
+// practice. Code that compares two points in time should still look at the
+// signed difference, so that it keeps working with any starting value.
+typedef uint64_t Nanos;
+
+static const Nanos NANOS_PER_MS = 1000000;
+
 class Util {
  public:
-  static unsigned int millis();
+  static Nanos nanos();
+  // Replaces the system's monotonic clock, so that tests can simulate the
+  // passage of time (or wraparound) without having to wait. Passing NULL
+  // restores the default. Install the clock before starting any threads.
+  static void setClock(Nanos (*clock)(void));
+
+ private:
+  static Nanos (*clock)(void);
 };